@@ -0,0 +1,340 @@
+#include "cobra/asyncio/future_task.hh"
+#include "cobra/asyncio/stream.hh"
+#include "cobra/asyncio/stream_buffer.hh"
+#include "cobra/compress/deflate.hh"
+#include "cobra/print.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <string>
+#include <vector>
+
+#ifdef COBRA_BENCH_ZLIB
+#include <zlib.h>
+#endif
+
+// Runs every file of a corpus through each compression level and checks
+// that everything comes back out the same, see the bench-compress target.
+
+static std::atomic<std::size_t> allocations = 0;
+
+// Every replacement goes through these two. Keeping them out of line stops
+// gcc from seeing a free of a pointer that came from an inlined new.
+[[gnu::noinline]] static void* allocate(std::size_t size, std::size_t alignment) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	size = size ? size : 1;
+
+	void* ptr = alignment > alignof(std::max_align_t)
+					? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)
+					: std::malloc(size);
+
+	if (!ptr) {
+		throw std::bad_alloc();
+	}
+
+	return ptr;
+}
+
+[[gnu::noinline]] static void deallocate(void* ptr) noexcept {
+	std::free(ptr);
+}
+
+void* operator new(std::size_t size) {
+	return allocate(size, 0);
+}
+
+void* operator new[](std::size_t size) {
+	return allocate(size, 0);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+	return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+	return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* ptr) noexcept {
+	deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+	deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+	deallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+	deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+	deallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+	deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+	deallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+	deallocate(ptr);
+}
+
+namespace {
+	using namespace cobra;
+	using clock = std::chrono::steady_clock;
+
+	constexpr int bench_max_runs = 100;
+	constexpr double bench_seconds = 0.25;
+	constexpr std::size_t bench_read_size = 64 * 1024;
+	constexpr double megabyte = 1000.0 * 1000.0;
+
+	class string_ostream : public ostream_impl<string_ostream> {
+		std::string* _data;
+
+	public:
+		string_ostream(std::string& data) : _data(&data) {}
+
+		task<std::size_t> write(const char* data, std::size_t size) {
+			_data->append(data, size);
+			co_return size;
+		}
+
+		task<void> flush() {
+			co_return;
+		}
+	};
+
+	class string_istream : public istream_impl<string_istream> {
+		const std::string* _data;
+		std::size_t _index = 0;
+
+	public:
+		string_istream(const std::string& data) : _data(&data) {}
+
+		task<std::size_t> read(char* data, std::size_t size) {
+			size = std::min(size, _data->size() - _index);
+			std::copy(_data->data() + _index, _data->data() + _index + size, data);
+			_index += size;
+			co_return size;
+		}
+	};
+
+	struct measurement {
+		double seconds;
+		std::size_t allocations;
+	};
+
+	struct totals {
+		std::size_t size = 0;
+		std::size_t compressed = 0;
+		double compress_seconds = 0;
+		double decompress_seconds = 0;
+		std::size_t allocations = 0;
+	};
+
+	// Takes the fastest of as many runs as fit in bench_seconds, small
+	// inputs would otherwise be all noise and large ones take forever.
+	template <class Func>
+	measurement measure(Func func) {
+		measurement best{0, 0};
+		double total = 0;
+
+		for (int i = 0; i < bench_max_runs && (i == 0 || total < bench_seconds); i++) {
+			std::size_t before = allocations.load(std::memory_order_relaxed);
+			clock::time_point start = clock::now();
+			func();
+			std::chrono::duration<double> seconds = clock::now() - start;
+			total += seconds.count();
+
+			if (i == 0 || seconds.count() < best.seconds) {
+				best = {seconds.count(), allocations.load(std::memory_order_relaxed) - before};
+			}
+		}
+
+		return best;
+	}
+
+	void compress(const std::string& input, std::string& output, int level) {
+		output.clear();
+		deflate_ostream<string_ostream> stream(string_ostream(output), deflate_mode::zlib, level);
+		block_task(stream.write_all(input.data(), input.size()));
+		block_task(std::move(stream).end());
+	}
+
+	void decompress(const std::string& input, std::string& output) {
+		output.clear();
+		inflate_istream stream(istream_buffer(string_istream(input), bench_read_size), deflate_mode::zlib);
+		std::size_t size = 0;
+
+		while (true) {
+			output.resize(size + bench_read_size);
+			std::size_t count = block_task(stream.read(output.data() + size, bench_read_size));
+
+			if (count == 0) {
+				break;
+			}
+
+			size += count;
+		}
+
+		output.resize(size);
+	}
+
+	double rate(std::size_t size, double seconds) {
+		return seconds > 0 ? size / megabyte / seconds : 0;
+	}
+
+	double ratio(std::size_t size, std::size_t compressed) {
+		return compressed > 0 ? static_cast<double>(size) / compressed : 0;
+	}
+
+	double per_megabyte(std::size_t count, std::size_t size) {
+		return size > 0 ? count / (size / megabyte) : 0;
+	}
+
+	bool check(const std::string& name, int level, const char* what, const std::string& expected,
+			   const std::string& actual) {
+		if (expected != actual) {
+			eprintln("{}: level {}: {} does not match the input", name, level, what);
+			return false;
+		}
+
+		return true;
+	}
+
+#ifdef COBRA_BENCH_ZLIB
+	// Our fastest level still compresses, zlib's level 0 only stores
+	int zlib_level(int level) {
+		return std::max(level, Z_BEST_SPEED);
+	}
+
+	// Checks that zlib reads our output and that we read zlib output, and
+	// prints how zlib itself does at the same level.
+	bool check_zlib(const std::string& name, int level, const std::string& input, const std::string& compressed) {
+		std::string output(input.size(), '\0');
+		std::string reference(compressBound(input.size()), '\0');
+		uLongf output_size = output.size();
+		uLongf reference_size = reference.size();
+
+		if (uncompress(reinterpret_cast<Bytef*>(output.data()), &output_size,
+					   reinterpret_cast<const Bytef*>(compressed.data()), compressed.size()) != Z_OK) {
+			eprintln("{}: level {}: zlib cannot decompress the output", name, level);
+			return false;
+		}
+
+		output.resize(output_size);
+
+		if (!check(name, level, "zlib round trip", input, output)) {
+			return false;
+		}
+
+		measurement c = measure([&] {
+			reference_size = reference.size();
+			compress2(reinterpret_cast<Bytef*>(reference.data()), &reference_size,
+					  reinterpret_cast<const Bytef*>(input.data()), input.size(), zlib_level(level));
+		});
+
+		measurement d = measure([&] {
+			output_size = output.size();
+			uncompress(reinterpret_cast<Bytef*>(output.data()), &output_size,
+					   reinterpret_cast<const Bytef*>(reference.data()), reference_size);
+		});
+
+		reference.resize(reference_size);
+		decompress(reference, output);
+
+		if (!check(name, level, "decompressed zlib output", input, output)) {
+			return false;
+		}
+
+		println("   zlib  {:5.2f}  {:13.1f}  {:15.1f}", ratio(input.size(), reference.size()),
+				rate(input.size(), c.seconds), rate(input.size(), d.seconds));
+		return true;
+	}
+#endif
+} // namespace
+
+int main(int argc, char** argv) {
+	std::vector<totals> levels(lz_level_max + 1);
+	std::string compressed;
+	std::string decompressed;
+	bool ok = true;
+
+	if (argc < 2) {
+		eprintln("usage: {} file...", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (int i = 1; i < argc; i++) {
+		std::ifstream file(argv[i], std::ios::binary);
+
+		if (!file) {
+			eprintln("{}: cannot open file", argv[i]);
+			ok = false;
+			continue;
+		}
+
+		std::string input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		compressed.reserve(input.size() + input.size() / 8 + 1024);
+		decompressed.reserve(input.size() + bench_read_size);
+
+		println("{} ({} bytes)", argv[i], input.size());
+		println("  level  ratio  compress MB/s  decompress MB/s  allocs/MB");
+
+		for (int level = lz_level_fastest; level <= lz_level_max; level++) {
+			try {
+				measurement c = measure([&] { compress(input, compressed, level); });
+				measurement d = measure([&] { decompress(compressed, decompressed); });
+
+				ok = check(argv[i], level, "round trip", input, decompressed) && ok;
+
+				println("  {:5}  {:5.2f}  {:13.1f}  {:15.1f}  {:9.1f}", level, ratio(input.size(), compressed.size()),
+						rate(input.size(), c.seconds), rate(input.size(), d.seconds),
+						per_megabyte(c.allocations + d.allocations, input.size()));
+
+#ifdef COBRA_BENCH_ZLIB
+				ok = check_zlib(argv[i], level, input, compressed) && ok;
+#endif
+
+				levels[level].size += input.size();
+				levels[level].compressed += compressed.size();
+				levels[level].compress_seconds += c.seconds;
+				levels[level].decompress_seconds += d.seconds;
+				levels[level].allocations += c.allocations + d.allocations;
+			} catch (const std::exception& e) {
+				eprintln("{}: level {}: {}", argv[i], level, e.what());
+				ok = false;
+			} catch (...) {
+				eprintln("{}: level {}: round trip failed", argv[i], level);
+				ok = false;
+			}
+		}
+	}
+
+	println("total");
+	println("  level  ratio  compress MB/s  decompress MB/s  allocs/MB");
+
+	for (int level = lz_level_fastest; level <= lz_level_max; level++) {
+		const totals& total = levels[level];
+		println("  {:5}  {:5.2f}  {:13.1f}  {:15.1f}  {:9.1f}", level, ratio(total.size, total.compressed),
+				rate(total.size, total.compress_seconds), rate(total.size, total.decompress_seconds),
+				per_megabyte(total.allocations, total.size));
+	}
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
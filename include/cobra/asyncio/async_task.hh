@@ -30,7 +30,7 @@ namespace cobra {
 		}
 
 		~async_task() {
-			if (_handle.promise().destroy_flag().test_and_set()) {
+			if (_handle && _handle.promise().destroy_flag().test_and_set()) {
 				_handle.destroy();
 			}
 		}
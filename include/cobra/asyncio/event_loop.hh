@@ -15,6 +15,7 @@
 #include <mutex>
 #include <optional>
 #include <unordered_map>
+#include <vector>
 
 #ifdef COBRA_LINUX
 extern "C" {
@@ -40,6 +41,21 @@ namespace cobra {
 
 	poll_type operator!(poll_type type);
 
+	class event_loop;
+
+	// Hands jobs from any thread to the one that polls the event loop
+	class loop_executor : public executor {
+		std::reference_wrapper<event_loop> _loop;
+
+	public:
+		using executor::schedule;
+
+		loop_executor(event_loop& loop);
+
+		virtual void schedule(std::function<void()> func) override;
+		virtual bool has_jobs() override;
+	};
+
 	class event_loop {
 	public:
 		using event_pair = std::pair<int, poll_type>;
@@ -76,10 +92,26 @@ namespace cobra {
 		virtual void poll() = 0;
 		virtual bool has_events() const = 0;
 
+		// Wakes the loop up and runs func from its next poll, safe to call from any thread
+		void post(std::function<void()> func);
+		bool has_posted() const;
+
+		inline executor* post_executor() {
+			return &_post_exec;
+		}
+
+	protected:
+		std::vector<std::function<void()>> take_posted();
+
 	private:
+		mutable std::mutex _posted_mutex;
+		std::vector<std::function<void()>> _posted;
+		loop_executor _post_exec{*this};
+
 		virtual void schedule_event(event_pair event, std::optional<std::chrono::milliseconds> timeout,
 									event_type::handle_type& handle) = 0;
 		virtual void schedule_process_event(pid_t pid, process_event_type::handle_type& handle) = 0;
+		virtual void wake() = 0;
 	};
 
 #ifdef COBRA_LINUX
@@ -93,6 +125,7 @@ namespace cobra {
 
 	private:
 		file _epoll_fd;
+		file _wake_fd;
 		mutable std::mutex _mutex;
 		std::reference_wrapper<executor> _exec;
 
@@ -119,6 +152,7 @@ namespace cobra {
 		void schedule_event(event_pair event, std::optional<std::chrono::milliseconds> timeout,
 							event_type::handle_type& handle) override;
 		void schedule_process_event(pid_t pid, process_event_type::handle_type& handle) override;
+		void wake() override;
 
 		std::vector<epoll_event> epoll(std::size_t count, std::optional<clock::duration> timeout);
 		static generator<std::pair<int, poll_type>> convert(epoll_event event);
@@ -181,6 +215,7 @@ namespace cobra {
 		std::optional<std::reference_wrapper<kqueue_event_loop::future_type>> remove_event(event_pair event);
 		void schedule_event(event_pair event, std::optional<std::chrono::milliseconds> timeout,
 							event_type::handle_type& handle) override;
+		void wake() override;
 	};
 #endif
 
@@ -4,40 +4,159 @@
 #include "cobra/asyncio/stream.hh"
 #include "cobra/serde.hh"
 
+#include <algorithm>
+#include <bit>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
 
 namespace cobra {
 	template <AsyncInputStream Stream>
 	class bit_istream {
+		using char_type = typename Stream::char_type;
+
 		Stream _stream;
+		std::uint64_t _bits = 0;
 		std::size_t _count = 0;
-		std::uint8_t _data;
+		// Buffered streams are read ahead straight from their buffer, bytes
+		// are only consumed once the buffer runs out or the stream is ended.
+		const char_type* _buffer = nullptr;
+		std::size_t _size = 0;
+		std::size_t _pending = 0;
 
 	public:
+		constexpr static std::size_t max_peek = 56;
+
 		bit_istream(Stream&& stream) : _stream(std::move(stream)) {}
 
-		task<std::uintmax_t> read_bits(std::size_t size) {
-			std::uintmax_t value = 0;
-			std::size_t index = 0;
+		bit_istream(bit_istream&& other)
+			: _stream(std::move(other._stream)), _bits(other._bits), _count(std::exchange(other._count, 0)),
+			  _pending(std::exchange(other._pending, 0)) {}
+
+		bit_istream& operator=(bit_istream other) {
+			std::swap(_stream, other._stream);
+			std::swap(_bits, other._bits);
+			std::swap(_count, other._count);
+			std::swap(_buffer, other._buffer);
+			std::swap(_size, other._size);
+			std::swap(_pending, other._pending);
+			return *this;
+		}
+
+		inline std::size_t available() const {
+			return _count;
+		}
+
+		// Bits that have not been buffered yet read as zero
+		inline std::uint64_t peek_bits(std::size_t size) const {
+			assert(size <= max_peek);
+			return _bits & ((std::uint64_t(1) << size) - 1);
+		}
+
+		inline void drop_bits(std::size_t size) {
+			assert(size <= _count);
+			_bits >>= size;
+			_count -= size;
+		}
+
+		// Tops up the bit buffer from whatever the stream already has buffered
+		// without suspending, returns the number of bits available.
+		std::size_t refill() {
+			if constexpr (AsyncBufferedInputStream<Stream>) {
+				// A moved stream has to fill its buffer again before reading ahead
+				const std::size_t n = _pending < _size ? std::min((64 - _count) / 8, _size - _pending) : 0;
+
+				if (n > 0) {
+					std::uint64_t value = 0;
+
+					if (std::endian::native == std::endian::little && _size - _pending >= 8) {
+						std::memcpy(&value, _buffer + _pending, 8);
+					} else {
+						for (std::size_t i = 0; i < n; i++) {
+							value |= std::uint64_t(static_cast<std::uint8_t>(_buffer[_pending + i])) << (i * 8);
+						}
+					}
+
+					if (n < 8) {
+						value &= (std::uint64_t(1) << (n * 8)) - 1;
+					}
+
+					_bits |= value << _count;
+					_count += n * 8;
+					_pending += n;
+				}
+			}
 
-			while (index < size) {
-				std::size_t offset = _count % 8;
+			return _count;
+		}
+
+		// Buffers at least one more byte. Only bytes up to the last bit that is
+		// actually read are ever consumed from the stream.
+		task<void> fill() {
+			assert(_count <= max_peek);
+
+			if constexpr (AsyncBufferedInputStream<Stream>) {
+				const std::size_t count = _count;
+
+				while (refill() == count) {
+					if (_buffer) {
+						_stream.consume(_pending);
+						_pending = 0;
+					}
+
+					auto [buffer, size] = co_await _stream.fill_buf();
+
+					if (size == 0) {
+						throw stream_error::incomplete_read;
+					}
 
-				if (offset == 0) {
-					_data = co_await read_u8(_stream);
+					_buffer = buffer;
+					_size = size;
 				}
+			} else {
+				_bits |= std::uint64_t(co_await read_u8(_stream)) << _count;
+				_count += 8;
+			}
+		}
 
-				std::size_t count = std::min(8 - offset, size - index);
-				value |= ((_data >> offset) & ((1 << count) - 1)) << index;
-				index += count;
-				_count += count;
+		inline bool try_read_bits(std::size_t size, std::uintmax_t& value) {
+			if (_count < size && refill() < size) {
+				return false;
+			}
+
+			value = peek_bits(size);
+			drop_bits(size);
+			return true;
+		}
+
+		task<std::uintmax_t> read_bits(std::size_t size) {
+			std::uintmax_t value;
+
+			while (!try_read_bits(size, value)) {
+				co_await fill();
 			}
 
 			co_return value;
 		}
 
+		// Drops the bits left over in a partially read byte
+		inline void align() {
+			drop_bits(_count % 8);
+		}
+
 		Stream end() && {
+			if constexpr (AsyncBufferedInputStream<Stream>) {
+				// Whole bytes that were read ahead are left in the stream
+				assert(_count / 8 <= _pending);
+				_stream.consume(_pending - _count / 8);
+			} else {
+				assert(_count < 8);
+			}
+
+			_count = 0;
+			_pending = 0;
 			return std::move(_stream);
 		}
 	};
@@ -45,55 +164,146 @@ namespace cobra {
 	template <AsyncOutputStream Stream>
 	class bit_ostream {
 		Stream _stream;
+		std::uint64_t _bits = 0;
 		std::size_t _count = 0;
-		std::uint8_t _data = 0;
+
+		task<void> drain() {
+			char buffer[8];
+			const std::size_t size = _count / 8;
+
+			for (std::size_t i = 0; i < size; i++) {
+				buffer[i] = static_cast<char>(_bits >> (i * 8));
+			}
+
+			_bits = size == 8 ? 0 : _bits >> (size * 8);
+			_count -= size * 8;
+			co_await _stream.write_all(buffer, size);
+		}
 
 	public:
+		constexpr static std::size_t max_put = 56;
+
 		bit_ostream(Stream&& stream) : _stream(std::move(stream)) {}
 
 		bit_ostream(bit_ostream&& other)
-			: _stream(std::move(other._stream)), _count(std::exchange(other._count, 0)), _data(other._data) {}
+			: _stream(std::move(other._stream)), _bits(other._bits), _count(std::exchange(other._count, 0)) {}
 
 		~bit_ostream() {
-			assert(_count % 8 == 0);
+			assert(_count == 0);
 		}
 
 		bit_ostream& operator=(bit_ostream other) {
 			std::swap(_stream, other._stream);
+			std::swap(_bits, other._bits);
 			std::swap(_count, other._count);
-			std::swap(_data, other._data);
 			return *this;
 		}
 
-		task<void> write_bits(std::uintmax_t value, std::size_t size) {
-			while (size > 0) {
-				std::size_t offset = _count % 8;
-				std::size_t count = std::min(8 - offset, size);
-				_data |= (value & ((1 << count) - 1)) << offset;
-				value >>= count;
-				size -= count;
-				_count += count;
-
-				if (_count % 8 == 0) {
-					co_await write_u8(_stream, _data);
-					_data = 0;
-				}
+		// Returns false if the bits do not fit before the buffer is drained
+		inline bool try_write_bits(std::uint64_t value, std::size_t size) {
+			assert(size <= max_put);
+
+			if (_count + size > 64) {
+				return false;
 			}
 
-			co_return;
+			if (size > 0) {
+				_bits |= (value & ((std::uint64_t(1) << size) - 1)) << _count;
+				_count += size;
+			}
+
+			return true;
+		}
+
+		task<void> write_bits(std::uintmax_t value, std::size_t size) {
+			if (!try_write_bits(value, size)) {
+				co_await drain();
+				try_write_bits(value, size);
+			}
 		}
 
 		task<void> flush() {
-			return _stream.flush();
+			co_await drain();
+			co_await _stream.flush();
 		}
 
 		task<Stream> end() && {
-			if (_count % 8 != 0) {
-				co_await write_u8(_stream, _data);
-				_count = 0;
+			_count = (_count + 7) / 8 * 8;
+			co_await drain();
+			co_return std::move(_stream);
+		}
+	};
+
+	// Collects bits in memory without suspending, whole bytes can then be
+	// handed to a stream in one go.
+	class bit_buffer {
+		std::vector<char> _data;
+		std::uint64_t _bits = 0;
+		std::size_t _count = 0;
+
+	public:
+		constexpr static std::size_t max_put = 56;
+
+		inline void write_bits(std::uint64_t value, std::size_t size) {
+			assert(size <= max_put);
+
+			// A full register would make even a write of no bits shift by 64
+			if (_count + size >= 64) {
+				drain();
 			}
 
-			co_return std::move(_stream);
+			_bits |= (value & ((std::uint64_t(1) << size) - 1)) << _count;
+			_count += size;
+		}
+
+		// Moves all whole bytes into the data buffer
+		void drain() {
+			char buffer[8];
+			const std::size_t size = _count / 8;
+
+			for (std::size_t i = 0; i < size; i++) {
+				buffer[i] = static_cast<char>(_bits >> (i * 8));
+			}
+
+			_data.insert(_data.end(), buffer, buffer + size);
+			_bits = size == 8 ? 0 : _bits >> (size * 8);
+			_count -= size * 8;
+		}
+
+		// Pads the last byte with zeros
+		void align() {
+			_count = (_count + 7) / 8 * 8;
+			drain();
+		}
+
+		// Only valid on a byte boundary, right after align or drain
+		inline void write_bytes(const char* data, std::size_t size) {
+			assert(_count == 0);
+			_data.insert(_data.end(), data, data + size);
+		}
+
+		// Forgets the drained bytes, bits of an incomplete byte are kept
+		inline void clear() {
+			_data.clear();
+		}
+
+		// Forgets everything but keeps the memory around
+		inline void reset() {
+			_data.clear();
+			_bits = 0;
+			_count = 0;
+		}
+
+		inline const char* data() const {
+			return _data.data();
+		}
+
+		inline std::size_t size() const {
+			return _data.size();
+		}
+
+		inline bool empty() const {
+			return _data.empty() && _count == 0;
 		}
 	};
 } // namespace cobra
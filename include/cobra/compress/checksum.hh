@@ -0,0 +1,33 @@
+#ifndef COBRA_COMPRESS_CHECKSUM_HH
+#define COBRA_COMPRESS_CHECKSUM_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace cobra {
+	constexpr std::uint32_t adler32_init = 1;
+	constexpr std::uint32_t crc32_init = 0;
+
+	// Both continue from a previous checksum like their zlib counterparts, the
+	// fastest kernel the cpu supports is picked the first time either is used.
+	std::uint32_t adler32(std::uint32_t adler, const void* data, std::size_t size);
+	std::uint32_t crc32(std::uint32_t crc, const void* data, std::size_t size);
+
+	// Checksum of two concatenated pieces of data given the checksum of each
+	// piece and the size of the second one.
+	std::uint32_t adler32_combine(std::uint32_t adler1, std::uint32_t adler2, std::uint64_t size2);
+	std::uint32_t crc32_combine(std::uint32_t crc1, std::uint32_t crc2, std::uint64_t size2);
+
+	struct checksum_variant {
+		const char* name;
+		std::uint32_t (*update)(std::uint32_t checksum, const void* data, std::size_t size);
+	};
+
+	// Every kernel the cpu can run, called like adler32 and crc32, so all of
+	// them can be tested and not only the one that ends up being picked.
+	std::vector<checksum_variant> adler32_variants();
+	std::vector<checksum_variant> crc32_variants();
+} // namespace cobra
+
+#endif
@@ -2,11 +2,18 @@
 #define COBRA_COMPRESS_DEFLATE_HH
 
 #include "cobra/compress/bit_stream.hh"
+#include "cobra/compress/checksum.hh"
+#include "cobra/compress/entropy.hh"
 #include "cobra/compress/lz.hh"
+#include "cobra/compress/state_pool.hh"
 #include "cobra/compress/stream_ringbuffer.hh"
 #include "cobra/compress/tree.hh"
 
 #include <bit>
+#include <limits>
+#include <optional>
+#include <span>
+#include <string>
 
 #define COBRA_DEFLATE_NONE 0
 #define COBRA_DEFLATE_FIXED 1
@@ -38,8 +45,40 @@ namespace cobra {
 	enum class deflate_mode {
 		raw,
 		zlib,
+		gzip,
 	};
 
+	constexpr std::uint8_t gzip_flag_hcrc = 0x02;
+	constexpr std::uint8_t gzip_flag_extra = 0x04;
+	constexpr std::uint8_t gzip_flag_name = 0x08;
+	constexpr std::uint8_t gzip_flag_comment = 0x10;
+
+	constexpr std::uint32_t checksum_init(deflate_mode mode) {
+		return mode == deflate_mode::gzip ? crc32_init : adler32_init;
+	}
+
+	inline std::uint32_t checksum_update(deflate_mode mode, std::uint32_t checksum, const void* data,
+										 std::size_t size) {
+		if (mode == deflate_mode::zlib) {
+			return adler32(checksum, data, size);
+		} else if (mode == deflate_mode::gzip) {
+			return crc32(checksum, data, size);
+		} else {
+			return checksum;
+		}
+	}
+
+	inline std::uint32_t checksum_combine(deflate_mode mode, std::uint32_t checksum1, std::uint32_t checksum2,
+										  std::uint64_t size2) {
+		if (mode == deflate_mode::zlib) {
+			return adler32_combine(checksum1, checksum2, size2);
+		} else if (mode == deflate_mode::gzip) {
+			return crc32_combine(checksum1, checksum2, size2);
+		} else {
+			return checksum1;
+		}
+	}
+
 	template <AsyncInputStream Stream>
 	class inflate_istream : public istream_ringbuffer<inflate_istream<Stream>> {
 		using base = istream_ringbuffer<inflate_istream<Stream>>;
@@ -65,12 +104,33 @@ namespace cobra {
 		bool _final = false;
 		deflate_mode _mode;
 		bool _read_header = false;
+		bool _read_trailer = false;
+		std::uint32_t _checksum;
+		std::uint32_t _total = 0;
+		std::size_t _checked = 0;
+		char* _direct = nullptr;
+		std::size_t _direct_size = 0;
+		std::size_t _direct_limit = 0;
+
+		struct extra_code {
+			std::uint16_t base;
+			std::uint16_t extra;
+		};
 
-		static task<std::uint16_t> decode(bit_istream<Stream>& stream, std::uint16_t code, std::uint16_t stride) {
+		// Longest literal/length code with extra bits plus distance code with
+		// extra bits, a symbol can be decoded without suspending when this many
+		// bits are buffered.
+		constexpr static std::size_t fast_bits = 15 + 5 + 15 + 13;
+		constexpr static std::size_t window_size = 32768;
+		// Smaller reads are served from the window, decoding straight into
+		// them would mean going through the state machine for every few bytes.
+		constexpr static std::size_t direct_min = 4096;
+
+		static extra_code decode(std::uint16_t code, std::uint16_t stride) {
 			std::uint16_t extra_bits = code / stride;
 			std::uint16_t block_offset = (stride << extra_bits) - stride;
 			std::uint16_t start_offset = (code % stride) << extra_bits;
-			co_return start_offset + block_offset + co_await stream.read_bits(extra_bits);
+			return {static_cast<std::uint16_t>(start_offset + block_offset), extra_bits};
 		}
 
 		static task<std::size_t> decode_code(bit_istream<Stream>& stream, std::uint8_t code) {
@@ -85,44 +145,214 @@ namespace cobra {
 			}
 		}
 
-		static task<std::uint16_t> decode_size(bit_istream<Stream>& stream, std::uint16_t code) {
+		static extra_code decode_size(std::uint16_t code) {
 			if (code >= 286) {
 				throw compress_error::bad_size_code;
 			} else if (code == 285) {
-				co_return 258;
+				return {258, 0};
 			} else if (code < 261) {
-				co_return code - 257 + 3;
+				return {static_cast<std::uint16_t>(code - 257 + 3), 0};
 			} else {
-				co_return co_await decode(stream, code - 261, 4) + 7;
+				extra_code result = decode(code - 261, 4);
+				result.base += 7;
+				return result;
 			}
 		}
 
-		static task<std::uint16_t> decode_dist(bit_istream<Stream>& stream, std::uint16_t code) {
+		static extra_code decode_dist(std::uint16_t code) {
 			if (code >= 30) {
 				throw compress_error::bad_dist_code;
 			} else if (code < 2) {
-				co_return code + 1;
+				return {static_cast<std::uint16_t>(code + 1), 0};
 			} else {
-				co_return co_await decode(stream, code - 2, 2) + 3;
+				extra_code result = decode(code - 2, 2);
+				result.base += 3;
+				return result;
 			}
 		}
 
-	public:
-		inflate_istream(Stream&& stream, deflate_mode mode = deflate_mode::raw)
-			: base(32768), _state(state_init{bit_istream(std::move(stream))}), _mode(mode) {}
+		// Output goes to the window, or straight to the caller during read
+		bool full() const {
+			return _direct ? _direct_size >= _direct_limit : base::full();
+		}
 
-		task<void> fill_ringbuf() {
-			while (!base::full()) {
+		void read_literal(std::uint16_t code) {
+			char c = std::char_traits<char>::to_char_type(code);
+
+			if (_direct) {
+				_direct[_direct_size++] = c;
+			} else {
+				base::write(&c, 1);
+			}
+		}
+
+		std::size_t copy(std::size_t dist, std::size_t size) {
+			if (!_direct) {
+				return base::copy(dist, size);
+			}
+
+			if (dist > window_size) {
+				throw compress_error::short_buffer;
+			}
+
+			char* out = _direct + _direct_size;
+			size = std::min(size, _direct_limit - _direct_size);
+			std::size_t index = 0;
+
+			if (dist > _direct_size) {
+				// The match starts in data returned by earlier reads
+				index = base::copy_out(dist - _direct_size, out, size);
+			}
+
+			copy_match(out + index, dist, size - index);
+			_direct_size += size;
+			return size;
+		}
+
+		task<std::size_t> write_stored(Stream& stream, std::size_t size) {
+			if (!_direct) {
+				co_return co_await base::write(stream, size);
+			}
+
+			std::size_t limit = std::min(size, _direct_limit - _direct_size);
+			limit = std::min(limit, co_await stream.read(_direct + _direct_size, limit));
+
+			if (limit == 0 && size != 0) {
+				throw stream_error::incomplete_read;
+			}
+
+			_direct_size += limit;
+			co_return limit;
+		}
+
+		// Decodes a whole symbol without suspending, only possible when enough
+		// bits could be buffered.
+		bool try_read_symbol(state_read& state) {
+			if (state.stream.refill() < fast_bits) {
+				return false;
+			}
+
+			std::uint16_t code = 0;
+			std::uintmax_t extra = 0;
+
+			// None of these can run out of bits
+			state.lt.try_read(state.stream, code);
+
+			if (code < 256) {
+				read_literal(code);
+			} else if (code == 256) {
+				_state = state_init{std::move(state.stream)};
+			} else {
+				extra_code size = decode_size(code);
+				state.stream.try_read_bits(size.extra, extra);
+				state.size = size.base + extra;
+
+				if (state.dt) {
+					state.dt->try_read(state.stream, code);
+				} else {
+					state.stream.try_read_bits(5, extra);
+					code = reverse(extra, 5);
+				}
+
+				extra_code dist = decode_dist(code);
+				state.stream.try_read_bits(dist.extra, extra);
+				state.dist = dist.base + extra;
+			}
+
+			return true;
+		}
+
+		task<void> read_header(bit_istream<Stream>& stream) {
+			if (_mode == deflate_mode::zlib) {
+				std::uint8_t cmf = co_await stream.read_bits(8);
+				std::uint8_t flg = co_await stream.read_bits(8);
+
+				if ((cmf & 0x0F) != 8 || (cmf >> 4) > 7 || ((cmf << 8) | flg) % 31 != 0) {
+					throw compress_error::bad_header;
+				}
+
+				if (flg & 0x20) {
+					// Preset dictionaries
+					throw compress_error::unsupported;
+				}
+			} else if (_mode == deflate_mode::gzip) {
+				if (co_await stream.read_bits(16) != 0x8B1F || co_await stream.read_bits(8) != 8) {
+					throw compress_error::bad_header;
+				}
+
+				std::uint8_t flg = co_await stream.read_bits(8);
+
+				if (flg & 0xE0) {
+					throw compress_error::bad_header;
+				}
+
+				// Modification time, extra flags and operating system
+				co_await stream.read_bits(32);
+				co_await stream.read_bits(16);
+
+				if (flg & gzip_flag_extra) {
+					std::size_t xlen = co_await stream.read_bits(16);
+
+					while (xlen-- > 0) {
+						co_await stream.read_bits(8);
+					}
+				}
+
+				if (flg & gzip_flag_name) {
+					while (co_await stream.read_bits(8) != 0) {}
+				}
+
+				if (flg & gzip_flag_comment) {
+					while (co_await stream.read_bits(8) != 0) {}
+				}
+
+				if (flg & gzip_flag_hcrc) {
+					co_await stream.read_bits(16);
+				}
+			}
+		}
+
+		task<void> read_trailer(bit_istream<Stream>& stream) {
+			stream.align();
+
+			if (_mode == deflate_mode::zlib) {
+				std::uint32_t adler = 0;
+
+				for (int i = 0; i < 4; i++) {
+					adler = (adler << 8) | co_await stream.read_bits(8);
+				}
+
+				if (adler != _checksum) {
+					throw compress_error::bad_checksum;
+				}
+			} else if (_mode == deflate_mode::gzip) {
+				std::uint32_t crc = co_await stream.read_bits(32);
+				std::uint32_t size = co_await stream.read_bits(32);
+
+				if (crc != _checksum || size != _total) {
+					throw compress_error::bad_checksum;
+				}
+			}
+		}
+
+		task<void> finish() {
+			if (_final && !_read_trailer) {
+				if (auto* state = std::get_if<state_init>(&_state)) {
+					co_await read_trailer(state->stream);
+					_read_trailer = true;
+				}
+			}
+		}
+
+		task<void> inflate() {
+			while (!full()) {
 				if (auto* state = std::get_if<state_init>(&_state)) {
 					if (_final) {
 						co_return;
 					}
 
 					if (!_read_header) {
-						if (_mode == deflate_mode::zlib) {
-							throw compress_error::unsupported;
-						}
-
+						co_await read_header(state->stream);
 						_read_header = true;
 					}
 
@@ -140,7 +370,7 @@ namespace cobra {
 
 						_state = state_write{std::move(stream), len};
 					} else if (type == COBRA_DEFLATE_FIXED) {
-						inflate_ltree lt(fixed_tree.data(), fixed_tree.size());
+						static const inflate_ltree lt(fixed_tree.data(), fixed_tree.size());
 
 						_state = state_read{std::move(state->stream), lt, std::nullopt, 0, 0};
 					} else if (type == COBRA_DEFLATE_DYNAMIC) {
@@ -188,35 +418,91 @@ namespace cobra {
 						throw compress_error::bad_block_type;
 					}
 				} else if (auto* state = std::get_if<state_write>(&_state)) {
-					state->limit -= co_await base::write(state->stream, state->limit);
+					state->limit -= co_await write_stored(state->stream, state->limit);
 
 					if (state->limit == 0) {
 						_state = state_init{bit_istream(std::move(state->stream))};
 					}
 				} else if (auto* state = std::get_if<state_read>(&_state)) {
 					if (state->size > 0) {
-						state->size -= base::copy(state->dist, state->size);
-					} else {
+						state->size -= copy(state->dist, state->size);
+					} else if (!try_read_symbol(*state)) {
 						std::uint16_t code = co_await state->lt.read(state->stream);
 
 						if (code < 256) {
-							char c = std::char_traits<char>::to_char_type(code);
-							base::write(&c, 1);
+							read_literal(code);
 						} else if (code == 256) {
 							_state = state_init{std::move(state->stream)};
 						} else {
-							state->size = co_await decode_size(state->stream, code);
-							code = state->dt ? co_await state->dt->read(state->stream)
-											 : reverse(co_await state->stream.read_bits(5), 5);
-							state->dist = co_await decode_dist(state->stream, code);
+							extra_code size = decode_size(code);
+							state->size = size.base + co_await state->stream.read_bits(size.extra);
+
+							if (state->dt) {
+								code = co_await state->dt->read(state->stream);
+							} else {
+								code = reverse(co_await state->stream.read_bits(5), 5);
+							}
+
+							extra_code dist = decode_dist(code);
+							state->dist = dist.base + co_await state->stream.read_bits(dist.extra);
 						}
 					}
 				}
 			}
 		}
 
+	public:
+		inflate_istream(Stream&& stream, deflate_mode mode = deflate_mode::raw)
+			: base(window_size), _state(state_init{bit_istream(std::move(stream))}), _mode(mode),
+			  _checksum(checksum_init(mode)) {}
+
+		task<void> fill_ringbuf() {
+			co_await inflate();
+
+			if (_mode != deflate_mode::raw) {
+				// Everything produced by a single fill still fits in the window
+				_checked = base::written(_checked, [this](const char* data, std::size_t size) {
+					_checksum = checksum_update(_mode, _checksum, data, size);
+					_total += size;
+				});
+			}
+
+			co_await finish();
+		}
+
+		// Large reads are decoded straight into data instead of going through
+		// the window first, which then only keeps a copy of the last 32 KiB.
+		task<std::size_t> read(char* data, std::size_t size) {
+			if (!base::empty() || size < direct_min) {
+				co_return co_await base::read(data, size);
+			}
+
+			_direct = data;
+			_direct_limit = size;
+
+			try {
+				co_await inflate();
+			} catch (...) {
+				_direct = nullptr;
+				throw;
+			}
+
+			std::size_t count = std::exchange(_direct_size, 0);
+			_direct = nullptr;
+			base::append(data, count);
+
+			if (_mode != deflate_mode::raw) {
+				_checksum = checksum_update(_mode, _checksum, data, count);
+				_total += count;
+				_checked += count;
+			}
+
+			co_await finish();
+			co_return count;
+		}
+
 		Stream end() && {
-			if (_final) {
+			if (_read_trailer) {
 				if (auto* state = std::get_if<state_init>(&_state)) {
 					return std::move(state->stream).end();
 				}
@@ -226,15 +512,142 @@ namespace cobra {
 		}
 	};
 
+	constexpr auto fixed_dist_tree = [] {
+		std::array<std::size_t, 32> tree;
+		tree.fill(5);
+		return tree;
+	}();
+
+	inline const deflate_ltree& fixed_ltree() {
+		static const deflate_ltree tree(fixed_tree.data(), fixed_tree.size());
+		return tree;
+	}
+
+	inline const deflate_dtree& fixed_dtree() {
+		static const deflate_dtree tree(fixed_dist_tree.data(), fixed_dist_tree.size());
+		return tree;
+	}
+
+	// Ends a block early once the most recent symbols look too different
+	// from the ones in the block so far, using the same coarse symbol
+	// classes and cutoff as libdeflate.
+	class deflate_block_split {
+		constexpr static std::size_t literal_types = 8;
+		constexpr static std::size_t match_types = 2;
+		constexpr static std::size_t check_interval = 512;
+
+		std::array<std::uint32_t, literal_types + match_types> _observations;
+		std::array<std::uint32_t, literal_types + match_types> _new_observations;
+		std::uint32_t _count;
+		std::uint32_t _new_count;
+
+		void merge() {
+			for (std::size_t i = 0; i < _observations.size(); i++) {
+				_observations[i] += _new_observations[i];
+				_new_observations[i] = 0;
+			}
+
+			_count += _new_count;
+			_new_count = 0;
+		}
+
+	public:
+		deflate_block_split() {
+			reset();
+		}
+
+		void reset() {
+			_observations.fill(0);
+			_new_observations.fill(0);
+			_count = 0;
+			_new_count = 0;
+		}
+
+		inline void observe_literal(std::uint8_t ch) {
+			_new_observations[((ch >> 5) & 0x6) | (ch & 1)] += 1;
+			_new_count += 1;
+		}
+
+		inline void observe_match(std::size_t length) {
+			_new_observations[literal_types + (length >= 9)] += 1;
+			_new_count += 1;
+		}
+
+		inline bool ready() const {
+			return _new_count >= check_interval;
+		}
+
+		// Takes the size of the block in bytes so far
+		bool should_end(std::size_t size) {
+			if (_count > 0) {
+				std::uint64_t delta = 0;
+
+				for (std::size_t i = 0; i < _observations.size(); i++) {
+					std::uint64_t expected = std::uint64_t(_observations[i]) * _new_count;
+					std::uint64_t actual = std::uint64_t(_new_observations[i]) * _count;
+					delta += expected > actual ? expected - actual : actual - expected;
+				}
+
+				const std::uint64_t items = _count + _new_count;
+				std::uint64_t cutoff = std::uint64_t(_new_count) * 200 / 512 * _count;
+
+				// Small blocks are more likely to look different by chance
+				if (size < 10000 && items < 8192) {
+					cutoff += cutoff * (8192 - items) / 8192;
+				}
+
+				if (delta + (size / 4096) * _count >= cutoff) {
+					return true;
+				}
+			}
+
+			merge();
+			return false;
+		}
+	};
+
+	// Buffers of a deflate_ostream_impl, kept in a state_pool between streams
+	struct deflate_state {
+		bit_buffer buffer;
+		std::vector<lz_command> commands;
+		// Input of the current block, so it can still be stored as is when that
+		// turns out smaller.
+		std::vector<char> raw;
+		// Scratch space for planting the trees of dynamic blocks
+		deflate_ltree::workspace ltree_workspace;
+		deflate_dtree::workspace dtree_workspace;
+		deflate_ctree::workspace ctree_workspace;
+
+		inline bool reusable() const {
+			return true;
+		}
+
+		void reset() {
+			buffer.reset();
+			commands.clear();
+			raw.clear();
+		}
+	};
+
 	template <AsyncOutputStream Stream>
 	class deflate_ostream_impl {
-		bit_ostream<Stream> _stream;
-		std::vector<lz_command> _commands;
+		Stream _stream;
+		std::unique_ptr<deflate_state> _state;
 		std::array<std::size_t, 288> _size_weight;
 		std::array<std::size_t, 32> _dist_weight;
+		deflate_block_split _split;
+		std::size_t _block_size = 0;
 		deflate_mode _mode;
 		bool _wrote_header = false;
 
+		constexpr static std::size_t max_block_commands = 32768;
+		// Bounds the raw bytes kept for a block that compresses very well
+		constexpr static std::size_t max_block_size = 256 * 1024;
+		// Blocks are not split before they are this big
+		constexpr static std::size_t min_block_size = 4096;
+		// Smaller blocks are never worth the header of a dynamic block
+		constexpr static std::size_t min_dynamic_commands = 20;
+
 		struct token {
 			std::uint16_t code;
 			std::uint16_t extra;
@@ -282,60 +695,180 @@ namespace cobra {
 			}
 		}
 
+		// Match lengths are looked up instead of encoded for every command
+		static const std::array<token, 259>& size_tokens() {
+			static const std::array<token, 259> tokens = [] {
+				std::array<token, 259> tokens{};
+
+				for (std::uint16_t size = 3; size <= 258; size++) {
+					tokens[size] = encode_size(size);
+				}
+
+				return tokens;
+			}();
+
+			return tokens;
+		}
+
+		struct fixed_code {
+			std::uint32_t bits;
+			std::uint32_t size;
+		};
+
+		// Every match length under the fixed tree with its extra bits attached
+		static const std::array<fixed_code, 259>& fixed_size_codes() {
+			static const std::array<fixed_code, 259> codes = [] {
+				std::array<fixed_code, 259> codes{};
+
+				for (std::uint16_t size = 3; size <= 258; size++) {
+					const token& size_token = size_tokens()[size];
+					const std::uint32_t code_size = fixed_ltree().cost(size_token.code);
+					codes[size] = {fixed_ltree().code(size_token.code) | std::uint32_t(size_token.value) << code_size,
+								   code_size + size_token.extra};
+				}
+
+				return codes;
+			}();
+
+			return codes;
+		}
+
+		// Length codes start at 257, distance codes at 0
+		static std::size_t size_extra_bits(std::size_t code) {
+			return code < 265 || code == 285 ? 0 : (code - 261) / 4;
+		}
+
+		static std::size_t dist_extra_bits(std::size_t code) {
+			return code < 4 ? 0 : (code - 2) / 2;
+		}
+
 		void reset() {
 			std::fill(_size_weight.begin(), _size_weight.end(), 0);
 			std::fill(_dist_weight.begin(), _dist_weight.end(), 0);
-			_commands.clear();
+			_state->commands.clear();
+			_split.reset();
 			_size_weight[256] += 1;
+			_state->raw.clear();
+			_block_size = 0;
+		}
+
+		inline std::size_t block_size() const {
+			return _block_size;
 		}
 
-		task<void> write_block(const deflate_ltree* lt, const deflate_dtree* dt) {
-			for (const lz_command& command : _commands) {
+		std::size_t extra_cost() const {
+			std::size_t bits = 0;
+
+			for (std::size_t code = 257; code < 286; code++) {
+				bits += _size_weight[code] * size_extra_bits(code);
+			}
+
+			for (std::size_t code = 0; code < 30; code++) {
+				bits += _dist_weight[code] * dist_extra_bits(code);
+			}
+
+			return bits;
+		}
+
+		std::size_t stored_cost() const {
+			// Block type and padding to a byte boundary are estimated at a byte
+			const std::size_t blocks = std::max<std::size_t>(1, (block_size() + 65534) / 65535);
+			return blocks * (8 + 32) + block_size() * 8;
+		}
+
+		std::size_t fixed_cost() const {
+			return 3 + fixed_ltree().cost(_size_weight.data(), 288) + fixed_dtree().cost(_dist_weight.data(), 32) +
+				   extra_cost();
+		}
+
+		void write_block(const deflate_ltree* lt, const deflate_dtree* dt) {
+			const std::array<token, 259>& sizes = size_tokens();
+
+			for (const lz_command& command : _state->commands) {
 				if (command.is_literal()) {
-					co_await lt->write(_stream, command.ch());
+					lt->write(_state->buffer, command.ch());
 				} else {
 					assert(command.length() >= 3);
 					assert(command.dist() >= 1);
 
-					token size_token = encode_size(command.length());
-					co_await lt->write(_stream, size_token.code);
-					co_await _stream.write_bits(size_token.value, size_token.extra);
+					const token& size_token = sizes[command.length()];
+					lt->write(_state->buffer, size_token.code);
+					_state->buffer.write_bits(size_token.value, size_token.extra);
 					token dist_token = encode_dist(command.dist());
 
-					if (dt) {
-						co_await dt->write(_stream, dist_token.code);
-					} else {
-						co_await _stream.write_bits(reverse(dist_token.code, 5), 5);
-					}
+					dt->write(_state->buffer, dist_token.code);
 
-					co_await _stream.write_bits(dist_token.value, dist_token.extra);
+					_state->buffer.write_bits(dist_token.value, dist_token.extra);
 				}
 			}
 
-			co_await lt->write(_stream, 256);
+			lt->write(_state->buffer, 256);
 
 			reset();
 		}
 
-		task<void> flush_block(bool end) {
+		// Writes each match with a single call, distance codes are all five bits
+		void write_fixed_block() {
+			const std::array<fixed_code, 259>& sizes = fixed_size_codes();
+			const deflate_ltree& lt = fixed_ltree();
+			const deflate_dtree& dt = fixed_dtree();
+
+			for (const lz_command& command : _state->commands) {
+				if (command.is_literal()) {
+					lt.write(_state->buffer, command.ch());
+				} else {
+					assert(command.length() >= 3);
+					assert(command.dist() >= 1);
+
+					const fixed_code& size_code = sizes[command.length()];
+					const token dist_token = encode_dist(command.dist());
+					const std::uint64_t dist_bits = dt.code(dist_token.code) | std::uint64_t(dist_token.value) << 5;
+
+					_state->buffer.write_bits(size_code.bits | dist_bits << size_code.size,
+											  size_code.size + 5 + dist_token.extra);
+				}
+			}
+
+			lt.write(_state->buffer, 256);
+
+			reset();
+		}
+
+		void write_header() {
 			if (!_wrote_header) {
 				if (_mode == deflate_mode::zlib) {
-					co_await _stream.write_bits(0x78, 8);
-					co_await _stream.write_bits(0x9C, 8);
+					_state->buffer.write_bits(0x78, 8);
+					_state->buffer.write_bits(0x9C, 8);
+				} else if (_mode == deflate_mode::gzip) {
+					// No flags, no modification time and an unknown operating system
+					_state->buffer.write_bits(0x088B1F, 24);
+					_state->buffer.write_bits(0, 48);
+					_state->buffer.write_bits(0xFF, 8);
 				}
 
 				_wrote_header = true;
 			}
+		}
 
-			if (_commands.size() >= 20) {
-				deflate_ltree lt = deflate_ltree::plant(_size_weight.data(), 288);
-				deflate_dtree dt = deflate_dtree::plant(_dist_weight.data(), 32);
+		struct dynamic_block {
+			deflate_ltree lt;
+			deflate_dtree dt;
+			std::optional<deflate_ctree> ct;
+			std::array<token, 320> code_code;
+			std::size_t code_size = 0;
+			std::array<std::size_t, 19> lc;
+			std::size_t hl;
+			std::size_t hd;
+			std::size_t hc;
+
+			dynamic_block(deflate_state& state, const std::size_t* size_weight, const std::size_t* dist_weight)
+				: lt(deflate_ltree::plant(size_weight, 288, state.ltree_workspace)),
+				  dt(deflate_dtree::plant(dist_weight, 32, state.dtree_workspace)) {
 				std::array<std::size_t, 320> l;
 				std::array<std::size_t, 19> code_weight;
-				std::array<token, 320> code_code;
-				std::size_t code_size = 0;
-				std::size_t hl = lt.get_size(l.data(), nullptr);
-				std::size_t hd = dt.get_size(l.data() + hl, nullptr);
+
+				hl = lt.get_size(l.data(), nullptr);
+				hd = dt.get_size(l.data() + hl, nullptr);
 
 				for (std::size_t i = 0, n, m; i < hl + hd; i += m) {
 					for (n = 1; i + n < hl + hd && l[i] == l[i + n]; n++)
@@ -370,81 +903,189 @@ namespace cobra {
 					code_weight[code_code[i].code] += 1;
 				}
 
-				deflate_ctree ct = deflate_ctree::plant(code_weight.data(), 19);
-				std::array<std::size_t, 19> lc;
-				std::size_t hc = ct.get_size(lc.data(), frobnication_table.data());
+				ct.emplace(deflate_ctree::plant(code_weight.data(), 19, state.ctree_workspace));
+				hc = ct->get_size(lc.data(), frobnication_table.data());
 
 				assert(hl >= 257 && "bad hl");
 				assert(hd >= 1 && "bad hd");
 				assert(hc >= 4 && "bad hc");
+			}
+
+			std::size_t header_cost() const {
+				std::size_t bits = 3 + 5 + 5 + 4 + 3 * hc;
 
-				co_await _stream.write_bits(end ? 1 : 0, 1);
-				co_await _stream.write_bits(2, 2);
-				co_await _stream.write_bits(hl - 257, 5);
-				co_await _stream.write_bits(hd - 1, 5);
-				co_await _stream.write_bits(hc - 4, 4);
+				for (std::size_t i = 0; i < code_size; i++) {
+					bits += ct->cost(code_code[i].code) + code_code[i].extra;
+				}
+
+				return bits;
+			}
+
+			void write_header(bit_buffer& buffer, bool end) const {
+				buffer.write_bits(end ? 1 : 0, 1);
+				buffer.write_bits(COBRA_DEFLATE_DYNAMIC, 2);
+				buffer.write_bits(hl - 257, 5);
+				buffer.write_bits(hd - 1, 5);
+				buffer.write_bits(hc - 4, 4);
 
 				for (std::size_t i = 0; i < hc; i++) {
 					assert(lc[i] < 8 && "code length length too lengthy");
-					co_await _stream.write_bits(lc[i], 3);
+					buffer.write_bits(lc[i], 3);
 				}
 
 				for (std::size_t i = 0; i < code_size; i++) {
-					co_await ct.write(_stream, code_code[i].code);
-					co_await _stream.write_bits(code_code[i].value, code_code[i].extra);
+					ct->write(buffer, code_code[i].code);
+					buffer.write_bits(code_code[i].value, code_code[i].extra);
 				}
+			}
+		};
+
+		void write_stored_block(bool end) {
+			const char* data = _state->raw.data();
+			std::size_t size = block_size();
+
+			do {
+				const std::size_t length = std::min<std::size_t>(size, 65535);
+
+				write_stored_header(length, end && length == size);
+				_state->buffer.write_bytes(data, length);
+				data += length;
+				size -= length;
+			} while (size > 0);
+
+			reset();
+		}
+
+		// Picks whichever of stored, fixed and dynamic comes out smallest
+		void encode_block(bool end) {
+			write_header();
+
+			const std::size_t stored_bits = stored_cost();
+			const std::size_t fixed_bits = fixed_cost();
+			std::optional<dynamic_block> dynamic;
+			std::size_t dynamic_bits = std::numeric_limits<std::size_t>::max();
+
+			if (_state->commands.size() >= min_dynamic_commands) {
+				dynamic.emplace(*_state, _size_weight.data(), _dist_weight.data());
+				dynamic_bits = dynamic->header_cost() + dynamic->lt.cost(_size_weight.data(), 288) +
+							   dynamic->dt.cost(_dist_weight.data(), 32) + extra_cost();
+			}
 
-				co_await write_block(&lt, &dt);
+			if (stored_bits < fixed_bits && stored_bits < dynamic_bits) {
+				write_stored_block(end);
+			} else if (dynamic_bits < fixed_bits) {
+				dynamic->write_header(_state->buffer, end);
+				write_block(&dynamic->lt, &dynamic->dt);
 			} else {
-				deflate_ltree lt(fixed_tree.data(), fixed_tree.size());
+				_state->buffer.write_bits(end ? 1 : 0, 1);
+				_state->buffer.write_bits(COBRA_DEFLATE_FIXED, 2);
+				write_fixed_block();
+			}
+		}
+
+		void write_stored_header(std::size_t length, bool end = false) {
+			_state->buffer.write_bits(end ? 1 : 0, 1);
+			_state->buffer.write_bits(COBRA_DEFLATE_NONE, 2);
+			_state->buffer.align();
+			_state->buffer.write_bits(length, 16);
+			_state->buffer.write_bits(~length & 0xFFFF, 16);
+			_state->buffer.drain();
+		}
 
-				co_await _stream.write_bits(end ? 1 : 0, 1);
-				co_await _stream.write_bits(1, 2);
-				co_await write_block(&lt, nullptr);
+		task<void> flush_block(bool end) {
+			encode_block(end);
+
+			if (end) {
+				_state->buffer.align();
+			} else {
+				_state->buffer.drain();
 			}
+
+			co_await _stream.write_all(_state->buffer.data(), _state->buffer.size());
+			_state->buffer.clear();
 		}
 
 	public:
-		deflate_ostream_impl(Stream&& stream, deflate_mode mode) : _stream(std::move(stream)), _mode(mode) {
+		deflate_ostream_impl(Stream&& stream, deflate_mode mode)
+			: _stream(std::move(stream)), _state(state_pool<deflate_state>::local().acquire()), _mode(mode) {
 			reset();
 		}
 
 		deflate_ostream_impl(deflate_ostream_impl&& other)
-			: _stream(std::move(other._stream)), _commands(std::move(other._commands)),
+			: _stream(std::move(other._stream)), _state(std::move(other._state)),
 			  _size_weight(std::move(other._size_weight)), _dist_weight(std::move(other._dist_weight)),
-			  _mode(std::move(other._mode)), _wrote_header(std::move(other._wrote_header)) {}
+			  _split(other._split), _block_size(other._block_size), _mode(std::move(other._mode)),
+			  _wrote_header(std::move(other._wrote_header)) {}
 
 		~deflate_ostream_impl() {
-			assert(_commands.empty());
+			assert(!_state || _state->commands.empty());
+			state_pool<deflate_state>::local().release(std::move(_state));
 		}
 
 		deflate_ostream_impl& operator=(deflate_ostream_impl other) {
 			std::swap(_stream, other._stream);
-			std::swap(_commands, other._commands);
+			std::swap(_state, other._state);
 			std::swap(_size_weight, other._size_weight);
 			std::swap(_dist_weight, other._dist_weight);
+			std::swap(_split, other._split);
+			std::swap(_block_size, other._block_size);
 			std::swap(_mode, other._mode);
 			std::swap(_wrote_header, other._wrote_header);
 			return *this;
 		}
 
-		task<void> write(const lz_command& command) {
-			_commands.push_back(command);
+		// The data is the input the commands stand for, it is copied into the
+		// block in one go instead of being rebuilt from the commands.
+		task<void> write(const lz_command* commands, std::size_t count, const std::uint8_t* data, std::size_t size) {
+			const std::array<token, 259>& sizes = size_tokens();
+			const std::uint8_t* end = data + size;
+			const std::uint8_t* copied = data;
 
-			if (command.is_literal()) {
-				_size_weight[command.ch()] += 1;
-			} else {
-				_size_weight[encode_size(command.length()).code] += 1;
-				_dist_weight[encode_dist(command.dist()).code] += 1;
+			for (const lz_command& command : std::span(commands, count)) {
+				_state->commands.push_back(command);
+				_block_size += command.length();
+				data += command.length();
+
+				if (command.is_literal()) {
+					_size_weight[command.ch()] += 1;
+					_split.observe_literal(command.ch());
+				} else {
+					_size_weight[sizes[command.length()].code] += 1;
+					_dist_weight[encode_dist(command.dist()).code] += 1;
+					_split.observe_match(command.length());
+				}
+
+				if (_state->commands.size() >= max_block_commands || block_size() >= max_block_size ||
+					(_split.ready() && block_size() >= min_block_size && _split.should_end(block_size()))) {
+					_state->raw.insert(_state->raw.end(), copied, data);
+					copied = data;
+					co_await flush_block(false);
+				}
 			}
 
-			if (_commands.size() >= 32768) {
-				co_await flush_block(false);
+			assert(data == end && "commands do not cover the data");
+			_state->raw.insert(_state->raw.end(), copied, end);
+		}
+
+		// Stores data as is in non-final blocks, only valid while no commands are pending
+		task<void> write_stored(const char* data, std::size_t size) {
+			assert(_state->commands.empty());
+			write_header();
+
+			while (size > 0) {
+				const std::size_t length = std::min<std::size_t>(size, 65535);
+
+				write_stored_header(length);
+				co_await _stream.write_all(_state->buffer.data(), _state->buffer.size());
+				co_await _stream.write_all(data, length);
+				_state->buffer.clear();
+				data += length;
+				size -= length;
 			}
 		}
 
 		task<void> flush() {
-			if (!_commands.empty()) {
+			if (!_state->commands.empty()) {
 				co_await flush_block(false);
 			}
 
@@ -454,7 +1095,21 @@ namespace cobra {
 
 		task<Stream> end() && {
 			co_await flush_block(true);
-			co_return co_await std::move(_stream).end();
+			co_return std::move(_stream);
+		}
+
+		// Ends with an empty stored block instead of a final one, the output is
+		// byte aligned and more deflate data can be appended to it.
+		task<Stream> sync() && {
+			if (!_state->commands.empty()) {
+				co_await flush_block(false);
+			}
+
+			write_header();
+			write_stored_header(0);
+			co_await _stream.write_all(_state->buffer.data(), _state->buffer.size());
+			_state->buffer.clear();
+			co_return std::move(_stream);
 		}
 	};
 
@@ -465,36 +1120,102 @@ namespace cobra {
 
 		lz_ostream<deflate_ostream_impl<Stream>> _inner;
 		deflate_mode _mode;
-		std::uint32_t adler32_a = 1;
-		std::uint32_t adler32_b = 0;
+		std::uint32_t _checksum;
+		std::uint32_t _total = 0;
+		// Adaptive streams hold back the first entropy_sample_size bytes and store
+		// them and everything after as is if they look incompressible.
+		bool _adaptive;
+		bool _sampled = false;
+		bool _stored = false;
+		std::string _sample;
 
 		constexpr static std::size_t window_size = 32768;
 
 	public:
 		using typename base::char_type;
 
-		deflate_ostream(Stream&& stream, deflate_mode mode = deflate_mode::raw)
-			: _inner(deflate_ostream_impl(std::move(stream), mode), window_size), _mode(mode) {}
+	private:
+		task<std::size_t> write_stored(const char_type* data, std::size_t size) {
+			co_await _inner.inner().write_stored(data, size);
+			co_return size;
+		}
+
+		task<std::size_t> write_sample(const char_type* data, std::size_t size) {
+			size = std::min(size, entropy_sample_size - _sample.size());
+			_checksum = checksum_update(_mode, _checksum, data, size);
+			_total += size;
+			_sample.append(data, size);
+
+			if (_sample.size() == entropy_sample_size) {
+				co_await end_sample();
+			}
+
+			co_return size;
+		}
+
+		// Decides on whatever was sampled so far, flushing before a full sample
+		// means the stream is compressed like any other
+		task<void> end_sample() {
+			_sampled = true;
+			_stored = is_incompressible(_sample.data(), _sample.size());
+
+			if (_stored) {
+				co_await _inner.inner().write_stored(_sample.data(), _sample.size());
+			} else {
+				co_await _inner.write_all(_sample.data(), _sample.size());
+			}
+
+			_sample = std::string();
+		}
+
+	public:
+		deflate_ostream(Stream&& stream, deflate_mode mode = deflate_mode::raw, int level = lz_level_default,
+						bool adaptive = false)
+			: _inner(deflate_ostream_impl(std::move(stream), mode), window_size, lz_levels[level]), _mode(mode),
+			  _checksum(checksum_init(mode)), _adaptive(adaptive) {
+			assert(level >= lz_level_fastest && level <= lz_level_max && "bad compression level");
+		}
 
 		task<std::size_t> write(const char_type* data, std::size_t size) {
-			for (std::size_t i = 0; i < size; i++) {
-				adler32_a = (adler32_a + static_cast<std::uint8_t>(data[i])) % 65521;
-				adler32_b = (adler32_b + adler32_a) % 65521;
+			if (_adaptive && !_sampled) {
+				return write_sample(data, size);
+			}
+
+			_checksum = checksum_update(_mode, _checksum, data, size);
+			_total += size;
+
+			if (_stored) {
+				return write_stored(data, size);
 			}
 
 			return _inner.write(data, size);
 		}
 
+		inline bool stored() const {
+			return _stored;
+		}
+
 		task<void> flush() {
-			return _inner.flush();
+			if (_adaptive && !_sampled) {
+				co_await end_sample();
+			}
+
+			co_await _inner.flush();
 		}
 
 		task<Stream> end() && {
+			if (_adaptive && !_sampled) {
+				co_await end_sample();
+			}
+
 			auto tmp2 = co_await std::move(_inner).end();
 			Stream tmp = co_await std::move(tmp2).end();
 
 			if (_mode == deflate_mode::zlib) {
-				co_await cobra::write_u32_be(tmp, adler32_b << 16 | adler32_a);
+				co_await cobra::write_u32_be(tmp, _checksum);
+			} else if (_mode == deflate_mode::gzip) {
+				co_await cobra::write_u32_le(tmp, _checksum);
+				co_await cobra::write_u32_le(tmp, _total);
 			}
 
 			co_return std::move(tmp);
@@ -0,0 +1,44 @@
+#ifndef COBRA_COMPRESS_ENTROPY_HH
+#define COBRA_COMPRESS_ENTROPY_HH
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace cobra {
+	constexpr std::size_t entropy_sample_size = 4096;
+	// Smaller samples are too noisy to act on
+	constexpr std::size_t entropy_min_sample = 512;
+	// Bits per byte, already compressed data sits just below 8
+	constexpr double incompressible_entropy = 7.5;
+
+	inline double byte_entropy(const void* data, std::size_t size) {
+		std::array<std::uint32_t, 256> counts{};
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		double entropy = 0;
+
+		for (std::size_t i = 0; i < size; i++) {
+			counts[bytes[i]] += 1;
+		}
+
+		for (std::uint32_t count : counts) {
+			if (count != 0) {
+				double p = static_cast<double>(count) / size;
+				entropy -= p * std::log2(p);
+			}
+		}
+
+		return entropy;
+	}
+
+	// Only looks at the first few KB. Repeats that LZ77 would find in data that
+	// looks random byte by byte are rare enough not to bother with.
+	inline bool is_incompressible(const void* data, std::size_t size) {
+		size = std::min(size, entropy_sample_size);
+		return size >= entropy_min_sample && byte_entropy(data, size) > incompressible_entropy;
+	}
+} // namespace cobra
+
+#endif
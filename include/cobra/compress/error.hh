@@ -14,6 +14,8 @@ namespace cobra {
 		bad_trees,
 		tree_too_stupid,
 		unsupported,
+		bad_header,
+		bad_checksum,
 	};
 } // namespace cobra
 
@@ -1,24 +1,21 @@
 #ifndef COBRA_COMPRESS_LZ_HH
 #define COBRA_COMPRESS_LZ_HH
 
-#ifdef COBRA_DEBUG
-#define FORCE_INLINE __attribute__((always_inline))
-#else
-#define FORCE_INLINE
-#endif
-
 #include "cobra/asyncio/stream.hh"
 #include "cobra/asyncio/task.hh"
+#include "cobra/compress/state_pool.hh"
 #include "cobra/ringbuffer.hh"
+#include "cobra/simd.hh"
 
 #include <algorithm>
+#include <bit>
+#include <cassert>
 #include <cstdint>
 #include <deque>
-#include <iterator>
-#include <limits>
-#include <stdexcept>
-#include <unordered_map>
+#include <memory>
+#include <span>
 #include <utility>
+#include <vector>
 
 #ifdef COBRA_DEBUG
 #include "cobra/compress/stream_ringbuffer.hh"
@@ -31,6 +28,28 @@
 
 namespace cobra {
 
+	struct lz_parameters {
+		uint16_t good_length;
+		uint16_t max_lazy;
+		uint16_t nice_length;
+		uint16_t max_chain;
+		bool lazy;
+	};
+
+	constexpr int lz_level_fastest = 0;
+	constexpr int lz_level_default = 6;
+	constexpr int lz_level_max = 9;
+
+	// Same tuning as zlib, max_lazy limits which matches get inserted into
+	// the hash table when matching greedily. The extra level 0 only looks at
+	// the most recent candidate.
+	constexpr lz_parameters lz_levels[] = {
+		{4, 4, 8, 1, false},		{4, 4, 8, 4, false},		 {4, 5, 16, 8, false},
+		{4, 6, 32, 32, false},		{4, 4, 16, 16, true},		 {8, 16, 32, 32, true},
+		{8, 16, 128, 128, true},	{8, 32, 128, 256, true},	 {32, 128, 258, 1024, true},
+		{32, 258, 258, 4096, true},
+	};
+
 	class lz_command {
 		uint16_t _length;
 		union {
@@ -65,147 +84,36 @@ namespace cobra {
 		}
 	};
 
-	class zchain {
-	public:
-		using buffer_iterator = ringbuffer<uint8_t>::iterator;
-
-		class zchain_iterator {
-		public:
-			using iterator_tag = std::forward_iterator_tag;
-
-		private:
-			zchain* _current = nullptr;
-
-		public:
-			constexpr zchain_iterator() noexcept = default;
-			constexpr zchain_iterator(zchain* chain) noexcept : _current(chain) {}
-			constexpr zchain_iterator(zchain_iterator&& other) noexcept
-				: _current(std::exchange(other._current, nullptr)) {}
-			constexpr zchain_iterator(const zchain_iterator& other) noexcept = default;
-			constexpr ~zchain_iterator() {
-				_current = nullptr;
-			}
-
-			constexpr zchain_iterator& operator=(const zchain_iterator& other) noexcept = default;
-			constexpr zchain_iterator& operator=(zchain_iterator&& other) noexcept {
-				if (this != &other) {
-					swap(other);
-				}
-				return *this;
-			}
-
-			constexpr bool operator==(const zchain_iterator& other) const noexcept = default;
-			constexpr bool operator!=(const zchain_iterator& other) const noexcept = default;
-
-			inline constexpr zchain& operator*() noexcept {
-				return *_current;
-			};
-
-			inline constexpr const zchain& operator*() const noexcept {
-				return *_current;
-			}
-
-			inline constexpr zchain* operator->() noexcept {
-				return _current;
-			}
+	constexpr std::size_t lz_hash_bits = 15;
+	constexpr std::size_t lz_hash_size = std::size_t(1) << lz_hash_bits;
 
-			inline constexpr const zchain* operator->() const noexcept {
-				return _current;
-			}
-
-			inline constexpr zchain_iterator& operator++() noexcept {
-				_current = _current->_next;
-				return *this;
-			}
+	// Buffers of an lz_ostream, kept in a state_pool between streams
+	struct lz_state {
+		std::size_t window_size;
+		// Holds two windows worth of data, positions in the table are offsets
+		// into it and 0 doubles as the end of a chain, like in zlib.
+		std::unique_ptr<uint8_t[]> window;
+		std::unique_ptr<uint16_t[]> head;
+		std::unique_ptr<uint16_t[]> prev;
+		// Commands are handed to the stream in batches
+		std::vector<lz_command> commands;
 
-			inline constexpr zchain_iterator operator++(int) noexcept {
-				zchain_iterator tmp(*this);
-				_current = _current->_next;
-				return tmp;
-			}
-
-			inline constexpr void swap(zchain_iterator& other) noexcept {
-				std::swap(_current, other._current);
-			}
-		};
+		lz_state(std::size_t window_size)
+			: window_size(window_size), window(std::make_unique<uint8_t[]>(2 * window_size)),
+			  head(std::make_unique<uint16_t[]>(lz_hash_size)), prev(std::make_unique<uint16_t[]>(window_size)) {}
 
-		using iterator = zchain_iterator;
-		using const_iterator = const zchain_iterator;
-
-	private:
-		uint32_t _hash;
-		zchain* _next = nullptr;
-		buffer_iterator _pos;
-
-	public:
-		constexpr zchain(uint32_t hash, buffer_iterator pos) noexcept : _hash(hash), _pos(pos) {}
-		constexpr zchain(zchain&& other) noexcept
-			: _hash(std::exchange(other._hash, std::numeric_limits<uint32_t>::max())),
-			  _next(std::exchange(other._next, nullptr)), _pos(std::move(other._pos)) {}
-		constexpr ~zchain() {
-			_hash = std::numeric_limits<uint32_t>::max();
-			_next = nullptr;
-			_pos = buffer_iterator();
+		inline bool reusable(std::size_t size) const {
+			return size == window_size;
 		}
-		// constexpr zchain(const zchain& other) noexcept = default;
 
-		inline constexpr iterator begin() noexcept {
-			return iterator(this);
-		}
-		inline constexpr iterator end() noexcept {
-			return iterator();
-		}
-		inline constexpr iterator next() noexcept {
-			return iterator(_next);
-		}
-		inline constexpr const_iterator next() const noexcept {
-			return iterator(_next);
-		}
-
-		inline constexpr zchain& operator=(zchain&& other) noexcept {
-			if (this != &other) {
-				swap(other);
-			}
-			return *this;
-		}
-
-		constexpr bool operator==(const zchain& other) const noexcept = default;
-
-		inline constexpr bool operator==(uint32_t hash) const noexcept {
-			return _hash == hash;
-		}
-
-		inline constexpr uint32_t hash() const noexcept {
-			return _hash;
-		}
-
-		inline constexpr buffer_iterator pos() noexcept {
-			return _pos;
-		}
-
-		inline constexpr zchain* set_next(zchain* next) noexcept {
-			return std::exchange(_next, next);
-		}
-
-		inline constexpr zchain* set_next(zchain& next) noexcept {
-			return set_next(&next);
-		}
-
-		constexpr void swap(zchain& other) noexcept {
-			std::swap(_hash, other._hash);
-			std::swap(_next, other._next);
-			_pos.swap(other._pos);
+		// Chains are only ever entered through the head table, so stale
+		// entries in prev and the window are unreachable once it is cleared.
+		void reset() {
+			std::fill(head.get(), head.get() + lz_hash_size, 0);
+			commands.clear();
 		}
 	};
 
-	inline constexpr void swap(zchain& lhs, zchain& rhs) noexcept {
-		lhs.swap(rhs);
-	}
-
-	inline constexpr void swap(zchain::zchain_iterator& lhs, zchain::zchain_iterator& rhs) noexcept {
-		lhs.swap(rhs);
-	}
-
 #ifdef COBRA_DEBUG
 	class lz_debug_istream {
 		ringbuffer<uint8_t> _window;
@@ -213,11 +121,13 @@ namespace cobra {
 	public:
 		lz_debug_istream(std::size_t window_size) : _window(window_size) {}
 
-		task<void> write(const lz_command& command) {
-			if (command.is_literal()) {
-				println("{}({})", (char)command.ch(), command.ch());
-			} else {
-				println("({},{})", command.dist(), command.length());
+		task<void> write(const lz_command* commands, std::size_t count, const uint8_t*, std::size_t) {
+			for (const lz_command& command : std::span(commands, count)) {
+				if (command.is_literal()) {
+					println("{}({})", (char)command.ch(), command.ch());
+				} else {
+					println("({},{})", command.dist(), command.length());
+				}
 			}
 			co_return;
 		}
@@ -235,8 +145,8 @@ namespace cobra {
 	public:
 		lz_istream(std::size_t window_size) : base(window_size) {}
 
-		task<void> write(const lz_command& command) {
-			_commands.push_back(command);
+		task<void> write(const lz_command* commands, std::size_t count, const uint8_t*, std::size_t) {
+			_commands.insert(_commands.end(), commands, commands + count);
 			co_return;
 		}
 
@@ -279,276 +189,317 @@ namespace cobra {
 		using typename base_type::char_type;
 
 	private:
-		Stream _stream;
-		ringbuffer<uint8_t> _buffer;
-		ringbuffer<uint8_t> _window;
-
-		ringbuffer<zchain> _chain;
-		std::unordered_map<uint32_t, std::pair<zchain::iterator, zchain::iterator>> _table;
-
 		constexpr static std::size_t _min_backref_length = 3;
 		constexpr static std::size_t _max_backref_length = 258;
+		constexpr static std::size_t _min_lookahead = _max_backref_length + _min_backref_length + 1;
+		constexpr static std::size_t _hash_bits = lz_hash_bits;
+		constexpr static std::size_t _hash_size = lz_hash_size;
+		constexpr static std::size_t _too_far = 4096;
+		constexpr static std::size_t _max_commands = 4096;
+
+		Stream _stream;
+		lz_parameters _parameters;
+		std::size_t _window_size;
+		std::unique_ptr<lz_state> _state;
+		std::size_t _strstart = 0;
+		std::size_t _lookahead = 0;
+		std::size_t _match_start = 0;
+		std::size_t _match_length = _min_backref_length - 1;
+		bool _match_available = false;
+		// Input covered by the pending commands, they end right before the
+		// literal a lazy match might still replace.
+		std::size_t _command_size = 0;
 
 	public:
-		lz_ostream(Stream&& stream, std::size_t window_size)
-			: _stream(std::move(stream)), _buffer(window_size), _window(window_size), _chain(window_size), _table() {}
+		lz_ostream(Stream&& stream, std::size_t window_size, lz_parameters parameters = lz_levels[lz_level_default])
+			: _stream(std::move(stream)), _parameters(parameters), _window_size(window_size),
+			  _state(state_pool<lz_state>::local().acquire(window_size)) {
+			_state->commands.reserve(_max_commands);
+			assert(std::has_single_bit(window_size) && "window size must be a power of two");
+			assert(window_size >= 2 * _min_lookahead && window_size <= 32768 && "bad window size");
+		}
 
 		lz_ostream(lz_ostream&& other)
-			: _stream(std::move(other._stream)), _buffer(std::move(other._buffer)), _window(std::move(other._window)),
-			  _chain(std::move(other._chain)), _table(std::move(other._table)) {}
+			: _stream(std::move(other._stream)), _parameters(other._parameters), _window_size(other._window_size),
+			  _state(std::move(other._state)), _strstart(other._strstart),
+			  _lookahead(std::exchange(other._lookahead, 0)), _match_start(other._match_start),
+			  _match_length(other._match_length), _match_available(std::exchange(other._match_available, false)),
+			  _command_size(std::exchange(other._command_size, 0)) {}
 
 		~lz_ostream() {
-			assert(_buffer.empty());
+			assert(_lookahead == 0 && !_match_available && (!_state || _state->commands.empty()));
+			state_pool<lz_state>::local().release(std::move(_state));
 		}
 
 		lz_ostream& operator=(lz_ostream&& other) noexcept {
 			if (this != &other) {
 				std::swap(_stream, other._stream);
-				swap(_buffer, other._buffer);
-				swap(_window, other._window);
-				swap(_chain, other._chain);
-				std::swap(_table, other._table);
+				std::swap(_parameters, other._parameters);
+				std::swap(_window_size, other._window_size);
+				std::swap(_state, other._state);
+				std::swap(_strstart, other._strstart);
+				std::swap(_lookahead, other._lookahead);
+				std::swap(_match_start, other._match_start);
+				std::swap(_match_length, other._match_length);
+				std::swap(_match_available, other._match_available);
+				std::swap(_command_size, other._command_size);
 			}
 			return *this;
 		}
 
+		// Primes the window with data that came before the stream, matches can
+		// refer back into it but nothing is produced for it. Only the last
+		// window worth of data is kept.
+		void set_dictionary(const char_type* data, std::size_t size) {
+			assert(_strstart == 0 && _lookahead == 0 && "dictionary must be set before writing");
+
+			if (size > _window_size) {
+				data += size - _window_size;
+				size = _window_size;
+			}
+
+			std::copy(data, data + size, _state->window.get());
+
+			for (std::size_t pos = 0; pos + _min_backref_length <= size; ++pos) {
+				insert_string(pos);
+			}
+
+			_strstart = size;
+		}
+
 		task<std::size_t> write(const char_type* data, std::size_t size) {
 			const std::size_t result = size;
+
 			while (size > 0) {
-				const std::size_t n = std::min(_buffer.remaining(), size);
-				_buffer.insert(data, data + n);
+				if (_strstart + _lookahead == 2 * _window_size) {
+					slide_window();
+				}
+
+				const std::size_t n = std::min(2 * _window_size - _strstart - _lookahead, size);
+				std::copy(data, data + n, _state->window.get() + _strstart + _lookahead);
+				_lookahead += n;
 				data += n;
 				size -= n;
-				co_await produce_one();
+				co_await produce(false);
 			}
+
 			co_return result;
 		}
 
 		task<Stream> end() && {
-			co_await produce_atleast(_buffer.size());
+			co_await produce(true);
 			co_return std::move(_stream);
 		}
 
 		task<void> flush() {
-			co_await produce_atleast(_buffer.size());
+			co_await produce(true);
 			co_await _stream.flush();
 		}
 
-	private:
-#ifdef COBRA_DEBUG_LZ
-		void assert_table_correct() {
-			for (auto& [key, value] : _table) {
-				for (auto& link : *value.first) {
-					assert(link.hash() == key);
-					if (std::distance(link.pos(), _window.end()) >= 3) {
-						uint32_t actual_hash = calc_hash(*(link.pos() + 2), *(link.pos() + 1), *link.pos());
-						assert(actual_hash == key);
-					}
-				}
-				assert(value.first != _chain[0].end());
-				assert(value.second != _chain[0].end());
-
-				if (value.first->next() == nullptr)
-					assert(value.first == value.second);
-				if (value.first == value.second)
-					assert(value.first->next() == nullptr);
-
-				auto it = value.first->begin();
-				while (true) {
-					assert(it != _chain[0].end());
-					if (it++ == value.second) {
-						assert(it == _chain[0].end());
-						break;
-					}
-				}
-			}
+		inline Stream& inner() {
+			return _stream;
 		}
 
-		void assert_chain_correct() {
-			std::set<uint32_t> checked;
-			for (auto& link : _chain) {
-				assert(_table.find(link.hash()) != _table.end());
-				if (!checked.contains(link.hash())) {
-					assert(_table.at(link.hash()).first == link.begin());
-					checked.insert(link.hash());
-				}
-			}
+	private:
+		std::size_t max_dist() const {
+			return _window_size - _min_lookahead;
 		}
 
-		void assert_correct() {
-			assert_table_correct();
-			assert_chain_correct();
+		static uint32_t hash(const uint8_t* data) {
+			const uint32_t value = static_cast<uint32_t>(data[0]) << 16 | static_cast<uint32_t>(data[1]) << 8 | data[2];
+			return (value * 0x9E3779B1u) >> (32 - _hash_bits);
 		}
-#else
-		FORCE_INLINE void assert_table_correct() {}
-		FORCE_INLINE void assert_chain_correct() {}
-		FORCE_INLINE void assert_correct() {}
-#endif
 
-		task<void> produce_one() {
-			assert_correct();
-			assert(!_buffer.empty());
-			if (_buffer.size() < _min_backref_length) {
-				// Not enough buffered to produce a backreference or to store a hash
-				co_await write_literal_command_from_buffer();
-				co_return;
-			}
+		std::size_t insert_string(std::size_t pos) {
+			const uint32_t index = hash(_state->window.get() + pos);
+			const std::size_t head = _state->head[index];
 
-			const auto hash = peek_hash();
-			const auto it = _table.find(hash);
+			_state->prev[pos & (_window_size - 1)] = static_cast<uint16_t>(head);
+			_state->head[index] = static_cast<uint16_t>(pos);
+			return head;
+		}
 
-			if (it == _table.end()) {
-				// Did not find anything in the window that starts with the same characters
-				co_await write_literal_command_chained_from_buffer(hash);
-				co_return;
-			}
+		void slide_window() {
+			assert(_strstart >= _window_size);
 
-			// Found backreference
-			auto [first, _] = it->second;
+			uint8_t* window = _state->window.get();
 
-			std::size_t best_length = _min_backref_length;
-			zchain* best_link = &*first;
+			std::copy(window + _window_size, window + 2 * _window_size, window);
+			_strstart -= _window_size;
+			_match_start = _match_start >= _window_size ? _match_start - _window_size : 0;
 
-			assert_correct();
-			for (auto& link : *first) {
-				auto [win_it, buf_it] = std::mismatch(link.pos(), _window.end(), _buffer.begin(), _buffer.end());
-				std::size_t length = buf_it - _buffer.begin();
+			for (std::size_t i = 0; i < _hash_size; ++i) {
+				_state->head[i] = _state->head[i] >= _window_size ? _state->head[i] - _window_size : 0;
+			}
 
-				if (win_it == _window.end()) {
-					auto [_, a] = std::mismatch(_buffer.begin(), _buffer.end(), buf_it, _buffer.end());
-					length = a - _buffer.begin();
-				}
+			for (std::size_t i = 0; i < _window_size; ++i) {
+				_state->prev[i] = _state->prev[i] >= _window_size ? _state->prev[i] - _window_size : 0;
+			}
+		}
 
-				if (length >= best_length) {
-					best_link = &link;
-					best_length = std::min(length, _max_backref_length);
+		std::size_t longest_match(std::size_t cur_match, std::size_t prev_length) {
+			const uint8_t* scan = _state->window.get() + _strstart;
+			const std::size_t max_length = std::min(_max_backref_length, _lookahead);
+			const std::size_t nice_length = std::min<std::size_t>(_parameters.nice_length, max_length);
+			const std::size_t limit = _strstart > max_dist() ? _strstart - max_dist() : 0;
+			std::size_t best_length = prev_length;
+			std::size_t chain_length = _parameters.max_chain;
 
-					if (length >= _max_backref_length)
-						break;
-				}
+			if (best_length >= max_length) {
+				return best_length;
 			}
-			assert(best_link);
 
-			const std::size_t window_match = _window.end() - best_link->pos();
-			co_await write_copy_command(hash, best_length, window_match);
-		}
+			// Already have a good match, do not try as hard
+			if (prev_length >= _parameters.good_length) {
+				chain_length = std::max<std::size_t>(chain_length >> 2, 1);
+			}
 
-		auto remove_oldest_link() {
-			const auto it = _chain.begin();
-			const auto res = it + 1;
-			const uint32_t link_hash = it->hash();
+			do {
+				const uint8_t* match = _state->window.get() + cur_match;
 
-			auto table_it = _table.find(link_hash);
-			if (table_it == _table.end())
-				return res;
+				// Cheap rejection before comparing the whole string
+				if (match[best_length] != scan[best_length] || match[0] != scan[0] || match[1] != scan[1]) {
+					continue;
+				}
 
-			const auto [head, tail] = table_it->second;
-			assert(it->next() == head->next());
-			assert(it->hash() == head->hash() && it->hash() == tail->hash());
+				const std::size_t length = common_prefix(scan, match, max_length);
 
-			if (head->next() == nullptr)
-				assert(head == tail);
+				if (length > best_length) {
+					_match_start = cur_match;
+					best_length = length;
 
-			if (head == tail) {
-				// Was the last link
-				_table.erase(link_hash);
-			} else {
-				_table[link_hash] = {it->next(), tail};
-			}
+					if (length >= nice_length) {
+						break;
+					}
+				}
+			} while ((cur_match = _state->prev[cur_match & (_window_size - 1)]) > limit && --chain_length != 0);
 
-			_chain.pop_front();
-			assert_correct();
-			return res;
+			return best_length;
 		}
 
-		auto write_literal(uint8_t ch) {
-			if (_window.full() || _chain.full()) {
-				remove_oldest_link();
-			}
-			return _window.push_back(ch);
+		inline void put_literal(uint8_t ch) {
+			_state->commands.push_back(lz_command(ch));
+			_command_size += 1;
 		}
 
-		void push_hash(ringbuffer<uint8_t>::iterator it, uint32_t hash) {
-			assert(!_chain.full());
-			const auto chain_it = _chain.push_back(zchain(hash, it));
-			assert_table_correct();
-
-			update_table(hash, chain_it);
-			assert_correct();
+		inline void put_match(std::size_t length, std::size_t dist) {
+			_state->commands.push_back(lz_command(static_cast<uint16_t>(length), static_cast<uint16_t>(dist)));
+			_command_size += length;
 		}
 
-		task<ringbuffer<uint8_t>::iterator> write_literal_command(uint8_t ch) {
-			co_await _stream.write(lz_command(ch));
-			co_return write_literal(ch);
+		// Hands the commands over together with the part of the window they stand for
+		task<void> write_commands() {
+			const std::size_t end = _strstart - (_match_available ? 1 : 0);
+			const uint8_t* data = _state->window.get() + end - _command_size;
+			co_await _stream.write(_state->commands.data(), _state->commands.size(), data, _command_size);
+			_state->commands.clear();
+			_command_size = 0;
 		}
 
-		task<void> write_literal_command_from_buffer() {
-			co_await write_literal_command(_buffer.pop_front());
+		inline bool can_produce(bool flush) const {
+			return _lookahead >= _min_lookahead || (flush && _lookahead > 0);
 		}
 
-		void update_table(uint32_t hash, zchain::iterator it) {
-			auto table_it = _table.find(hash);
-			if (table_it == _table.end()) {
-				_table[hash] = {it, it};
-			} else {
-				table_it->second.second->set_next(&*it);
-				table_it->second.second = it;
-			}
-		}
+		task<void> produce(bool flush) {
+			do {
+				if (_parameters.lazy) {
+					produce_lazy(flush);
+				} else {
+					produce_greedy(flush);
+				}
 
-		void update_table(uint32_t hash, ringbuffer<zchain>::iterator it) {
-			update_table(hash, it->begin());
+				if (!_state->commands.empty()) {
+					co_await write_commands();
+				}
+			} while (can_produce(flush));
 		}
 
-		task<void> write_literal_command_chained(uint8_t ch, uint32_t hash) {
-			assert_correct();
-			const auto win_it = co_await write_literal_command(ch);
+		void produce_greedy(bool flush) {
+			while (_state->commands.size() < _max_commands && can_produce(flush)) {
+				const std::size_t end = _strstart + _lookahead;
+				std::size_t hash_head = 0;
+				std::size_t length = 0;
 
-			push_hash(win_it, hash);
-			co_return;
-		}
+				if (_lookahead >= _min_backref_length) {
+					hash_head = insert_string(_strstart);
+				}
 
-		task<void> write_literal_command_chained_from_buffer(uint32_t hash) {
-			co_await write_literal_command_chained(_buffer.pop_front(), hash);
-		}
+				if (hash_head != 0 && _strstart - hash_head <= max_dist()) {
+					length = longest_match(hash_head, _min_backref_length - 1);
+				}
 
-		auto write_from_buffer(std::size_t count) {
-			auto it = _window.insert(_buffer.begin(), _buffer.begin() + count);
-			_buffer.erase_front(count);
-			return it;
-		}
+				if (length >= _min_backref_length) {
+					put_match(length, _strstart - _match_start);
+
+					if (length <= _parameters.max_lazy) {
+						for (std::size_t pos = _strstart + 1; pos < _strstart + length; ++pos) {
+							if (pos + _min_backref_length <= end) {
+								insert_string(pos);
+							}
+						}
+					}
 
-		task<void> write_copy_command(uint32_t hash, uint16_t length, uint16_t dist) {
-			(void)hash;
-			assert_correct();
-			for (uint16_t i = 0; i < length; ++i) {
-				if (_buffer.size() < 3) {
-					auto ch = _buffer.pop_front();
-					write_literal(ch);
+					_strstart += length;
+					_lookahead -= length;
 				} else {
-					auto hash = peek_hash();
-					auto ch = _buffer.pop_front();
-					auto it = write_literal(ch);
-					push_hash(it, hash);
+					put_literal(_state->window[_strstart]);
+					_strstart += 1;
+					_lookahead -= 1;
 				}
 			}
-			co_await _stream.write(lz_command(length, dist));
 		}
 
-		uint32_t calc_hash(uint8_t l, uint8_t c, uint8_t r) {
-			return static_cast<uint32_t>(l) << 16 | static_cast<uint32_t>(c) << 8 | r;
-		}
+		// Only commits to a match once the match at the next position turns
+		// out not to be longer.
+		void produce_lazy(bool flush) {
+			while (_state->commands.size() < _max_commands && can_produce(flush)) {
+				const std::size_t end = _strstart + _lookahead;
+				const std::size_t prev_length = _match_length;
+				const std::size_t prev_match = _match_start;
+				std::size_t hash_head = 0;
 
-		uint32_t peek_hash() {
-			return calc_hash(_buffer[2], _buffer[1], _buffer[0]);
-			// return static_cast<uint32_t>(_buffer[2]) << 16 | static_cast<uint32_t>(_buffer[1]) << 8 |  _buffer[0];
-		}
+				if (_lookahead >= _min_backref_length) {
+					hash_head = insert_string(_strstart);
+				}
+
+				_match_length = _min_backref_length - 1;
+
+				if (hash_head != 0 && prev_length < _parameters.max_lazy && _strstart - hash_head <= max_dist()) {
+					_match_length = longest_match(hash_head, prev_length);
+
+					// A far away match of minimum length costs more than the literals
+					if (_match_length == _min_backref_length && _strstart - _match_start > _too_far) {
+						_match_length = _min_backref_length - 1;
+					}
+				}
+
+				if (prev_length >= _min_backref_length && _match_length <= prev_length) {
+					put_match(prev_length, _strstart - 1 - prev_match);
+
+					for (std::size_t pos = _strstart + 1; pos < _strstart - 1 + prev_length; ++pos) {
+						if (pos + _min_backref_length <= end) {
+							insert_string(pos);
+						}
+					}
+
+					_lookahead -= prev_length - 1;
+					_strstart += prev_length - 1;
+					_match_available = false;
+					_match_length = _min_backref_length - 1;
+				} else {
+					if (_match_available) {
+						put_literal(_state->window[_strstart - 1]);
+					}
+
+					_match_available = true;
+					_strstart += 1;
+					_lookahead -= 1;
+				}
+			}
 
-		task<void> produce_atleast(size_t at_least) {
-			assert(at_least <= _buffer.size() && "tried to produce  more than available");
-			const size_t before = _buffer.size();
-			while (!_buffer.empty() && before - _buffer.size() < at_least) {
-				co_await produce_one();
+			if (flush && _lookahead == 0 && _match_available) {
+				put_literal(_state->window[_strstart - 1]);
+				_match_available = false;
 			}
 		}
 	};
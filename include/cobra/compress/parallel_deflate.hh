@@ -0,0 +1,211 @@
+#ifndef COBRA_COMPRESS_PARALLEL_DEFLATE_HH
+#define COBRA_COMPRESS_PARALLEL_DEFLATE_HH
+
+#include "cobra/asyncio/async_task.hh"
+#include "cobra/asyncio/executor.hh"
+#include "cobra/asyncio/std_stream.hh"
+#include "cobra/compress/deflate.hh"
+
+#include <deque>
+#include <optional>
+#include <sstream>
+#include <string>
+
+namespace cobra {
+	constexpr std::size_t parallel_deflate_segment_size = 128 * 1024;
+	constexpr std::size_t parallel_deflate_dictionary_size = 32 * 1024;
+	// Segments of one stream that can be compressing at the same time
+	constexpr std::size_t parallel_deflate_max_pending = 8;
+
+	// Splits its input into segments that are compressed concurrently on an
+	// executor, like pigz. Each segment is primed with the tail of the one
+	// before it and ends on a byte boundary with an empty stored block, so
+	// the compressed segments are simply concatenated. With a resume executor
+	// the writer hops over to it once a segment is done, which keeps it off
+	// the threads that do the compressing. The executor has to actually queue
+	// the job elsewhere, an inline one resumes on the compressing thread.
+	// Bodies that are flushed or end before a whole segment is buffered, or
+	// whose first segment an adaptive stream finds incompressible, are handed
+	// to a regular deflate_ostream and never leave the writer's thread.
+	template <AsyncOutputStream Stream>
+	class parallel_deflate_ostream : public buffered_ostream_impl<parallel_deflate_ostream<Stream>> {
+		using base = buffered_ostream_impl<parallel_deflate_ostream<Stream>>;
+
+	public:
+		using typename base::char_type;
+
+	private:
+		struct segment {
+			std::string data;
+			std::uint32_t checksum;
+			std::size_t size;
+		};
+
+		using segment_ostream = std_ostream<std::ostringstream>;
+
+		Stream _stream;
+		executor* _exec;
+		executor* _resume;
+		deflate_mode _mode;
+		int _level;
+		bool _adaptive;
+		bool _parallel = false;
+		std::optional<deflate_ostream<Stream>> _inline;
+		std::string _input;
+		std::string _dictionary;
+		std::deque<async_task<segment>> _pending;
+		std::uint32_t _checksum;
+		std::uint32_t _total = 0;
+		bool _wrote_header = false;
+
+		constexpr static std::size_t window_size = 32768;
+
+		static task<segment> compress(std::string dictionary, std::string data, deflate_mode mode, int level) {
+			lz_ostream<deflate_ostream_impl<segment_ostream>> output(
+				deflate_ostream_impl(segment_ostream(std::ostringstream()), deflate_mode::raw), window_size,
+				lz_levels[level]);
+			output.set_dictionary(dictionary.data(), dictionary.size());
+			co_await output.write_all(data.data(), data.size());
+			deflate_ostream_impl<segment_ostream> impl = co_await std::move(output).end();
+			segment_ostream result = co_await std::move(impl).sync();
+			std::uint32_t checksum = checksum_update(mode, checksum_init(mode), data.data(), data.size());
+			co_return segment{std::move(result.inner()).str(), checksum, data.size()};
+		}
+
+		task<void> write_header() {
+			static constexpr char zlib_header[] = {0x78, static_cast<char>(0x9C)};
+			// No flags, no modification time and an unknown operating system
+			static constexpr char gzip_header[] = {0x1F, static_cast<char>(0x8B), 0x08, 0x00, 0x00,
+												   0x00, 0x00, 0x00, 0x00, static_cast<char>(0xFF)};
+
+			if (!_wrote_header) {
+				if (_mode == deflate_mode::zlib) {
+					co_await _stream.write_all(zlib_header, sizeof zlib_header);
+				} else if (_mode == deflate_mode::gzip) {
+					co_await _stream.write_all(gzip_header, sizeof gzip_header);
+				}
+
+				_wrote_header = true;
+			}
+		}
+
+		task<void> submit() {
+			if (_pending.size() >= parallel_deflate_max_pending) {
+				co_await write_segment();
+			}
+
+			std::string dictionary = std::move(_dictionary);
+			std::string data = std::move(_input);
+
+			// The next segment refers back into the last window of everything before it
+			const std::size_t keep = std::min(data.size(), parallel_deflate_dictionary_size);
+			_dictionary.assign(dictionary.end() - std::min(dictionary.size(), parallel_deflate_dictionary_size - keep),
+							   dictionary.end());
+			_dictionary.append(data.end() - keep, data.end());
+			_input.clear();
+			_input.reserve(parallel_deflate_segment_size);
+
+			_pending.push_back(_exec->schedule(compress(std::move(dictionary), std::move(data), _mode, _level)));
+		}
+
+		task<void> write_segment() {
+			async_task<segment> pending = std::move(_pending.front());
+			_pending.pop_front();
+			segment result = co_await std::move(pending);
+
+			if (_resume) {
+				co_await _resume->schedule();
+			}
+
+			co_await write_header();
+			co_await _stream.write_all(result.data.data(), result.data.size());
+			_checksum = checksum_combine(_mode, _checksum, result.checksum, result.size);
+			_total += result.size;
+		}
+
+		task<void> compress_inline() {
+			_inline.emplace(std::move(_stream), _mode, _level, _adaptive);
+			co_await _inline->write_all(_input.data(), _input.size());
+			_input = std::string();
+		}
+
+		task<void> drain() {
+			if (!_input.empty()) {
+				co_await submit();
+			}
+
+			while (!_pending.empty()) {
+				co_await write_segment();
+			}
+		}
+
+	public:
+		parallel_deflate_ostream(Stream&& stream, executor* exec, deflate_mode mode = deflate_mode::raw,
+								 int level = lz_level_default, executor* resume = nullptr, bool adaptive = false)
+			: _stream(std::move(stream)), _exec(exec), _resume(resume), _mode(mode), _level(level),
+			  _adaptive(adaptive), _checksum(checksum_init(mode)) {
+			assert(level >= lz_level_fastest && level <= lz_level_max && "bad compression level");
+		}
+
+		task<std::size_t> write(const char_type* data, std::size_t size) {
+			if (_inline) {
+				co_return co_await _inline->write(data, size);
+			}
+
+			const std::size_t n = std::min(size, parallel_deflate_segment_size - _input.size());
+			_input.append(data, n);
+
+			if (_input.size() == parallel_deflate_segment_size) {
+				if (!_parallel && _adaptive && is_incompressible(_input.data(), _input.size())) {
+					co_await compress_inline();
+				} else {
+					_parallel = true;
+					co_await submit();
+				}
+			}
+
+			co_return n;
+		}
+
+		task<void> flush() {
+			if (!_parallel && !_inline) {
+				co_await compress_inline();
+			}
+
+			if (_inline) {
+				co_await _inline->flush();
+			} else {
+				co_await drain();
+				co_await _stream.flush();
+			}
+		}
+
+		task<Stream> end() && {
+			// An empty final block with fixed codes
+			static constexpr char final_block[] = {0x03, 0x00};
+
+			if (!_parallel && !_inline) {
+				co_await compress_inline();
+			}
+
+			if (_inline) {
+				co_return co_await std::move(*_inline).end();
+			}
+
+			co_await drain();
+			co_await write_header();
+			co_await _stream.write_all(final_block, sizeof final_block);
+
+			if (_mode == deflate_mode::zlib) {
+				co_await cobra::write_u32_be(_stream, _checksum);
+			} else if (_mode == deflate_mode::gzip) {
+				co_await cobra::write_u32_le(_stream, _checksum);
+				co_await cobra::write_u32_le(_stream, _total);
+			}
+
+			co_return std::move(_stream);
+		}
+	};
+} // namespace cobra
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef COBRA_COMPRESS_STATE_POOL_HH
+#define COBRA_COMPRESS_STATE_POOL_HH
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace cobra {
+	// Per thread free list of compressor state that is too big to allocate
+	// for every stream. It never holds more than the number of streams that
+	// were open on the thread at the same time, and at most max_free. State
+	// released on another thread than it was acquired on simply moves over.
+	template <class T>
+	class state_pool {
+		std::vector<std::unique_ptr<T>> _free;
+
+	public:
+		constexpr static std::size_t max_free = 16;
+
+		static state_pool& local() {
+			thread_local state_pool pool;
+			return pool;
+		}
+
+		template <class... Args>
+		std::unique_ptr<T> acquire(const Args&... args) {
+			while (!_free.empty()) {
+				std::unique_ptr<T> state = std::move(_free.back());
+				_free.pop_back();
+
+				if (state->reusable(args...)) {
+					state->reset();
+					return state;
+				}
+			}
+
+			return std::make_unique<T>(args...);
+		}
+
+		void release(std::unique_ptr<T> state) {
+			if (state && _free.size() < max_free) {
+				_free.push_back(std::move(state));
+			}
+		}
+	};
+} // namespace cobra
+
+#endif
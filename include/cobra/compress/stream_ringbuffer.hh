@@ -3,10 +3,32 @@
 
 #include "cobra/asyncio/stream.hh"
 #include "cobra/compress/error.hh"
+#include "cobra/mirrored_buffer.hh"
 
-#include <memory>
+#include <bit>
+#include <cassert>
+#include <cstring>
 
 namespace cobra {
+	// Copies a back-reference of size elements that starts dist elements
+	// before out. Overlapping matches repeat a pattern, so every copy can take
+	// everything written so far and the chunks double in size.
+	template <class CharT>
+	void copy_match(CharT* out, std::size_t dist, std::size_t size) {
+		const CharT* in = out - dist;
+
+		while (size > 0) {
+			std::size_t limit = std::min(size, static_cast<std::size_t>(out - in));
+			std::memcpy(out, in, limit * sizeof(CharT));
+			out += limit;
+			size -= limit;
+		}
+	}
+
+	// The buffer can end up larger than asked for, it is rounded up to a power
+	// of two and, when mirrored, to the page size. Mirrored buffers hand out
+	// everything between two positions in one go, even across the end, but
+	// take a few system calls to set up and tear down, so they are opt in.
 	template <class Base, class CharT, class Traits = std::char_traits<CharT>>
 	class basic_istream_ringbuffer
 		: public basic_buffered_istream_impl<basic_istream_ringbuffer<Base, CharT, Traits>, CharT, Traits> {
@@ -15,13 +37,22 @@ namespace cobra {
 												   Traits>::char_type;
 
 	private:
-		std::unique_ptr<char_type[]> _buffer;
+		static_assert(std::has_single_bit(sizeof(CharT)), "mask needs a power of two number of elements");
+
+		mirrored_buffer _storage;
+		char_type* _buffer;
 		std::size_t _buffer_size;
+		std::size_t _buffer_mask;
 		std::size_t _buffer_begin = 0;
 		std::size_t _buffer_end = 0;
 
 		std::pair<std::size_t, std::size_t> space(std::size_t from, std::size_t to) const {
-			std::size_t begin = from % _buffer_size;
+			std::size_t begin = from & _buffer_mask;
+
+			if (_storage.mirrored()) {
+				return {begin, to - from};
+			}
+
 			return {begin, std::min(_buffer_size - begin, to - from)};
 		}
 
@@ -30,7 +61,7 @@ namespace cobra {
 		task<std::size_t> write(Stream& stream, std::size_t size) {
 			auto [begin, limit] = space(_buffer_end, _buffer_begin + _buffer_size);
 			limit = std::min(limit, size);
-			limit = std::min(limit, co_await stream.read(_buffer.get() + begin, limit));
+			limit = std::min(limit, co_await stream.read(_buffer + begin, limit));
 
 			if (limit == 0 && size != 0) {
 				throw stream_error::incomplete_read;
@@ -43,7 +74,7 @@ namespace cobra {
 		std::size_t write(const char_type* data, std::size_t size) {
 			auto [begin, limit] = space(_buffer_end, _buffer_begin + _buffer_size);
 			limit = std::min(limit, size);
-			std::copy(data, data + limit, _buffer.get() + begin);
+			std::copy(data, data + limit, _buffer + begin);
 			_buffer_end += limit;
 			return limit;
 		}
@@ -57,15 +88,23 @@ namespace cobra {
 				throw compress_error::long_distance;
 			}
 
-			std::size_t first = (_buffer_end - dist) % _buffer_size;
+			std::size_t first = (_buffer_end - dist) & _buffer_mask;
 			auto [begin, limit] = space(_buffer_end, _buffer_begin + _buffer_size);
-			limit = std::min(limit, std::min(size, _buffer_size - first));
+			limit = std::min(limit, size);
+
+			if (first >= begin || !_storage.mirrored()) {
+				// Keeps a wrapped source from running into what is being written
+				limit = std::min(limit, _buffer_size - first);
+			}
 
-			char_type* buffer_out = _buffer.get() + begin;
-			char_type* buffer_in = _buffer.get() + first;
+			char_type* buffer_out = _buffer + begin;
+			char_type* buffer_in = _buffer + first;
 
-			for (std::size_t i = 0; i < limit; i++) {
-				buffer_out[i] = buffer_in[i];
+			if (buffer_in < buffer_out) {
+				copy_match(buffer_out, buffer_out - buffer_in, limit);
+			} else {
+				// The source wrapped around, it is never overwritten before it is read
+				std::memmove(buffer_out, buffer_in, limit * sizeof(char_type));
 			}
 
 			_buffer_end += limit;
@@ -73,6 +112,61 @@ namespace cobra {
 			return limit;
 		}
 
+		// Copies up to size elements starting dist elements before the end of
+		// the data written so far, without writing them, returns the amount.
+		std::size_t copy_out(std::size_t dist, char_type* data, std::size_t size) const {
+			if (dist > _buffer_size) {
+				throw compress_error::short_buffer;
+			}
+
+			if (dist > _buffer_end) {
+				throw compress_error::long_distance;
+			}
+
+			std::size_t from = _buffer_end - dist;
+			std::size_t to = from + std::min(size, dist);
+
+			while (from < to) {
+				auto [begin, limit] = space(from, to);
+				std::copy(_buffer + begin, _buffer + begin + limit, data);
+				data += limit;
+				from += limit;
+			}
+
+			return std::min(size, dist);
+		}
+
+		// Adds data that was handed out without going through the buffer, only
+		// the last part of it is kept for back-references.
+		void append(const char_type* data, std::size_t size) {
+			assert(empty());
+
+			std::size_t index = size - std::min(size, _buffer_size);
+			_buffer_end += index;
+			_buffer_begin = _buffer_end;
+
+			while (index < size) {
+				index += write(data + index, size - index);
+			}
+
+			_buffer_begin = _buffer_end;
+		}
+
+		// Calls func with every contiguous part of the data written since from,
+		// which must not have been overwritten yet, returns the new position.
+		template <class Func>
+		std::size_t written(std::size_t from, Func func) const {
+			assert(from + _buffer_size >= _buffer_end);
+
+			while (from < _buffer_end) {
+				auto [begin, limit] = space(from, _buffer_end);
+				func(_buffer + begin, limit);
+				from += limit;
+			}
+
+			return from;
+		}
+
 		bool empty() const {
 			return _buffer_begin >= _buffer_end;
 		}
@@ -82,15 +176,32 @@ namespace cobra {
 		}
 
 	public:
-		basic_istream_ringbuffer(std::size_t buffer_size) {
-			_buffer = std::make_unique<char_type[]>(buffer_size);
-			_buffer_size = buffer_size;
+		basic_istream_ringbuffer(std::size_t buffer_size, bool mirror = false)
+			: _storage(buffer_size * sizeof(char_type), mirror) {
+			_buffer = reinterpret_cast<char_type*>(_storage.data());
+			_buffer_size = _storage.size() / sizeof(char_type);
+			_buffer_mask = _buffer_size - 1;
+		}
+
+		basic_istream_ringbuffer(basic_istream_ringbuffer&& other)
+			: _storage(std::move(other._storage)), _buffer(std::exchange(other._buffer, nullptr)),
+			  _buffer_size(other._buffer_size), _buffer_mask(other._buffer_mask),
+			  _buffer_begin(std::exchange(other._buffer_begin, 0)), _buffer_end(std::exchange(other._buffer_end, 0)) {}
+
+		basic_istream_ringbuffer& operator=(basic_istream_ringbuffer other) {
+			std::swap(_storage, other._storage);
+			std::swap(_buffer, other._buffer);
+			std::swap(_buffer_size, other._buffer_size);
+			std::swap(_buffer_mask, other._buffer_mask);
+			std::swap(_buffer_begin, other._buffer_begin);
+			std::swap(_buffer_end, other._buffer_end);
+			return *this;
 		}
 
 		task<std::pair<const char_type*, std::size_t>> fill_buf() {
 			co_await static_cast<Base*>(this)->fill_ringbuf();
 			auto [begin, limit] = space(_buffer_begin, _buffer_end);
-			co_return {_buffer.get() + begin, limit};
+			co_return {_buffer + begin, limit};
 		}
 
 		void consume(std::size_t size) {
@@ -8,7 +8,8 @@
 
 #include <algorithm>
 #include <array>
-#include <numeric>
+#include <cassert>
+#include <cstdint>
 #include <vector>
 
 namespace cobra {
@@ -27,103 +28,171 @@ namespace cobra {
 		}
 	}
 
+	constexpr std::uint64_t reverse(std::uint64_t value, std::size_t bits) {
+		value = ((value & UINT64_C(0xAAAAAAAAAAAAAAAA)) >> 1) | ((value & UINT64_C(0x5555555555555555)) << 1);
+		value = ((value & UINT64_C(0xCCCCCCCCCCCCCCCC)) >> 2) | ((value & UINT64_C(0x3333333333333333)) << 2);
+		value = ((value & UINT64_C(0xF0F0F0F0F0F0F0F0)) >> 4) | ((value & UINT64_C(0x0F0F0F0F0F0F0F0F)) << 4);
+		value = ((value & UINT64_C(0xFF00FF00FF00FF00)) >> 8) | ((value & UINT64_C(0x00FF00FF00FF00FF)) << 8);
+		value = ((value & UINT64_C(0xFFFF0000FFFF0000)) >> 16) | ((value & UINT64_C(0x0000FFFF0000FFFF)) << 16);
+		value = ((value & UINT64_C(0xFFFFFFFF00000000)) >> 32) | ((value & UINT64_C(0x00000000FFFFFFFF)) << 32);
+		return value >> (64 - bits);
+	}
+
+	// Codes are looked up by their first root_bits bits, longer codes continue
+	// into a subtable indexed by the remaining bits.
 	template <class T, std::size_t Size, std::size_t Bits>
 	class inflate_tree {
-		std::array<T, Size> _data;
-		std::array<T, Bits + 1> _count;
+		struct entry {
+			std::uint16_t value;
+			std::uint8_t length;
+			bool link;
+		};
+
+		constexpr static std::size_t root_bits = std::min<std::size_t>(Bits, 9);
+
+		std::vector<entry> _table;
+
+		inline const entry& lookup(std::uint64_t bits) const {
+			const entry& root = _table[bits & ((1 << root_bits) - 1)];
+
+			if (!root.link) {
+				return root;
+			}
+
+			return _table[root.value + ((bits >> root_bits) & ((1 << root.length) - 1))];
+		}
 
 	public:
-		inflate_tree(const std::size_t* size, std::size_t n) {
-			std::array<T, Bits + 1> next;
+		inflate_tree(const std::size_t* size, std::size_t n) : _table(1 << root_bits, entry{0, 0, false}) {
+			std::array<std::size_t, Bits + 1> count;
+			std::array<std::size_t, Bits + 1> next;
 
 			validate_tree_size<Bits>(size, n);
-			std::fill(_count.begin(), _count.end(), 0);
+			std::fill(count.begin(), count.end(), 0);
 
-			for (T i = 0; i < n; i++) {
-				if (size[i] != 0) {
-					_count[size[i]] += 1;
+			for (std::size_t i = 0; i < n; i++) {
+				count[size[i]] += 1;
+			}
+
+			count[0] = 0;
+			next[0] = 0;
+
+			for (std::size_t i = 1; i <= Bits; i++) {
+				next[i] = (next[i - 1] + count[i - 1]) << 1;
+			}
+
+			// Without codes longer than the root there are no subtables
+			if constexpr (Bits > root_bits) {
+				std::array<std::size_t, Bits + 1> code = next;
+				std::array<std::size_t, 1 << root_bits> sub_bits;
+
+				std::fill(sub_bits.begin(), sub_bits.end(), 0);
+
+				for (std::size_t i = 0; i < n; i++) {
+					if (size[i] > root_bits) {
+						std::size_t prefix = reverse(code[size[i]]++, size[i]) & ((1 << root_bits) - 1);
+						sub_bits[prefix] = std::max(sub_bits[prefix], size[i] - root_bits);
+					}
+				}
+
+				for (std::size_t i = 0; i < sub_bits.size(); i++) {
+					if (sub_bits[i] != 0) {
+						const std::uint16_t offset = static_cast<std::uint16_t>(_table.size());
+						_table[i] = {offset, static_cast<std::uint8_t>(sub_bits[i]), true};
+						_table.resize(_table.size() + (std::size_t(1) << sub_bits[i]), entry{0, 0, false});
+					}
 				}
 			}
 
-			std::partial_sum(_count.begin(), std::prev(_count.end()), std::next(next.begin()));
+			for (std::size_t i = 0; i < n; i++) {
+				if (size[i] == 0) {
+					continue;
+				}
 
-			for (T i = 0; i < n; i++) {
-				if (size[i] != 0) {
-					_data[next[size[i]]++] = i;
+				std::size_t bits = reverse(next[size[i]]++, size[i]);
+				std::size_t offset = 0;
+				std::size_t length = size[i];
+				std::size_t step = std::size_t(1) << size[i];
+				std::size_t end = std::size_t(1) << root_bits;
+
+				if (size[i] > root_bits) {
+					const entry& root = _table[bits & ((1 << root_bits) - 1)];
+					offset = root.value;
+					bits >>= root_bits;
+					step >>= root_bits;
+					end = std::size_t(1) << root.length;
+				}
+
+				for (std::size_t j = bits; j < end; j += step) {
+					_table[offset + j] = {static_cast<std::uint16_t>(i), static_cast<std::uint8_t>(length), false};
 				}
 			}
 		}
 
+		// Bits past the buffered ones read as zero, so an entry is only valid
+		// when all bits of its code were actually buffered.
 		template <AsyncInputStream Stream>
-		task<T> read(bit_istream<Stream>& stream) const {
-			T offset = 0;
-			T value = 0;
+		bool try_read(bit_istream<Stream>& stream, T& value) const {
+			if (stream.available() < Bits) {
+				stream.refill();
+			}
 
-			for (std::size_t i = 0; i <= Bits; i++) {
-				if (value < _count[i]) {
-					co_return _data[value + offset];
-				}
+			const entry& current = lookup(stream.peek_bits(Bits));
+
+			if (current.length != 0 && current.length <= stream.available()) {
+				stream.drop_bits(current.length);
+				value = static_cast<T>(current.value);
+				return true;
+			}
 
-				offset += _count[i];
-				value -= _count[i];
-				value <<= 1;
-				value |= co_await stream.read_bits(1);
+			if (stream.available() >= Bits) {
+				throw compress_error::bad_huffman_code;
 			}
 
-			throw compress_error::bad_huffman_code;
+			return false;
 		}
-	};
 
-	constexpr std::uint64_t reverse(std::uint64_t value, std::size_t bits) {
-		value = ((value & UINT64_C(0xAAAAAAAAAAAAAAAA)) >> 1) | ((value & UINT64_C(0x5555555555555555)) << 1);
-		value = ((value & UINT64_C(0xCCCCCCCCCCCCCCCC)) >> 2) | ((value & UINT64_C(0x3333333333333333)) << 2);
-		value = ((value & UINT64_C(0xF0F0F0F0F0F0F0F0)) >> 4) | ((value & UINT64_C(0x0F0F0F0F0F0F0F0F)) << 4);
-		value = ((value & UINT64_C(0xFF00FF00FF00FF00)) >> 8) | ((value & UINT64_C(0x00FF00FF00FF00FF)) << 8);
-		value = ((value & UINT64_C(0xFFFF0000FFFF0000)) >> 16) | ((value & UINT64_C(0x0000FFFF0000FFFF)) << 16);
-		value = ((value & UINT64_C(0xFFFFFFFF00000000)) >> 32) | ((value & UINT64_C(0x00000000FFFFFFFF)) << 32);
-		return value >> (64 - bits);
-	}
+		template <AsyncInputStream Stream>
+		task<T> read(bit_istream<Stream>& stream) const {
+			T value;
+
+			while (!try_read(stream, value)) {
+				co_await stream.fill();
+			}
+
+			co_return value;
+		}
+	};
 
 	template <class T, std::size_t Size, std::size_t Bits>
 	class deflate_tree {
-	public:
-		std::array<std::size_t, Size> _size;
-		std::array<T, Size> _data;
+		static_assert(Size <= 65536, "symbols have to fit in 16 bits");
 
-		struct node {
-			std::size_t weight;
-			T index;
-			T code;
-		};
+		std::array<std::uint8_t, Size> _size;
+		std::array<T, Size> _data;
 
-		struct list {
-			std::array<node, Size * 2> nodes;
-			std::size_t size;
+	public:
+		// Scratch space for plant, large enough that it is better kept around
+		// than put on the stack for every block.
+		struct workspace {
+			// Weights in the upper bits and symbols in the lower 16 bits, so a
+			// plain sort orders them by weight
+			std::array<std::uint64_t, Size> symbols;
+			std::array<std::size_t, Size> nodes;
+			std::array<std::size_t, Size> size;
 		};
 
-		static void plant_find_size(const std::array<list, Bits + 1>& lists, std::array<std::size_t, Size>& size,
-									std::size_t i, std::size_t j) {
-			if (lists[i].nodes[j].index < Size) {
-				plant_find_size(lists, size, i - 1, (std::size_t)lists[i].nodes[j].index * 2);
-				plant_find_size(lists, size, i - 1, (std::size_t)lists[i].nodes[j].index * 2 + 1);
-			}
-
-			if (lists[i].nodes[j].code < Size) {
-				size[lists[i].nodes[j].code] += 1;
-			}
-		}
-
-	public:
 		deflate_tree(const std::size_t* size, std::size_t n) {
 			std::array<T, Bits + 1> count;
 			std::array<T, Bits + 1> next;
 
 			validate_tree_size<Bits>(size, n);
 			std::fill(count.begin(), count.end(), 0);
-			std::copy(size, size + n, _size.data());
+			std::fill(_size.begin(), _size.end(), 0);
 
 			for (T i = 0; i < n; i++) {
 				if (size[i] != 0) {
+					_size[i] = static_cast<std::uint8_t>(size[i]);
 					count[size[i]] += 1;
 				}
 			}
@@ -159,84 +228,139 @@ namespace cobra {
 			return max;
 		}
 
-		template <AsyncOutputStream Stream>
-		task<void> write(bit_ostream<Stream>& stream, T value) const {
-			co_await stream.write_bits(_data[value], _size[value]);
+		inline void write(bit_buffer& buffer, T value) const {
+			buffer.write_bits(_data[value], _size[value]);
 		}
 
-		static deflate_tree plant(const std::size_t* weight, std::size_t n) {
-			std::array<list, Bits + 1> lists;
-			std::array<std::size_t, Size> size;
+		inline T code(T value) const {
+			return _data[value];
+		}
+
+		inline std::size_t cost(T value) const {
+			return _size[value];
+		}
 
-			lists[0].size = 0;
+		// Bits taken by symbols with these weights, not counting extra bits
+		std::size_t cost(const std::size_t* weight, std::size_t n) const {
+			std::size_t bits = 0;
 
-			for (T i = 0; i < n; i++) {
+			for (std::size_t i = 0; i < n; i++) {
+				bits += weight[i] * _size[i];
+			}
+
+			return bits;
+		}
+
+		// Builds a huffman code in place as described by Moffat and Katajainen,
+		// then moves the symbols that ended up deeper than Bits up to Bits and
+		// pushes shallower ones down until the code fits again, like zlib.
+		static deflate_tree plant(const std::size_t* weight, std::size_t n, workspace& work) {
+			std::array<std::size_t, Bits + 1> count;
+			std::size_t used = 0;
+
+			for (std::size_t i = 0; i < n; i++) {
 				if (weight[i] != 0) {
-					lists[0].nodes[lists[0].size].weight = weight[i];
-					lists[0].nodes[lists[0].size].index = Size;
-					lists[0].nodes[lists[0].size].code = i;
-					lists[0].size += 1;
+					assert(weight[i] < (std::uint64_t(1) << 48) && "weight too heavy");
+					work.symbols[used++] = (std::uint64_t(weight[i]) << 16) | i;
 				}
 			}
 
-			std::sort(lists[0].nodes.data(), lists[0].nodes.data() + lists[0].size, [](const node& a, const node& b) {
-				return a.weight < b.weight;
-			});
+			std::fill(work.size.begin(), work.size.begin() + n, 0);
 
-			for (std::size_t i = 1; i <= Bits; i++) {
-				std::size_t pair_index = 0;
-				std::size_t leaf_index = 0;
+			// A lone symbol still needs a code of one bit
+			if (used < 2) {
+				work.size[used == 0 ? 0 : work.symbols[0] & 0xFFFF] = 1;
+				return deflate_tree(work.size.data(), n);
+			}
+
+			std::sort(work.symbols.begin(), work.symbols.begin() + used);
+
+			std::size_t* nodes = work.nodes.data();
+
+			for (std::size_t i = 0; i < used; i++) {
+				nodes[i] = work.symbols[i] >> 16;
+			}
+
+			// Combine the two lightest nodes until one is left, internal nodes
+			// replace the leaves from the front and end up holding the index of
+			// their parent.
+			std::size_t leaf = 2;
+			std::size_t root = 0;
 
-				lists[i].size = 0;
+			nodes[0] += nodes[1];
 
-				if (i == Bits) {
-					leaf_index = lists[0].size;
+			for (std::size_t next = 1; next < used - 1; next++) {
+				if (leaf >= used || nodes[root] < nodes[leaf]) {
+					nodes[next] = nodes[root];
+					nodes[root++] = next;
+				} else {
+					nodes[next] = nodes[leaf++];
 				}
 
-				while (leaf_index < lists[0].size || pair_index < lists[i - 1].size / 2) {
-					std::size_t leaf_weight = std::numeric_limits<std::size_t>::max();
-					std::size_t pair_weight = std::numeric_limits<std::size_t>::max();
+				if (leaf >= used || (root < next && nodes[root] < nodes[leaf])) {
+					nodes[next] += nodes[root];
+					nodes[root++] = next;
+				} else {
+					nodes[next] += nodes[leaf++];
+				}
+			}
 
-					if (leaf_index < lists[0].size) {
-						leaf_weight = lists[0].nodes[leaf_index].weight;
-					}
+			// Parent indices become depths, the root is the last internal node
+			nodes[used - 2] = 0;
 
-					if (pair_index < lists[i - 1].size / 2) {
-						pair_weight =
-							lists[i - 1].nodes[pair_index * 2].weight + lists[i - 1].nodes[pair_index * 2 + 1].weight;
-					}
+			for (std::size_t i = used - 2; i-- > 0;) {
+				nodes[i] = nodes[nodes[i]] + 1;
+			}
 
-					if (leaf_weight < pair_weight) {
-						lists[i].nodes[lists[i].size].weight = leaf_weight;
-						lists[i].nodes[lists[i].size].index = Size;
-						lists[i].nodes[lists[i].size].code = lists[0].nodes[leaf_index].code;
-						leaf_index += 1;
-					} else {
-						lists[i].nodes[lists[i].size].weight = pair_weight;
-						lists[i].nodes[lists[i].size].index = pair_index;
-						lists[i].nodes[lists[i].size].code = Size;
-						pair_index += 1;
-					}
+			// Every level has room for twice the internal nodes of the level
+			// above, whatever is not an internal node is a leaf.
+			std::fill(count.begin(), count.end(), 0);
 
-					lists[i].size += 1;
+			for (std::size_t depth = 0, available = 1, i = used - 1; available > 0; depth++) {
+				std::size_t internal = 0;
+
+				while (i > 0 && nodes[i - 1] == depth) {
+					internal += 1;
+					i -= 1;
 				}
+
+				count[std::min(depth, Bits)] += available - internal;
+				available = internal * 2;
 			}
 
-			std::fill(size.data(), size.data() + n, 0);
+			std::size_t total = 0;
 
-			for (std::size_t i = 0; i < lists[Bits].size; i++) {
-				plant_find_size(lists, size, Bits, i);
+			for (std::size_t i = 1; i <= Bits; i++) {
+				total += count[i] << (Bits - i);
 			}
 
-			if (lists[Bits].size == 0) {
-				if (lists[0].size == 0) {
-					size[0] += 1;
-				} else {
-					size[lists[0].nodes[0].code] += 1;
+			// Each step makes a leaf above Bits the sibling of a leaf at Bits
+			while (total > (std::size_t(1) << Bits)) {
+				std::size_t depth = Bits - 1;
+
+				while (count[depth] == 0) {
+					depth -= 1;
+				}
+
+				count[depth] -= 1;
+				count[depth + 1] += 2;
+				count[Bits] -= 1;
+				total -= 1;
+			}
+
+			// The lightest symbols get the longest codes
+			for (std::size_t depth = Bits, i = 0; depth > 0; depth--) {
+				for (std::size_t j = 0; j < count[depth]; j++) {
+					work.size[work.symbols[i++] & 0xFFFF] = depth;
 				}
 			}
 
-			return deflate_tree(size.data(), n);
+			return deflate_tree(work.size.data(), n);
+		}
+
+		static deflate_tree plant(const std::size_t* weight, std::size_t n) {
+			workspace work;
+			return plant(weight, n, work);
 		}
 	};
 } // namespace cobra
@@ -1,6 +1,7 @@
 #ifndef COBRA_CONFIG_HH
 #define COBRA_CONFIG_HH
 
+#include "cobra/compress/lz.hh"
 #include "cobra/http/handler.hh"
 #include "cobra/http/message.hh"
 #include "cobra/http/uri.hh"
@@ -38,7 +39,10 @@ extern "C" {
 	X(set_header)                                                                                                      \
 	X(static)                                                                                                          \
 	X(proxy)                                                                                                           \
-	X(extension)
+	X(extension)                                                                                                       \
+	X(compress_level)                                                                                                  \
+	X(compress_type)                                                                                                   \
+	X(compress_adaptive)
 
 #ifndef COBRA_NO_SSL
 #define COBRA_SERVER_KEYWORDS                                                                                          \
@@ -701,6 +705,32 @@ namespace cobra {
 			auto operator<=>(const static_file_config& other) const = default;
 		};
 
+		// An empty level disables compression
+		struct compression_config {
+			std::optional<int> level;
+
+			static compression_config parse(parse_session& session);
+
+			auto operator<=>(const compression_config& other) const = default;
+		};
+
+		// Either a mime type, which may end in `/*`, or a file extension starting with a dot
+		struct compress_type {
+			std::string type;
+
+			static compress_type parse(parse_session& session);
+
+			auto operator<=>(const compress_type& other) const = default;
+		};
+
+		struct adaptive_compression_config {
+			bool enabled;
+
+			static adaptive_compression_config parse(parse_session& session);
+
+			auto operator<=>(const adaptive_compression_config& other) const = default;
+		};
+
 		struct proxy_config {
 			listen_address address;
 
@@ -928,6 +958,9 @@ namespace cobra {
 			std::unordered_map<std::string, file_part> _server_names;
 			std::unordered_map<http_response_code, define<error_page>> _error_pages;
 			std::set<define<extension>> _extensions;
+			std::optional<define<compression_config>> _compression;
+			std::set<define<compress_type>> _compress_types;
+			std::optional<define<adaptive_compression_config>> _adaptive_compression;
 
 		public:
 			static define<block_config> parse(parse_session& session);
@@ -946,6 +979,9 @@ namespace cobra {
 			void parse_static(parse_session& session);
 			void parse_proxy(parse_session& session);
 			void parse_extension(parse_session& session);
+			void parse_compress_level(parse_session& session);
+			void parse_compress_type(parse_session& session);
+			void parse_compress_adaptive(parse_session& session);
 			void parse_cgi(parse_session& session);
 			void parse_fast_cgi(parse_session& session);
 			void parse_index(parse_session& session);
@@ -1023,6 +1059,11 @@ namespace cobra {
 			config* parent;
 
 			std::optional<std::size_t> max_body_size;
+			// Empty when responses should not be compressed
+			std::optional<int> compress_level = lz_level_default;
+			// Empty when everything except well known compressed formats should be compressed
+			std::unordered_set<std::string> compress_types;
+			bool compress_adaptive = true;
 			std::optional<fs::path> index;
 			std::optional<fs::path> root;
 			std::optional<
@@ -0,0 +1,86 @@
+#ifndef COBRA_HTTP_ACCESS_LOG_HH
+#define COBRA_HTTP_ACCESS_LOG_HH
+
+#include "cobra/file.hh"
+#include "cobra/http/message.hh"
+#include "cobra/net/stream.hh"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <thread>
+
+namespace cobra {
+	constexpr std::size_t access_log_record_size = 512;
+	constexpr std::size_t access_log_batch_size = 64;
+	// Dropped records are reported on stderr at most this often
+	constexpr std::chrono::seconds access_log_report_interval(1);
+
+	enum class access_log_format {
+		simple,
+		combined,
+		json,
+	};
+
+	enum class access_log_overflow {
+		drop,
+		block,
+	};
+
+	struct access_log_options {
+		access_log_format format = access_log_format::simple;
+		access_log_overflow overflow = access_log_overflow::drop;
+		bool color = false;
+		std::size_t capacity = 4096;
+	};
+
+	// Records are formatted by the thread that logs them into a bounded
+	// multi-producer ring, a single background thread drains the ring and
+	// writes the records in batches.
+	class access_log {
+		struct slot {
+			std::atomic_size_t sequence;
+			std::size_t size;
+			char data[access_log_record_size];
+		};
+
+		file _file;
+		access_log_options _options;
+		std::unique_ptr<slot[]> _slots;
+		std::size_t _mask;
+		alignas(64) std::atomic_size_t _head = 0;
+		alignas(64) std::atomic_size_t _pending = 0;
+		std::atomic_size_t _written = 0;
+		std::atomic_size_t _dropped = 0;
+		std::atomic_bool _stop = false;
+		std::thread _writer;
+
+		std::size_t format(char* data, const basic_socket_stream* socket, const http_request* request,
+						   const http_response& response) const;
+		void write_batch(slot** slots, std::size_t count);
+		void report_dropped(std::size_t& reported);
+		void run();
+
+	public:
+		access_log() = delete;
+		access_log(const access_log& other) = delete;
+
+		access_log(file out, access_log_options options);
+		~access_log();
+
+		access_log& operator=(const access_log& other) = delete;
+
+		void log(const basic_socket_stream* socket, const http_request* request, const http_response& response);
+
+		inline std::size_t written() const {
+			return _written.load(std::memory_order_relaxed);
+		}
+
+		inline std::size_t dropped() const {
+			return _dropped.load(std::memory_order_relaxed);
+		}
+	};
+} // namespace cobra
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef COBRA_HTTP_COMPRESS_CACHE_HH
+#define COBRA_HTTP_COMPRESS_CACHE_HH
+
+#include "cobra/asyncio/executor.hh"
+#include "cobra/asyncio/mutex.hh"
+#include "cobra/asyncio/task.hh"
+#include "cobra/compress/deflate.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace cobra {
+	struct compress_cache_key {
+		std::string path;
+		std::uint64_t device;
+		std::uint64_t inode;
+		std::int64_t mtime;
+		deflate_mode mode;
+		int level;
+
+		bool operator==(const compress_cache_key& other) const = default;
+	};
+
+	struct compress_cache_hash {
+		std::size_t operator()(const compress_cache_key& key) const;
+	};
+
+	// Compressed static files, bounded in size and evicted in LRU order.
+	// Concurrent misses for the same key wait for the first one to populate
+	// the entry instead of compressing the same file again.
+	class compress_cache {
+	public:
+		using value_type = std::shared_ptr<const std::string>;
+		using populate_function = std::function<task<std::string>()>;
+
+	private:
+		struct entry {
+			async_mutex mutex;
+			value_type data;
+
+			entry(executor* exec) : mutex(exec) {}
+		};
+
+		using lru_list = std::list<compress_cache_key>;
+
+		struct slot {
+			std::shared_ptr<entry> value;
+			lru_list::iterator position;
+		};
+
+		std::mutex _mutex;
+		std::size_t _capacity;
+		std::size_t _size = 0;
+		lru_list _lru;
+		std::unordered_map<compress_cache_key, slot, compress_cache_hash> _entries;
+
+		void evict();
+		void erase(const compress_cache_key& key, const std::shared_ptr<entry>& value);
+
+	public:
+		compress_cache(std::size_t capacity);
+		compress_cache(const compress_cache& other) = delete;
+
+		compress_cache& operator=(const compress_cache& other) = delete;
+
+		// Errors from populate are rethrown to the caller that ran it, callers
+		// that were waiting on that entry get nothing instead.
+		task<value_type> get(compress_cache_key key, executor* exec, populate_function populate);
+
+		inline std::size_t capacity() const {
+			return _capacity;
+		}
+	};
+} // namespace cobra
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "cobra/asyncio/stream.hh"
 #include "cobra/http/message.hh"
+#include "cobra/http/result.hh"
 
 namespace cobra {
 	template <AsyncBufferedInputStream Stream>
@@ -24,7 +25,7 @@ namespace cobra {
 			auto [data, size] = co_await _stream.fill_buf();
 
 			if (_limit && size > *_limit) {
-				throw HTTP_CONTENT_TOO_LARGE;
+				throw http_error(HTTP_CONTENT_TOO_LARGE);
 			}
 
 			co_return {data, size};
@@ -3,6 +3,7 @@
 
 #include "cobra/asyncio/event_loop.hh"
 #include "cobra/asyncio/stream.hh"
+#include "cobra/http/result.hh"
 #include "cobra/http/writer.hh"
 
 #include <optional>
@@ -142,11 +143,12 @@ namespace cobra {
 		}
 	};
 
-	task<void> handle_static(http_response_writer writer, const handle_context<static_config>& context,
-							 std::optional<http_response_code> = std::nullopt);
-	task<void> handle_cgi(http_response_writer writer, const handle_context<cgi_config>& context);
-	task<void> handle_redirect(http_response_writer writer, const handle_context<redirect_config>& context);
-	task<void> handle_proxy(http_response_writer writer, const handle_context<proxy_config>& context);
+	task<http_result<void>> handle_static(http_response_writer writer, const handle_context<static_config>& context,
+										  std::optional<http_response_code> = std::nullopt);
+	task<http_result<void>> handle_cgi(http_response_writer writer, const handle_context<cgi_config>& context);
+	task<http_result<void>> handle_redirect(http_response_writer writer,
+											const handle_context<redirect_config>& context);
+	task<http_result<void>> handle_proxy(http_response_writer writer, const handle_context<proxy_config>& context);
 } // namespace cobra
 
 #endif
@@ -86,6 +86,7 @@ namespace cobra {
 		bool contains(const http_header_key& key) const;
 		void insert(http_header_key key, http_header_value value);
 		void insert_or_assign(http_header_key key, http_header_value value);
+		void erase(const http_header_key& key);
 
 		iterator begin();
 		const_iterator begin() const;
@@ -110,6 +111,7 @@ namespace cobra {
 		void set_header(http_header_key key, const http_header_map& map);
 		void add_header(http_header_key key, http_header_value value);
 		void add_header(http_header_key key, const http_header_map& map);
+		void remove_header(const http_header_key& key);
 	};
 
 	class http_request : public http_message {
@@ -21,6 +21,8 @@ namespace cobra {
 	constexpr std::size_t cgi_header_value_max_length = 4096;
 	constexpr std::size_t cgi_header_map_max_length = 256;
 	constexpr std::size_t cgi_header_map_max_size = 65536;
+	constexpr std::size_t http_chunk_size_max_length = 16;
+	constexpr std::size_t http_chunk_extension_max_length = 4096;
 
 	enum class http_parse_error {
 		unexpected_eof,
@@ -61,6 +63,7 @@ namespace cobra {
 	uri parse_uri(std::string_view string, const http_request_method& method);
 	task<http_request> parse_http_request(buffered_istream_reference stream);
 	task<http_response> parse_http_response(buffered_istream_reference stream);
+	task<http_header_map> parse_http_trailer(buffered_istream_reference stream);
 	task<http_header_map> parse_cgi(buffered_istream_reference stream);
 
 	template <class UnsignedT>
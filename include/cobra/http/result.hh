@@ -0,0 +1,90 @@
+#ifndef COBRA_HTTP_RESULT_HH
+#define COBRA_HTTP_RESULT_HH
+
+#include "cobra/http/message.hh"
+
+#include <optional>
+#include <utility>
+#include <variant>
+
+namespace cobra {
+	namespace config {
+		class config;
+	}
+
+	class http_error {
+		http_response_code _code;
+		const config::config* _config;
+
+	public:
+		http_error(http_response_code code, const config::config* config = nullptr) : _code(code), _config(config) {}
+
+		inline http_response_code code() const {
+			return _code;
+		}
+
+		inline const config::config* config() const {
+			return _config;
+		}
+	};
+
+	// Routine http statuses are returned through http_result instead of being
+	// thrown, exceptions are left for failures that are actually unexpected.
+	template <class T>
+	class http_result {
+		std::variant<T, http_error> _value;
+
+	public:
+		http_result(T value) : _value(std::in_place_index<0>, std::move(value)) {}
+		http_result(http_error error) : _value(std::in_place_index<1>, std::move(error)) {}
+
+		inline bool has_value() const {
+			return _value.index() == 0;
+		}
+
+		inline explicit operator bool() const {
+			return has_value();
+		}
+
+		inline T& value() & {
+			return std::get<0>(_value);
+		}
+
+		inline const T& value() const& {
+			return std::get<0>(_value);
+		}
+
+		inline T&& value() && {
+			return std::get<0>(std::move(_value));
+		}
+
+		inline const http_error& error() const {
+			return std::get<1>(_value);
+		}
+	};
+
+	template <>
+	class http_result<void> {
+		std::optional<http_error> _error;
+
+	public:
+		http_result() = default;
+		http_result(http_error error) : _error(std::move(error)) {}
+
+		inline bool has_value() const {
+			return !_error.has_value();
+		}
+
+		inline explicit operator bool() const {
+			return has_value();
+		}
+
+		inline void value() const {}
+
+		inline const http_error& error() const {
+			return *_error;
+		}
+	};
+} // namespace cobra
+
+#endif
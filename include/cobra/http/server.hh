@@ -5,11 +5,14 @@
 #include "cobra/asyncio/executor.hh"
 #include "cobra/config.hh"
 #include "cobra/http/message.hh"
+#include "cobra/http/result.hh"
 #include "cobra/http/writer.hh"
 #include "cobra/net/stream.hh"
 
 #include <memory>
 #include <optional>
+#include <unordered_map>
+#include <vector>
 
 namespace cobra {
 
@@ -27,37 +30,93 @@ namespace cobra {
 		http_filter(std::shared_ptr<const config::config> config);
 		http_filter(std::shared_ptr<const config::config> config, std::vector<http_filter> filters);
 
-		generator<std::pair<http_filter*, uri_abs_path>>
-		match(const basic_socket_stream& socket, const http_request& request, const uri_abs_path& normalized);
-
 		inline const config::config& config() const {
 			return *_config.get();
 		}
+		inline const std::vector<http_filter>& sub_filters() const {
+			return _sub_filters;
+		}
 		inline std::size_t match_count() const {
 			return _match_count;
 		}
+	};
 
-	protected:
-		bool eval(const basic_socket_stream& socket, const http_request& request, const uri_abs_path& normalized) const;
+	// Compiled form of a filter tree, built once per listen address. Matching
+	// only touches the routes whose location is a prefix of the request path.
+	class http_router {
+		struct route {
+			const http_filter* filter;
+			std::size_t parent;
+			std::size_t end;
+			uri_abs_path location;
+			std::vector<bool> methods;
+			std::vector<bool> extensions;
+		};
+
+		struct segment_node {
+			std::unordered_map<uri_segment, std::size_t> children;
+			std::vector<std::size_t> routes;
+		};
+
+		struct suffix_node {
+			std::unordered_map<char, std::size_t> children;
+			std::optional<std::size_t> extension;
+		};
+
+		using table = std::vector<segment_node>;
+
+		std::vector<route> _routes;
+		std::unordered_map<std::string, table> _hosts;
+		table _default;
+		std::unordered_map<http_request_method, std::size_t> _methods;
+		std::vector<suffix_node> _extensions;
+
+		void add_route(const http_filter& filter, std::size_t parent);
+		table make_table(std::optional<std::string_view> host) const;
+		std::vector<std::size_t> get_candidates(const table& routes, const uri_abs_path& path) const;
+		std::vector<std::size_t> get_extensions(const uri_abs_path& path) const;
+		bool eval(const route& current, std::optional<std::size_t> method,
+				  const std::vector<std::size_t>& extensions) const;
+
+		void match_children(const table& routes, std::size_t parent, std::optional<std::size_t> method,
+							const uri_abs_path& path,
+							std::vector<std::pair<const http_filter*, uri_abs_path>>& result) const;
+		void match_range(const table& routes, const std::size_t* first, const std::size_t* last,
+						 std::optional<std::size_t> method, const uri_abs_path& path,
+						 std::vector<std::pair<const http_filter*, uri_abs_path>>& result) const;
+
+	public:
+		static constexpr std::size_t npos = -1;
+
+		http_router() = default;
+		http_router(const std::vector<http_filter>& filters);
+
+		std::vector<std::pair<const http_filter*, uri_abs_path>>
+		match(std::optional<std::string_view> host, const http_request& request, const uri_abs_path& normalized) const;
 	};
 
 	class server : public http_filter {
 		config::listen_address _address;
 		std::unordered_map<std::string, ssl_ctx> _contexts;
+		http_router _router;
 		executor* _exec;
+		executor* _compress_exec;
 		event_loop* _loop;
+		access_log* _log;
 		std::atomic_uint16_t _num_connections = 0;
 
 		server() = delete;
 		server(config::listen_address address, std::unordered_map<std::string, ssl_ctx> contexts,
-			   std::vector<http_filter> handlers, executor* exec, event_loop* loop);
+			   std::vector<http_filter> handlers, executor* exec, executor* compress_exec, event_loop* loop,
+			   access_log* log);
 
 	public:
 		server(server&& other);
 		task<void> start(executor* exec, event_loop* loop);
 
 		static std::vector<server> convert(const std::vector<std::shared_ptr<config::server>>& configs, executor* exec,
-										   event_loop* loop);
+										   event_loop* loop, access_log* log = nullptr,
+										   executor* compress_exec = nullptr);
 #ifdef COBRA_FUZZ_HANDLER
 		task<void> on_connect(basic_socket_stream& socket);
 #endif
@@ -66,12 +125,13 @@ namespace cobra {
 #ifndef COBRA_FUZZ_HANDLER
 		task<void> on_connect(basic_socket_stream& socket);
 #endif
-		task<void> match_and_handle(basic_socket_stream& socket, const http_request& request,
-									buffered_istream_reference in, http_ostream_wrapper& out,
-									http_server_logger* logger, std::optional<http_response_code> code = std::nullopt);
-		task<void> handle_request(const http_filter& config, const http_request& request,
-								  const uri_abs_path& normalized, buffered_istream_reference in,
-								  http_response_writer writer, std::optional<http_response_code> code);
+		task<http_result<void>> match_and_handle(basic_socket_stream& socket, const http_request& request,
+												 buffered_istream_reference in, http_ostream_wrapper& out,
+												 http_server_logger* logger,
+												 std::optional<http_response_code> code = std::nullopt);
+		task<http_result<void>> handle_request(const http_filter& config, const http_request& request,
+											   const uri_abs_path& normalized, buffered_istream_reference in,
+											   http_response_writer writer, std::optional<http_response_code> code);
 
 		inline uint16_t max_connections() const {
 			return 60;
@@ -5,67 +5,134 @@
 #include "cobra/asyncio/stream.hh"
 #include "cobra/asyncio/stream_buffer.hh"
 #include "cobra/compress/deflate.hh"
+#include "cobra/compress/parallel_deflate.hh"
+#include "cobra/http/access_log.hh"
 #include "cobra/http/message.hh"
 #include "cobra/http/parse.hh"
 #include "cobra/http/util.hh"
 #include "cobra/net/stream.hh"
 
+#include <optional>
+#include <string>
+#include <string_view>
 #include <type_traits>
+#include <unordered_set>
 
 namespace cobra {
 	template <AsyncBufferedInputStream Stream>
 	class chunked_istream : public buffered_istream_impl<chunked_istream<Stream>> {
+		using base = buffered_istream_impl<chunked_istream<Stream>>;
+
+	public:
+		using typename base::char_type;
+
+	private:
+		enum class state {
+			size,
+			extension,
+			size_lf,
+			data,
+			data_cr,
+			data_lf,
+			trailer,
+			done,
+		};
+
 		Stream _stream;
+		state _state = state::size;
 		std::size_t _remaining = 0;
-		bool _done = false;
-		int _crlf = 0;
+		std::size_t _length = 0;
+		http_header_map _trailers;
 
-	public:
-		using typename buffered_istream_impl<chunked_istream<Stream>>::char_type;
+		// Parses as much of the chunk framing as is available in the buffered
+		// span without suspending, returns the number of bytes used.
+		std::size_t parse(const char_type* data, std::size_t size) {
+			std::size_t index = 0;
 
-		chunked_istream(Stream&& stream) : _stream(std::move(stream)) {}
+			while (index < size) {
+				char_type ch = data[index];
 
-		task<std::pair<const char_type*, std::size_t>> fill_buf() {
-			while (true) {
-				while (_crlf > 0) {
-					if (co_await _stream.get() != '\r') {
+				if (_state == state::size) {
+					if (auto digit = unhexify(ch)) {
+						if (++_length > http_chunk_size_max_length) {
+							throw http_parse_error::bad_content;
+						}
+
+						_remaining = _remaining * 16 + *digit;
+					} else if (_length == 0) {
+						throw http_parse_error::bad_content;
+					} else if (ch == ';' || is_http_ws(ch)) {
+						_state = state::extension;
+						_length = 0;
+					} else if (ch == '\r') {
+						_state = state::size_lf;
+					} else {
+						throw http_parse_error::bad_content;
+					}
+				} else if (_state == state::extension) {
+					if (ch == '\r') {
+						_state = state::size_lf;
+					} else if (is_http_ctl(ch) && !is_http_ws(ch)) {
+						throw http_parse_error::bad_content;
+					} else if (++_length > http_chunk_extension_max_length) {
+						throw http_parse_error::bad_content;
+					}
+				} else if (_state == state::size_lf) {
+					if (ch != '\n') {
 						throw http_parse_error::bad_content;
 					}
 
-					if (co_await _stream.get() != '\n') {
+					_length = 0;
+					_state = _remaining == 0 ? state::trailer : state::data;
+					return index + 1;
+				} else if (_state == state::data_cr) {
+					if (ch != '\r') {
 						throw http_parse_error::bad_content;
 					}
 
-					_crlf -= 1;
+					_state = state::data_lf;
+				} else if (_state == state::data_lf) {
+					if (ch != '\n') {
+						throw http_parse_error::bad_content;
+					}
+
+					_state = state::size;
+				} else {
+					return index;
 				}
 
-				if (_done) {
+				index += 1;
+			}
+
+			return index;
+		}
+
+	public:
+		chunked_istream(Stream&& stream) : _stream(std::move(stream)) {}
+
+		task<std::pair<const char_type*, std::size_t>> fill_buf() {
+			while (true) {
+				if (_state == state::done) {
 					co_return {nullptr, 0};
 				}
 
-				if (_remaining > 0) {
-					auto [data, size] = co_await _stream.fill_buf();
-					co_return {data, std::min(size, _remaining)};
+				if (_state == state::trailer) {
+					_trailers = co_await parse_http_trailer(buffered_istream_reference(_stream));
+					_state = state::done;
+					continue;
 				}
 
-				if (auto digit = unhexify(co_await _stream.peek())) {
-					_stream.consume(1);
-					_remaining = *digit;
-				} else {
-					throw http_parse_error::bad_content;
-				}
+				auto [data, size] = co_await _stream.fill_buf();
 
-				while (auto digit = unhexify(co_await _stream.peek())) {
-					_stream.consume(1);
-					_remaining = _remaining * 16 + *digit;
+				if (_state == state::data) {
+					co_return {data, std::min(size, _remaining)};
 				}
 
-				if (_remaining == 0) {
-					_done = true;
-					_crlf += 1;
+				if (size == 0) {
+					throw http_parse_error::bad_content;
 				}
 
-				_crlf += 1;
+				_stream.consume(parse(data, size));
 			}
 		}
 
@@ -74,15 +141,36 @@ namespace cobra {
 			_remaining -= size;
 
 			if (size > 0 && _remaining == 0) {
-				_crlf += 1;
+				_state = state::data_cr;
+			}
+		}
+
+		task<std::size_t> read(char_type* data, std::size_t size) {
+			if (_state != state::data) {
+				co_return co_await base::read(data, size);
 			}
+
+			// Hand the payload straight to the inner stream, which can bypass
+			// its own buffer for large reads.
+			std::size_t count = co_await _stream.read(data, std::min(size, _remaining));
+			_remaining -= count;
+
+			if (count > 0 && _remaining == 0) {
+				_state = state::data_cr;
+			}
+
+			co_return count;
+		}
+
+		const http_header_map& trailers() const {
+			return _trailers;
 		}
 
 		task<Stream> end() && {
-			while (!_done) {
+			while (_state != state::done) {
 				auto [data, size] = co_await fill_buf();
 
-				if (size == 0) {
+				if (size == 0 && _state != state::done) {
 					throw stream_error::incomplete_read;
 				}
 
@@ -143,14 +231,38 @@ namespace cobra {
 	using http_ostream_variant =
 		buffered_ostream_variant<Stream, ostream_buffer<chunked_ostream<Stream>>, ostream_limit<Stream>,
 								 deflate_ostream<Stream>, deflate_ostream<ostream_buffer<chunked_ostream<Stream>>>,
-								 ostream_limit<deflate_ostream<Stream>>>;
+								 ostream_limit<deflate_ostream<Stream>>,
+								 parallel_deflate_ostream<ostream_buffer<chunked_ostream<Stream>>>>;
 
 	using http_istream = buffered_istream_ref<http_istream_variant<buffered_istream_reference>>;
 	using http_ostream =
 		buffered_ostream_variant<buffered_ostream_ref<http_ostream_variant<buffered_ostream_reference>>, null_ostream>;
 
 	bool has_header_value(const http_message& message, const std::string& key, std::string_view target);
+	// Picks the content coding with the highest quality in the Accept-Encoding
+	// header of the request, gzip wins ties. Returns nothing for identity.
+	std::optional<deflate_mode> accept_encoding(const http_message& message);
+	bool accept_identity(const http_message& message);
+	// Whether the request accepts this particular content coding, a missing
+	// Accept-Encoding header only accepts identity here.
+	bool accept_coding(const http_message& message, deflate_mode mode);
+	// Content coding of the body if it is exactly one of the ones we decode
+	std::optional<deflate_mode> content_encoding(const http_message& message);
+	bool identity_encoding(const http_message& message);
+
+	inline const char* content_coding(deflate_mode mode) {
+		return mode == deflate_mode::gzip ? "gzip" : "deflate";
+	}
 
+	// Static files can have a precompressed sidecar with this extension next to them
+	inline const char* precompressed_extension(deflate_mode mode) {
+		return mode == deflate_mode::gzip ? ".gz" : ".deflate";
+	}
+
+	// Mime type of a static file going by its extension
+	std::optional<std::string_view> file_content_type(std::string_view path);
+	// Whether the extension is one of the well known formats that are compressed already
+	bool compressed_format(std::string_view path);
 	template <AsyncBufferedInputStream Stream>
 	http_istream_variant<Stream> get_istream(Stream stream, const http_message& message) {
 		if (message.has_header("Content-Length")) {
@@ -164,9 +276,12 @@ namespace cobra {
 	}
 
 	class http_server_logger {
+		access_log* _log;
 		const basic_socket_stream* _socket = nullptr;
 
 	public:
+		http_server_logger(access_log* log);
+
 		void set_socket(const basic_socket_stream& socket);
 
 		void log(const http_request* request, const http_response& response);
@@ -184,9 +299,11 @@ namespace cobra {
 		http_ostream get();
 		http_ostream get_chunked();
 		http_ostream get(std::size_t limit);
-		http_ostream get_deflate();
-		http_ostream get_deflate_chunked();
-		http_ostream get_deflate(std::size_t limit);
+		http_ostream get_deflate(deflate_mode mode, int level, bool adaptive);
+		http_ostream get_deflate_chunked(deflate_mode mode, int level, bool adaptive);
+		http_ostream get_deflate(std::size_t limit, deflate_mode mode, int level, bool adaptive);
+		http_ostream get_parallel_deflate_chunked(executor* exec, executor* resume, deflate_mode mode, int level,
+												  bool adaptive);
 		task<void> end();
 
 		void set_close();
@@ -212,14 +329,51 @@ namespace cobra {
 		http_ostream_wrapper* _stream;
 		http_server_logger* _logger;
 		std::vector<std::pair<std::string, std::string>> _headers;
+		std::optional<int> _compress_level = lz_level_default;
+		const std::unordered_set<std::string>* _compress_types = nullptr;
+		bool _compress_adaptive = false;
+		executor* _compress_executor = nullptr;
+		executor* _resume_executor = nullptr;
+		std::string _content_path;
+
+		bool compressible(std::string_view content_type) const;
 
 	public:
 		http_response_writer(const http_request* request, http_ostream_wrapper* stream,
 							 http_server_logger* logger = nullptr);
 
 		void set_header(std::string key, std::string value);
+		void set_compress_level(std::optional<int> level);
+		// Allowlist of mime types and extensions, everything but well known compressed formats when empty
+		void set_compress_types(const std::unordered_set<std::string>* types);
+		void set_compress_adaptive(bool adaptive);
+		// Chunked bodies are compressed in parallel segments on this executor when set, the
+		// connection continues on resume afterwards if given, e.g. the event loop's post executor
+		void set_compress_executor(executor* exec, executor* resume = nullptr);
+		// Path of the file being sent, used for its extension instead of the request path
+		void set_content_path(std::string path);
+
+		std::optional<deflate_mode> encoding(std::string_view content_type = {}) const;
+
+		inline executor* compress_executor() const {
+			return _compress_executor;
+		}
+
+		inline executor* resume_executor() const {
+			return _resume_executor;
+		}
+
+		inline bool compress_adaptive() const {
+			return _compress_adaptive;
+		}
+
+		inline int encoding_level() const {
+			return _compress_level.value_or(lz_level_fastest);
+		}
 
-		bool can_compress() const;
+		bool can_compress(std::string_view content_type = {}) const;
+		// False if the client refuses both identity and every coding we support
+		bool acceptable(std::string_view content_type = {}) const;
 		task<http_ostream> send(http_response response) &&;
 	};
 
@@ -0,0 +1,46 @@
+#ifndef COBRA_MIRRORED_BUFFER_HH
+#define COBRA_MIRRORED_BUFFER_HH
+
+#include <cstddef>
+
+namespace cobra {
+	// Storage for ring buffers, its size is always a power of two so
+	// positions can wrap with mask(). When mirrored, the same memory is
+	// mapped a second time right after the first, so any size() bytes
+	// starting at an offset below size() are contiguous. Mirroring has to be
+	// asked for, it is only tried on Linux and falls back to a plain
+	// allocation if it fails.
+	class mirrored_buffer {
+		char* _data;
+		std::size_t _size;
+		bool _mirrored = false;
+
+	public:
+		mirrored_buffer() = delete;
+		mirrored_buffer(const mirrored_buffer& other) = delete;
+
+		mirrored_buffer(std::size_t size, bool mirror = false);
+		mirrored_buffer(mirrored_buffer&& other) noexcept;
+		~mirrored_buffer();
+
+		mirrored_buffer& operator=(mirrored_buffer other) noexcept;
+
+		inline char* data() const {
+			return _data;
+		}
+
+		inline std::size_t size() const {
+			return _size;
+		}
+
+		inline std::size_t mask() const {
+			return _size - 1;
+		}
+
+		inline bool mirrored() const {
+			return _mirrored;
+		}
+	};
+} // namespace cobra
+
+#endif
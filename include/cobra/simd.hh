@@ -0,0 +1,14 @@
+#ifndef COBRA_SIMD_HH
+#define COBRA_SIMD_HH
+
+#include <cstddef>
+
+namespace cobra {
+	// Byte scanning kernels, the fastest one the cpu supports is picked the
+	// first time each function is used, like the checksums.
+
+	// Length of the common prefix of two ranges of size bytes
+	std::size_t common_prefix(const void* a, const void* b, std::size_t size);
+} // namespace cobra
+
+#endif
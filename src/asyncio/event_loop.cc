@@ -13,10 +13,12 @@
 #include <ranges>
 #include <stdexcept>
 #include <tuple>
+#include <utility>
 
 #ifdef COBRA_LINUX
 extern "C" {
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 }
 #endif
 
@@ -26,8 +28,37 @@ namespace cobra {
 		return type == poll_type::read ? poll_type::write : poll_type::read;
 	}
 
+	loop_executor::loop_executor(event_loop& loop) : _loop(loop) {}
+
+	void loop_executor::schedule(std::function<void()> func) {
+		_loop.get().post(std::move(func));
+	}
+
+	bool loop_executor::has_jobs() {
+		return _loop.get().has_posted();
+	}
+
 	event_loop::~event_loop() {}
 
+	void event_loop::post(std::function<void()> func) {
+		{
+			std::lock_guard guard(_posted_mutex);
+			_posted.push_back(std::move(func));
+		}
+
+		wake();
+	}
+
+	bool event_loop::has_posted() const {
+		std::lock_guard guard(_posted_mutex);
+		return !_posted.empty();
+	}
+
+	std::vector<std::function<void()>> event_loop::take_posted() {
+		std::lock_guard guard(_posted_mutex);
+		return std::exchange(_posted, {});
+	}
+
 	event_loop::event_type event_loop::wait_read(const file& fd, std::optional<std::chrono::milliseconds> timeout) {
 		return wait_ready(poll_type::read, fd, timeout);
 	}
@@ -55,14 +86,29 @@ namespace cobra {
 	}
 
 #ifdef COBRA_LINUX
-	epoll_event_loop::epoll_event_loop(executor& exec) : _epoll_fd(epoll_create(1)), _exec(exec) {
-		if (_epoll_fd.fd() == -1)
+	epoll_event_loop::epoll_event_loop(executor& exec)
+		: _epoll_fd(epoll_create(1)), _wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), _exec(exec) {
+		if (_epoll_fd.fd() == -1 || _wake_fd.fd() == -1)
+			throw errno_exception();
+
+		// Stays registered for good, it is not in the event maps
+		epoll_event epoll_event;
+		epoll_event.events = EPOLLIN;
+		epoll_event.data.fd = _wake_fd.fd();
+
+		if (epoll_ctl(_epoll_fd.fd(), EPOLL_CTL_ADD, _wake_fd.fd(), &epoll_event) == -1)
 			throw errno_exception();
 	}
 
 	epoll_event_loop::epoll_event_loop(epoll_event_loop&& other) noexcept
-		: _epoll_fd(std::move(other._epoll_fd)), _exec(other._exec), _write_events(std::move(other._write_events)),
-		  _read_events(std::move(other._read_events)) {}
+		: _epoll_fd(std::move(other._epoll_fd)), _wake_fd(std::move(other._wake_fd)), _exec(other._exec),
+		  _write_events(std::move(other._write_events)), _read_events(std::move(other._read_events)) {}
+
+	void epoll_event_loop::wake() {
+		std::uint64_t count = 1;
+		// Only fails when the counter is about to overflow, the loop is awake then anyway
+		(void)write(_wake_fd.fd(), &count, sizeof count);
+	}
 
 	void epoll_event_loop::schedule_event(event_pair event, std::optional<std::chrono::milliseconds> timeout,
 										  event_handle<void>& handle) {
@@ -175,6 +221,12 @@ namespace cobra {
 		}
 
 		for (auto&& event : events) {
+			if (event.first == _wake_fd.fd()) {
+				std::uint64_t count;
+				(void)read(_wake_fd.fd(), &count, sizeof count);
+				continue;
+			}
+
 			auto future = remove_event(event);
 
 			if (future) {
@@ -184,11 +236,16 @@ namespace cobra {
 				});
 			}
 		}
+
+		for (auto&& func : take_posted()) {
+			_exec.get().schedule(std::move(func));
+		}
 	}
 
 	bool epoll_event_loop::has_events() const {
 		std::lock_guard guard(_mutex);
-		return !_write_events.empty() || !_read_events.empty() || !_process_events.empty() || _exec.get().has_jobs();
+		return !_write_events.empty() || !_read_events.empty() || !_process_events.empty() || has_posted() ||
+			   _exec.get().has_jobs();
 	}
 
 	void epoll_event_loop::remove_before(std::unordered_map<int, timed_future>& map, time_point point) {
@@ -341,6 +398,19 @@ namespace cobra {
 	kqueue_event_loop::kqueue_event_loop(executor& exec) : _kqueue_fd(kqueue()), _exec(exec) {
 		if (_kqueue_fd.fd() == -1)
 			throw errno_exception();
+
+		struct kevent change;
+
+		EV_SET(&change, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+		if (kevent(_kqueue_fd.fd(), &change, 1, NULL, 0, NULL) == -1)
+			throw errno_exception();
+	}
+
+	void kqueue_event_loop::wake() {
+		struct kevent change;
+
+		EV_SET(&change, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+		kevent(_kqueue_fd.fd(), &change, 1, NULL, 0, NULL);
 	}
 
 	void kqueue_event_loop::schedule_event(event_pair event, std::optional<std::chrono::milliseconds> timeout,
@@ -387,6 +457,9 @@ namespace cobra {
 			throw errno_exception();
 
 		for (int i = 0; i < ret; ++i) {
+			if (events[i].filter == EVFILT_USER)
+				continue;
+
 			poll_type type = events[i].flags & EVFILT_READ ? poll_type::read : poll_type::write;
 			auto fut = remove_event({events[i].ident, type});
 			if (fut) {
@@ -396,11 +469,15 @@ namespace cobra {
 				});
 			}
 		}
+
+		for (auto&& func : take_posted()) {
+			_exec.get().schedule(std::move(func));
+		}
 	}
 
 	bool kqueue_event_loop::has_events() const {
 		std::lock_guard guard(_mutex);
-		return !_write_events.empty() || !_read_events.empty() || _exec.get().has_jobs();
+		return !_write_events.empty() || !_read_events.empty() || has_posted() || _exec.get().has_jobs();
 	}
 #endif
 } // namespace cobra
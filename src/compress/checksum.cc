@@ -0,0 +1,388 @@
+#include "cobra/compress/checksum.hh"
+
+#include <algorithm>
+#include <array>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define COBRA_CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
+namespace cobra {
+	using checksum_kernel = std::uint32_t (*)(std::uint32_t, const unsigned char*, std::size_t);
+
+	constexpr std::uint32_t adler32_base = 65521;
+	// Largest amount of bytes that can be summed before the sums can overflow
+	constexpr std::size_t adler32_nmax = 5552;
+
+	constexpr auto crc32_tables = [] {
+		std::array<std::array<std::uint32_t, 256>, 8> tables{};
+
+		for (std::uint32_t i = 0; i < 256; i++) {
+			std::uint32_t crc = i;
+
+			for (int j = 0; j < 8; j++) {
+				crc = crc & 1 ? 0xEDB88320 ^ (crc >> 1) : crc >> 1;
+			}
+
+			tables[0][i] = crc;
+		}
+
+		for (std::size_t i = 0; i < 256; i++) {
+			for (std::size_t j = 1; j < tables.size(); j++) {
+				tables[j][i] = (tables[j - 1][i] >> 8) ^ tables[0][tables[j - 1][i] & 0xFF];
+			}
+		}
+
+		return tables;
+	}();
+
+	static std::uint32_t adler32_scalar(std::uint32_t adler, const unsigned char* data, std::size_t size) {
+		std::uint32_t a = adler & 0xFFFF;
+		std::uint32_t b = adler >> 16;
+
+		while (size > 0) {
+			std::size_t n = std::min(size, adler32_nmax);
+			size -= n;
+
+			while (n-- > 0) {
+				a += *data++;
+				b += a;
+			}
+
+			a %= adler32_base;
+			b %= adler32_base;
+		}
+
+		return b << 16 | a;
+	}
+
+	static std::uint32_t load_u32_le(const unsigned char* data) {
+		return static_cast<std::uint32_t>(data[0]) | static_cast<std::uint32_t>(data[1]) << 8 |
+			   static_cast<std::uint32_t>(data[2]) << 16 | static_cast<std::uint32_t>(data[3]) << 24;
+	}
+
+	// Slicing by 8, works on the crc before the final inversion
+	static std::uint32_t crc32_scalar(std::uint32_t crc, const unsigned char* data, std::size_t size) {
+		const auto& t = crc32_tables;
+
+		while (size >= 8) {
+			std::uint32_t lo = crc ^ load_u32_le(data);
+			std::uint32_t hi = load_u32_le(data + 4);
+
+			crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+				  t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+			data += 8;
+			size -= 8;
+		}
+
+		while (size-- > 0) {
+			crc = t[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+		}
+
+		return crc;
+	}
+
+#ifdef COBRA_CHECKSUM_X86
+	__attribute__((target("ssse3"))) static std::uint32_t sum_epi32(__m128i v) {
+		v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+		v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+		return static_cast<std::uint32_t>(_mm_cvtsi128_si32(v));
+	}
+
+	// Blocks of 32 bytes are summed in vector lanes, the prefix sums are only
+	// reduced modulo the base once per adler32_nmax bytes.
+	__attribute__((target("ssse3"))) static std::uint32_t adler32_ssse3(std::uint32_t adler,
+																		 const unsigned char* data, std::size_t size) {
+		constexpr std::size_t block_size = 32;
+
+		std::uint32_t a = adler & 0xFFFF;
+		std::uint32_t b = adler >> 16;
+		std::size_t blocks = size / block_size;
+
+		const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+		const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i ones = _mm_set1_epi16(1);
+
+		size -= blocks * block_size;
+
+		while (blocks > 0) {
+			std::size_t n = std::min(blocks, adler32_nmax / block_size);
+			blocks -= n;
+
+			__m128i ps = _mm_cvtsi32_si128(static_cast<int>(a * n));
+			__m128i s1 = zero;
+			__m128i s2 = _mm_cvtsi32_si128(static_cast<int>(b));
+
+			do {
+				const __m128i bytes1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+				const __m128i bytes2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+
+				ps = _mm_add_epi32(ps, s1);
+				s1 = _mm_add_epi32(s1, _mm_sad_epu8(bytes1, zero));
+				s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+				s1 = _mm_add_epi32(s1, _mm_sad_epu8(bytes2, zero));
+				s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+				data += block_size;
+			} while (--n > 0);
+
+			s2 = _mm_add_epi32(s2, _mm_slli_epi32(ps, 5));
+			a = (a + sum_epi32(s1)) % adler32_base;
+			b = sum_epi32(s2) % adler32_base;
+		}
+
+		return adler32_scalar(b << 16 | a, data, size);
+	}
+
+	__attribute__((target("avx2"))) static std::uint32_t adler32_avx2(std::uint32_t adler, const unsigned char* data,
+																	  std::size_t size) {
+		constexpr std::size_t block_size = 32;
+
+		std::uint32_t a = adler & 0xFFFF;
+		std::uint32_t b = adler >> 16;
+		std::size_t blocks = size / block_size;
+
+		const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15,
+											 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i ones = _mm256_set1_epi16(1);
+
+		size -= blocks * block_size;
+
+		while (blocks > 0) {
+			std::size_t n = std::min(blocks, adler32_nmax / block_size);
+			blocks -= n;
+
+			__m256i ps = _mm256_setr_epi32(static_cast<int>(a * n), 0, 0, 0, 0, 0, 0, 0);
+			__m256i s1 = zero;
+			__m256i s2 = _mm256_setr_epi32(static_cast<int>(b), 0, 0, 0, 0, 0, 0, 0);
+
+			do {
+				const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+
+				ps = _mm256_add_epi32(ps, s1);
+				s1 = _mm256_add_epi32(s1, _mm256_sad_epu8(bytes, zero));
+				s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+				data += block_size;
+			} while (--n > 0);
+
+			s2 = _mm256_add_epi32(s2, _mm256_slli_epi32(ps, 5));
+			a = (a + sum_epi32(_mm_add_epi32(_mm256_castsi256_si128(s1), _mm256_extracti128_si256(s1, 1)))) %
+				adler32_base;
+			b = sum_epi32(_mm_add_epi32(_mm256_castsi256_si128(s2), _mm256_extracti128_si256(s2, 1))) % adler32_base;
+		}
+
+		return adler32_scalar(b << 16 | a, data, size);
+	}
+
+	// Folds 64 bytes at a time with carry-less multiplication, see "Fast CRC
+	// Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+	__attribute__((target("pclmul,sse4.1"))) static std::uint32_t crc32_pclmul(std::uint32_t crc,
+																			   const unsigned char* data,
+																			   std::size_t size) {
+		if (size < 64) {
+			return crc32_scalar(crc, data, size);
+		}
+
+		alignas(16) static constexpr std::uint64_t k1k2[] = {0x0154442BD4, 0x01C6E41596};
+		alignas(16) static constexpr std::uint64_t k3k4[] = {0x01751997D0, 0x00CCAA009E};
+		alignas(16) static constexpr std::uint64_t k5k0[] = {0x0163CD6124, 0x0000000000};
+		alignas(16) static constexpr std::uint64_t poly[] = {0x01DB710641, 0x01F7011641};
+
+		const std::size_t rest = size % 16;
+		__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+		size -= rest;
+		x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x00));
+		x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x10));
+		x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x20));
+		x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x30));
+		x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+		x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+		data += 64;
+		size -= 64;
+
+		while (size >= 64) {
+			x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+			x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+			x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+			x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+			x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+			x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+			x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+			x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+			x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x00)));
+			x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x10)));
+			x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x20)));
+			x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x30)));
+
+			data += 64;
+			size -= 64;
+		}
+
+		x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+
+		for (__m128i next : {x2, x3, x4}) {
+			x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+			x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+			x1 = _mm_xor_si128(_mm_xor_si128(x1, next), x5);
+		}
+
+		while (size >= 16) {
+			x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+			x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+			x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+			x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+			data += 16;
+			size -= 16;
+		}
+
+		// Fold 128 bits down to 64 bits
+		x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+		x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+		x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+		x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+		x2 = _mm_srli_si128(x1, 4);
+		x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x00);
+		x1 = _mm_xor_si128(x1, x2);
+
+		// Barrett reduction down to 32 bits
+		x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+		x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x10);
+		x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, x3), x0, 0x00);
+		x1 = _mm_xor_si128(x1, x2);
+
+		return crc32_scalar(static_cast<std::uint32_t>(_mm_extract_epi32(x1, 1)), data, rest);
+	}
+#endif
+
+	static checksum_kernel select_adler32() {
+#ifdef COBRA_CHECKSUM_X86
+		__builtin_cpu_init();
+
+		if (__builtin_cpu_supports("avx2")) {
+			return adler32_avx2;
+		} else if (__builtin_cpu_supports("ssse3")) {
+			return adler32_ssse3;
+		}
+#endif
+		return adler32_scalar;
+	}
+
+	static checksum_kernel select_crc32() {
+#ifdef COBRA_CHECKSUM_X86
+		__builtin_cpu_init();
+
+		if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+			return crc32_pclmul;
+		}
+#endif
+		return crc32_scalar;
+	}
+
+	std::uint32_t adler32(std::uint32_t adler, const void* data, std::size_t size) {
+		static const checksum_kernel kernel = select_adler32();
+		return kernel(adler, static_cast<const unsigned char*>(data), size);
+	}
+
+	std::uint32_t crc32(std::uint32_t crc, const void* data, std::size_t size) {
+		static const checksum_kernel kernel = select_crc32();
+		return ~kernel(~crc, static_cast<const unsigned char*>(data), size);
+	}
+
+	template <checksum_kernel Kernel>
+	static std::uint32_t adler32_variant(std::uint32_t adler, const void* data, std::size_t size) {
+		return Kernel(adler, static_cast<const unsigned char*>(data), size);
+	}
+
+	template <checksum_kernel Kernel>
+	static std::uint32_t crc32_variant(std::uint32_t crc, const void* data, std::size_t size) {
+		return ~Kernel(~crc, static_cast<const unsigned char*>(data), size);
+	}
+
+	std::vector<checksum_variant> adler32_variants() {
+		std::vector<checksum_variant> variants{{"scalar", adler32_variant<adler32_scalar>}};
+
+#ifdef COBRA_CHECKSUM_X86
+		__builtin_cpu_init();
+
+		if (__builtin_cpu_supports("ssse3")) {
+			variants.push_back({"ssse3", adler32_variant<adler32_ssse3>});
+		}
+
+		if (__builtin_cpu_supports("avx2")) {
+			variants.push_back({"avx2", adler32_variant<adler32_avx2>});
+		}
+#endif
+		return variants;
+	}
+
+	std::vector<checksum_variant> crc32_variants() {
+		std::vector<checksum_variant> variants{{"scalar", crc32_variant<crc32_scalar>}};
+
+#ifdef COBRA_CHECKSUM_X86
+		__builtin_cpu_init();
+
+		if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+			variants.push_back({"pclmul", crc32_variant<crc32_pclmul>});
+		}
+#endif
+		return variants;
+	}
+
+	std::uint32_t adler32_combine(std::uint32_t adler1, std::uint32_t adler2, std::uint64_t size2) {
+		const std::uint32_t rem = size2 % adler32_base;
+		std::uint32_t a = adler1 & 0xFFFF;
+		std::uint32_t b = rem * a % adler32_base;
+
+		a += (adler2 & 0xFFFF) + adler32_base - 1;
+		b += (adler1 >> 16) + (adler2 >> 16) + adler32_base - rem;
+		a %= adler32_base;
+		b %= adler32_base;
+		return b << 16 | a;
+	}
+
+	// Multiplies two polynomials modulo the crc polynomial, bits are reflected
+	static constexpr std::uint32_t crc32_multiply(std::uint32_t a, std::uint32_t b) {
+		std::uint32_t product = 0;
+
+		for (std::uint32_t mask = 1u << 31; mask != 0; mask >>= 1) {
+			if (a & mask) {
+				product ^= b;
+			}
+
+			b = b & 1 ? 0xEDB88320 ^ (b >> 1) : b >> 1;
+		}
+
+		return product;
+	}
+
+	// x^(2^n) modulo the crc polynomial, which repeats after 32 entries
+	constexpr auto crc32_powers = [] {
+		std::array<std::uint32_t, 32> powers{};
+		std::uint32_t power = 1u << 30;
+
+		for (std::size_t n = 0; n < powers.size(); n++) {
+			powers[n] = power;
+			power = crc32_multiply(power, power);
+		}
+
+		return powers;
+	}();
+
+	std::uint32_t crc32_combine(std::uint32_t crc1, std::uint32_t crc2, std::uint64_t size2) {
+		// Appending size2 zero bytes multiplies crc1 by x^(8 * size2)
+		std::uint32_t shift = 1u << 31;
+
+		for (std::size_t n = 3; size2 != 0; size2 >>= 1, n++) {
+			if (size2 & 1) {
+				shift = crc32_multiply(crc32_powers[n % crc32_powers.size()], shift);
+			}
+		}
+
+		return crc32_multiply(shift, crc1) ^ crc2;
+	}
+} // namespace cobra
@@ -733,6 +733,55 @@ namespace cobra {
 			return error_page{code, std::move(file)};
 		}
 
+		compression_config compression_config::parse(parse_session& session) {
+			word w = session.get_word_simple("string", "level");
+
+			if (w.str() == "off") {
+				return {std::nullopt};
+			} else if (w.str() == "fastest") {
+				return {lz_level_fastest};
+			} else if (w.str().length() == 1 && w.str()[0] >= '1' && w.str()[0] <= '0' + lz_level_max) {
+				return {w.str()[0] - '0'};
+			} else {
+				diagnostic diag = diagnostic::error(w.part(), COBRA_TEXT("invalid compression level"),
+													COBRA_TEXT("expected `off`, `fastest` or a level from 1 to {}",
+															   lz_level_max));
+				throw error(diag);
+			}
+		}
+
+		compress_type compress_type::parse(parse_session& session) {
+			word w = session.get_word_simple("string", "type");
+			std::string type = w.str();
+
+			std::transform(type.begin(), type.end(), type.begin(), [](unsigned char ch) {
+				return std::tolower(ch);
+			});
+
+			if (type.size() < 2 || (type[0] != '.' && type.find('/') == std::string::npos)) {
+				diagnostic diag =
+					diagnostic::error(w.part(), COBRA_TEXT("invalid compression type"),
+									  COBRA_TEXT("expected a mime type like `text/*` or an extension like `.js`"));
+				throw error(diag);
+			}
+
+			return {std::move(type)};
+		}
+
+		adaptive_compression_config adaptive_compression_config::parse(parse_session& session) {
+			word w = session.get_word_simple("string", "adaptive compression");
+
+			if (w.str() == "true") {
+				return {true};
+			} else if (w.str() == "false") {
+				return {false};
+			} else {
+				diagnostic diag = diagnostic::error(w.part(), COBRA_TEXT("invalid adaptive compression option"),
+													COBRA_TEXT("expected either `true` or `false`"));
+				throw error(diag);
+			}
+		}
+
 		redirect_config redirect_config::parse(parse_session& session) {
 			std::optional<word> w;
 
@@ -1254,6 +1303,23 @@ namespace cobra {
 			}
 		}
 
+		void block_config::parse_compress_level(parse_session& session) {
+			parse_and_assign_warn_reassign(_compression, "compress_level", session);
+		}
+
+		void block_config::parse_compress_type(parse_session& session) {
+			auto def = parse_define<compress_type>(session, "compress_type");
+
+			auto [it, inserted] = _compress_types.insert(def);
+			if (!inserted) {
+				warn_duplicate(def.part, it->part, "compress_type", session);
+			}
+		}
+
+		void block_config::parse_compress_adaptive(parse_session& session) {
+			parse_and_assign_warn_reassign(_adaptive_compression, "compress_adaptive", session);
+		}
+
 		void block_config::parse_root(parse_session& session) {
 			parse_and_assign_warn_reassign(_root, "root", session);
 		}
@@ -1342,6 +1408,10 @@ namespace cobra {
 				index = cfg._index->def.file();
 			if (cfg._root)
 				root = cfg._root->def.dir();
+			if (cfg._compression)
+				compress_level = cfg._compression->def.level;
+			if (cfg._adaptive_compression)
+				compress_adaptive = cfg._adaptive_compression->def.enabled;
 
 			if (cfg._handler) {
 				if (auto h = std::get_if<static_file_config>(&cfg._handler->def)) {
@@ -1369,6 +1439,10 @@ namespace cobra {
 				extensions.insert(extension.def.ext);
 			}
 
+			for (auto& type : cfg._compress_types) {
+				compress_types.insert(type.def.type);
+			}
+
 			for (auto [code, def] : cfg._error_pages) {
 				error_pages.insert({code, def->file});
 			}
@@ -1393,6 +1467,12 @@ namespace cobra {
 					root = parent->root;
 				if (!max_body_size)
 					max_body_size = parent->max_body_size;
+				if (!cfg._compression)
+					compress_level = parent->compress_level;
+				if (!cfg._adaptive_compression)
+					compress_adaptive = parent->compress_adaptive;
+				if (compress_types.empty())
+					compress_types = parent->compress_types;
 				if (!handler)
 					handler = parent->handler;
 				if (server_names.empty())
@@ -1427,6 +1507,21 @@ namespace cobra {
 
 			if (max_body_size)
 				println(stream, "{}max_body_size: {}", spacing, *max_body_size);
+			if (compress_level)
+				println(stream, "{}compress_level: {}", spacing, *compress_level);
+			else
+				println(stream, "{}compress_level: off", spacing);
+			println(stream, "{}compress_adaptive: {}", spacing, compress_adaptive);
+
+			if (!compress_types.empty())
+				print(stream, "{}compress_types: ", spacing);
+
+			for (auto& type : compress_types) {
+				print(stream, "{} ", type);
+			}
+
+			if (!compress_types.empty())
+				println(stream, "");
 			if (index)
 				println(stream, "{}index: {}", spacing, index->string());
 
@@ -0,0 +1,357 @@
+#include "cobra/http/access_log.hh"
+
+#include "cobra/print.hh"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <format>
+#include <string_view>
+
+extern "C" {
+#include <sys/uio.h>
+}
+
+namespace cobra {
+	class access_log_record {
+		char* _data;
+		std::size_t _size = 0;
+
+	public:
+		// The last byte is kept free for the terminating newline
+		static constexpr std::size_t capacity = access_log_record_size - 1;
+
+		access_log_record(char* data) : _data(data) {}
+
+		template <class... Args>
+		void print(std::format_string<Args...> fmt, Args&&... args) {
+			auto result = std::format_to_n(_data + _size, capacity - _size, fmt, std::forward<Args>(args)...);
+			_size = std::min(capacity, _size + static_cast<std::size_t>(result.size));
+		}
+
+		void put(char ch) {
+			if (_size < capacity) {
+				_data[_size++] = ch;
+			}
+		}
+
+		void print_json(std::string_view str) {
+			static constexpr char hex[] = "0123456789abcdef";
+
+			put('"');
+
+			for (unsigned char ch : str) {
+				if (ch == '"' || ch == '\\') {
+					put('\\');
+					put(ch);
+				} else if (ch < 0x20) {
+					print("\\u00{}{}", hex[ch >> 4], hex[ch & 0xf]);
+				} else {
+					put(ch);
+				}
+			}
+
+			put('"');
+		}
+
+		// Quoted the way nginx and apache write quoted fields of the combined format
+		void print_quoted(std::string_view str) {
+			static constexpr char hex[] = "0123456789ABCDEF";
+
+			put('"');
+
+			for (unsigned char ch : str) {
+				if (ch == '"' || ch == '\\') {
+					put('\\');
+					put(ch);
+				} else if (ch < 0x20 || ch >= 0x7f) {
+					put('\\');
+					put('x');
+					put(hex[ch >> 4]);
+					put(hex[ch & 0xf]);
+				} else {
+					put(ch);
+				}
+			}
+
+			put('"');
+		}
+
+		std::size_t end() {
+			_data[_size++] = '\n';
+			return _size;
+		}
+	};
+
+	struct access_log_time {
+		std::time_t time = -1;
+		std::tm tm;
+	};
+
+	static const std::tm& access_log_now() {
+		thread_local access_log_time cached;
+
+		std::time_t now = std::time(nullptr);
+
+		if (now != cached.time) {
+			gmtime_r(&now, &cached.tm);
+			cached.time = now;
+		}
+
+		return cached.tm;
+	}
+
+	static term::control access_log_color(http_response_code code) {
+		switch (code / 100) {
+		case 1:
+			return term::fg_cyan();
+		case 2:
+			return term::fg_green();
+		case 3:
+			return term::fg_yellow();
+		case 4:
+			return term::fg_red();
+		case 5:
+			return term::fg_magenta();
+		default:
+			return term::control();
+		}
+	}
+
+	access_log::access_log(file out, access_log_options options)
+		: _file(std::move(out)), _options(options),
+		  _slots(std::make_unique<slot[]>(std::bit_ceil(std::max<std::size_t>(options.capacity, 2)))),
+		  _mask(std::bit_ceil(std::max<std::size_t>(options.capacity, 2)) - 1) {
+		for (std::size_t i = 0; i <= _mask; ++i) {
+			_slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
+		_writer = std::thread(&access_log::run, this);
+	}
+
+	access_log::~access_log() {
+		_stop.store(true, std::memory_order_release);
+		_pending.fetch_add(1, std::memory_order_release);
+		_pending.notify_one();
+		_writer.join();
+	}
+
+	std::size_t access_log::format(char* data, const basic_socket_stream* socket, const http_request* request,
+								   const http_response& response) const {
+		static constexpr std::string_view months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+													  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+		access_log_record record(data);
+		std::string peer = socket ? socket->peername().string() : "-";
+
+		switch (_options.format) {
+		case access_log_format::simple: {
+			term::control ctrl = _options.color ? access_log_color(response.code()) : term::control();
+
+			record.print("{}[{}]", ctrl, response.code());
+
+			if (socket) {
+				record.print(" {}", peer);
+			}
+
+			if (request) {
+				if (socket) {
+					record.print(" ->");
+				}
+
+				record.print(" {} {}", request->method(), request->uri().string());
+			}
+
+			if (_options.color) {
+				record.print("{}", term::reset());
+			}
+
+			break;
+		}
+		case access_log_format::combined: {
+			const std::tm& tm = access_log_now();
+
+			record.print("{} - - [{:02}/{}/{:04}:{:02}:{:02}:{:02} +0000] ", peer, tm.tm_mday, months[tm.tm_mon],
+						 tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+			if (request) {
+				record.print_quoted(std::format("{} {} HTTP/{}.{}", request->method(), request->uri().string(),
+												request->version().major(), request->version().minor()));
+				record.put(' ');
+			} else {
+				record.print("\"-\" ");
+			}
+
+			record.print("{} ", response.code());
+
+			if (response.has_header("Content-Length")) {
+				record.print("{}", response.header("Content-Length"));
+			} else {
+				record.print("-");
+			}
+
+			record.put(' ');
+			record.print_quoted(request && request->has_header("Referer") ? request->header("Referer") : "-");
+			record.put(' ');
+			record.print_quoted(request && request->has_header("User-Agent") ? request->header("User-Agent") : "-");
+			break;
+		}
+		case access_log_format::json: {
+			const std::tm& tm = access_log_now();
+
+			record.print("{{\"time\":\"{:04}-{:02}-{:02}T{:02}:{:02}:{:02}Z\",\"status\":{}", tm.tm_year + 1900,
+						 tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, response.code());
+
+			if (socket) {
+				record.print(",\"peer\":");
+				record.print_json(peer);
+			}
+
+			if (request) {
+				record.print(",\"method\":");
+				record.print_json(request->method());
+				record.print(",\"uri\":");
+				record.print_json(request->uri().string());
+			}
+
+			record.print("}}");
+			break;
+		}
+		}
+
+		return record.end();
+	}
+
+	void access_log::log(const basic_socket_stream* socket, const http_request* request,
+						 const http_response& response) {
+		std::size_t pos = _head.load(std::memory_order_relaxed);
+		slot* current;
+
+		while (true) {
+			current = &_slots[pos & _mask];
+			std::size_t sequence = current->sequence.load(std::memory_order_acquire);
+			std::intptr_t diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+
+			if (diff == 0) {
+				if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				if (_options.overflow == access_log_overflow::drop) {
+					_dropped.fetch_add(1, std::memory_order_relaxed);
+					return;
+				}
+
+				std::this_thread::yield();
+				pos = _head.load(std::memory_order_relaxed);
+			} else {
+				pos = _head.load(std::memory_order_relaxed);
+			}
+		}
+
+		current->size = format(current->data, socket, request, response);
+		current->sequence.store(pos + 1, std::memory_order_release);
+		_pending.fetch_add(1, std::memory_order_release);
+		_pending.notify_one();
+	}
+
+	void access_log::write_batch(slot** slots, std::size_t count) {
+		iovec iov[access_log_batch_size];
+		iovec* first = iov;
+		iovec* last = iov + count;
+
+		for (std::size_t i = 0; i < count; ++i) {
+			iov[i].iov_base = slots[i]->data;
+			iov[i].iov_len = slots[i]->size;
+		}
+
+		while (first != last) {
+			ssize_t rc = ::writev(_file.fd(), first, static_cast<int>(last - first));
+
+			if (rc < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+
+				// Nothing sensible left to do with the records, count them as lost
+				_dropped.fetch_add(last - first, std::memory_order_relaxed);
+				count -= last - first;
+				break;
+			}
+
+			std::size_t size = rc;
+
+			while (first != last && size >= first->iov_len) {
+				size -= first->iov_len;
+				++first;
+			}
+
+			if (first != last) {
+				first->iov_base = static_cast<char*>(first->iov_base) + size;
+				first->iov_len -= size;
+			}
+		}
+
+		_written.fetch_add(count, std::memory_order_relaxed);
+	}
+
+	void access_log::report_dropped(std::size_t& reported) {
+		std::size_t count = dropped();
+
+		if (count != reported) {
+			eprintln("access log: dropped {} record(s)", count - reported);
+			reported = count;
+		}
+	}
+
+	void access_log::run() {
+		using clock = std::chrono::steady_clock;
+
+		slot* batch[access_log_batch_size];
+		std::size_t pos = 0;
+		std::size_t reported = 0;
+		clock::time_point last_report = clock::now();
+
+		while (true) {
+			std::size_t pending = _pending.load(std::memory_order_acquire);
+			std::size_t count = 0;
+
+			while (count < access_log_batch_size) {
+				slot& current = _slots[(pos + count) & _mask];
+
+				if (current.sequence.load(std::memory_order_acquire) != pos + count + 1) {
+					break;
+				}
+
+				batch[count++] = &current;
+			}
+
+			if (count == 0) {
+				if (_stop.load(std::memory_order_acquire)) {
+					break;
+				}
+
+				_pending.wait(pending, std::memory_order_acquire);
+				continue;
+			}
+
+			write_batch(batch, count);
+
+			for (std::size_t i = 0; i < count; ++i) {
+				batch[i]->sequence.store(pos + i + _mask + 1, std::memory_order_release);
+			}
+
+			pos += count;
+
+			// Records are only dropped while the writer is busy, so this is checked between batches
+			if (clock::now() - last_report >= access_log_report_interval) {
+				report_dropped(reported);
+				last_report = clock::now();
+			}
+		}
+
+		report_dropped(reported);
+	}
+} // namespace cobra
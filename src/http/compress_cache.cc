@@ -0,0 +1,104 @@
+#include "cobra/http/compress_cache.hh"
+
+#include <exception>
+#include <utility>
+
+namespace cobra {
+	std::size_t compress_cache_hash::operator()(const compress_cache_key& key) const {
+		std::size_t hash = std::hash<std::string>()(key.path);
+
+		for (std::uint64_t value : {key.device, key.inode, static_cast<std::uint64_t>(key.mtime),
+									static_cast<std::uint64_t>(key.mode), static_cast<std::uint64_t>(key.level)}) {
+			hash ^= std::hash<std::uint64_t>()(value) + 0x9e3779b97f4a7c15 + (hash << 6) + (hash >> 2);
+		}
+
+		return hash;
+	}
+
+	compress_cache::compress_cache(std::size_t capacity) : _capacity(capacity) {}
+
+	void compress_cache::evict() {
+		while (_size > _capacity && !_lru.empty()) {
+			auto it = _entries.find(_lru.back());
+
+			if (it->second.value->data) {
+				_size -= it->second.value->data->size();
+			}
+
+			_entries.erase(it);
+			_lru.pop_back();
+		}
+	}
+
+	void compress_cache::erase(const compress_cache_key& key, const std::shared_ptr<entry>& value) {
+		std::lock_guard lock(_mutex);
+		auto it = _entries.find(key);
+
+		if (it != _entries.end() && it->second.value == value) {
+			_lru.erase(it->second.position);
+			_entries.erase(it);
+		}
+	}
+
+	task<compress_cache::value_type> compress_cache::get(compress_cache_key key, executor* exec,
+														 populate_function populate) {
+		std::shared_ptr<entry> current;
+		bool owner = false;
+
+		{
+			std::lock_guard lock(_mutex);
+			auto it = _entries.find(key);
+
+			if (it != _entries.end()) {
+				_lru.splice(_lru.begin(), _lru, it->second.position);
+				current = it->second.value;
+
+				if (current->data) {
+					co_return current->data;
+				}
+			} else {
+				current = std::make_shared<entry>(exec);
+				// Nobody else can see the entry yet, so this cannot fail
+				owner = current->mutex.try_lock();
+				_lru.push_front(key);
+				_entries.emplace(key, slot{current, _lru.begin()});
+			}
+		}
+
+		if (!owner) {
+			// Only returns once the owner has populated the entry or given up
+			async_lock lock = co_await async_lock::lock(current->mutex);
+			std::lock_guard guard(_mutex);
+			co_return current->data;
+		}
+
+		std::exception_ptr error;
+		std::string data;
+
+		try {
+			data = co_await populate();
+		} catch (...) {
+			error = std::current_exception();
+		}
+
+		if (error) {
+			erase(key, current);
+			current->mutex.unlock();
+			std::rethrow_exception(error);
+		}
+
+		{
+			std::lock_guard lock(_mutex);
+			current->data = std::make_shared<const std::string>(std::move(data));
+			auto it = _entries.find(key);
+
+			if (it != _entries.end() && it->second.value == current) {
+				_size += current->data->size();
+				evict();
+			}
+		}
+
+		current->mutex.unlock();
+		co_return current->data;
+	}
+} // namespace cobra
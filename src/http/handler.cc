@@ -3,6 +3,7 @@
 #include "cobra/asyncio/generator_stream.hh"
 #include "cobra/asyncio/std_stream.hh"
 #include "cobra/fastcgi.hh"
+#include "cobra/http/compress_cache.hh"
 #include "cobra/http/parse.hh"
 #include "cobra/net/stream.hh"
 #include "cobra/print.hh"
@@ -17,8 +18,13 @@
 #include <format>
 #include <fstream>
 #include <optional>
+#include <sstream>
 #include <stdexcept>
 
+extern "C" {
+#include <sys/stat.h>
+}
+
 namespace cobra {
 	// ODOT: sanitize header keys and values
 	static generator<std::pair<std::string, std::string>> get_cgi_params(const handle_context<cgi_config>& context) {
@@ -157,12 +163,104 @@ namespace cobra {
 		co_yield "</table></body></html>";
 	}
 
-	task<void> handle_static(http_response_writer writer, const handle_context<static_config>& context,
-							 std::optional<http_response_code> code) {
+	static bool is_fresh_sidecar(const std::filesystem::path& path, const std::filesystem::path& sidecar) {
+		std::error_code ec;
+
+		// Empty sidecars mark files that do not get any smaller
+		if (!std::filesystem::is_regular_file(sidecar, ec) || std::filesystem::file_size(sidecar, ec) == 0 || ec) {
+			return false;
+		}
+
+		auto sidecar_time = std::filesystem::last_write_time(sidecar, ec);
+
+		if (ec) {
+			return false;
+		}
+
+		auto path_time = std::filesystem::last_write_time(path, ec);
+		return !ec && sidecar_time >= path_time;
+	}
+
+	constexpr std::size_t compress_cache_capacity = 64 * 1024 * 1024;
+	// Bigger files are compressed while they are sent instead
+	constexpr std::size_t compress_cache_max_file = 4 * 1024 * 1024;
+
+	static task<std::string> compress_file(std::filesystem::path path, std::size_t size, deflate_mode mode,
+										   int level) {
+		istream_buffer input(file_istream(path.c_str()), COBRA_BUFFER_SIZE);
+
+		if (!input.inner()) {
+			throw std::filesystem::filesystem_error("failed to open file", path,
+													std::make_error_code(std::errc::no_such_file_or_directory));
+		}
+
+		deflate_ostream output(std_ostream<std::ostringstream>(std::ostringstream()), mode, level);
+		co_await pipe(buffered_istream_reference(input), ostream_reference(output));
+		std_ostream<std::ostringstream> result = co_await std::move(output).end();
+		std::string data = result.inner().str();
+
+		// An empty entry marks a file that does not get any smaller
+		if (data.size() >= size) {
+			data.clear();
+		}
+
+		co_return data;
+	}
+
+	// Misses are compressed on compress_exec when there is one and the caller
+	// continues on resume afterwards, like the parallel deflate stream does.
+	static task<compress_cache::value_type> cached_compress(const std::filesystem::path& path, std::size_t size,
+															deflate_mode mode, int level, executor* exec,
+															executor* compress_exec, executor* resume) {
+		static compress_cache cache(compress_cache_capacity);
+		struct stat st;
+
+		if (::stat(path.c_str(), &st) != 0) {
+			co_return nullptr;
+		}
+
+		compress_cache_key key{path.string(),
+							   static_cast<std::uint64_t>(st.st_dev),
+							   static_cast<std::uint64_t>(st.st_ino),
+							   std::filesystem::last_write_time(path).time_since_epoch().count(),
+							   mode,
+							   level};
+
+		compress_cache::populate_function populate = [path, size, mode, level, compress_exec,
+													  resume]() -> task<std::string> {
+			if (!compress_exec) {
+				co_return co_await compress_file(path, size, mode, level);
+			}
+
+			std::exception_ptr error;
+			std::string data;
+
+			try {
+				data = co_await compress_exec->schedule(compress_file(path, size, mode, level));
+			} catch (...) {
+				error = std::current_exception();
+			}
+
+			if (resume) {
+				co_await resume->schedule();
+			}
+
+			if (error) {
+				std::rethrow_exception(error);
+			}
+
+			co_return data;
+		};
+
+		co_return co_await cache.get(std::move(key), exec, std::move(populate));
+	}
+
+	task<http_result<void>> handle_static(http_response_writer writer, const handle_context<static_config>& context,
+										  std::optional<http_response_code> code) {
 		std::filesystem::path path = context.root() + context.file();
 
 		if (context.request().method() != "GET") {
-			throw HTTP_METHOD_NOT_ALLOWED;
+			co_return http_error(HTTP_METHOD_NOT_ALLOWED);
 		}
 
 		try {
@@ -173,40 +271,96 @@ namespace cobra {
 					resp.set_header("Content-type", "text/html");
 					http_ostream sock_ostream = co_await std::move(writer).send(resp);
 					co_await pipe(buffered_istream_reference(dir_istream), ostream_reference(sock_ostream));
-					co_return;
+					co_return {};
 				} else {
-					throw HTTP_NOT_FOUND;
+					co_return http_error(HTTP_NOT_FOUND);
 				}
 			}
 		} catch (const std::filesystem::filesystem_error&) {
-			throw HTTP_NOT_FOUND;
+			co_return http_error(HTTP_NOT_FOUND);
 		}
 
 		try {
-			std::size_t size = std::filesystem::file_size(path);
+			writer.set_content_path(path.string());
+
+			const std::string_view type = file_content_type(path.string()).value_or("");
+			std::optional<deflate_mode> precompressed = writer.encoding(type);
+			std::filesystem::path source = path;
+
+			if (precompressed) {
+				source += precompressed_extension(*precompressed);
+
+				if (!is_fresh_sidecar(path, source)) {
+					source = path;
+					precompressed = std::nullopt;
+				}
+			}
+
+			std::size_t size = std::filesystem::file_size(source);
 			// istream_buffer file_istream(file_istream(path.c_str()), COBRA_BUFFER_SIZE); doesn't work on g++
-			istream_buffer fis(file_istream(path.c_str()), COBRA_BUFFER_SIZE);
+			istream_buffer fis(file_istream(source.c_str()), COBRA_BUFFER_SIZE);
 
 			if (!fis.inner()) {
-				throw HTTP_NOT_FOUND;
+				co_return http_error(HTTP_NOT_FOUND);
+			}
+
+			if (!writer.acceptable(type)) {
+				co_return http_error(HTTP_NOT_ACCEPTABLE);
+			}
+
+			compress_cache::value_type cached;
+
+			if (!precompressed && writer.can_compress(type) && size <= compress_cache_max_file) {
+				cached = co_await cached_compress(path, size, *writer.encoding(type), writer.encoding_level(),
+												  context.exec(), writer.compress_executor(), writer.resume_executor());
 			}
 
 			http_response resp(code.value_or(HTTP_OK));
 
-			if (!writer.can_compress()) {
+			if (!type.empty()) {
+				resp.set_header("Content-Type", std::string(type));
+			}
+
+			if (cached && cached->empty()) {
+				cached = nullptr;
+				writer.set_compress_level(std::nullopt);
+			} else if (!cached && writer.can_compress(type) && writer.compress_adaptive()) {
+				auto [data, sample_size] = co_await fis.fill_buf();
+
+				if (is_incompressible(data, sample_size)) {
+					writer.set_compress_level(std::nullopt);
+				}
+			}
+
+			if (cached) {
+				resp.set_header("Content-Encoding", content_coding(*writer.encoding(type)));
+				resp.set_header("Vary", "Accept-Encoding");
+				resp.add_header("Content-Length", std::format("{}", cached->size()));
+				http_ostream sock_ostream = co_await std::move(writer).send(resp);
+				co_await sock_ostream.write_all(cached->data(), cached->size());
+				co_return {};
+			}
+
+			if (precompressed) {
+				resp.set_header("Content-Encoding", content_coding(*precompressed));
+				resp.set_header("Vary", "Accept-Encoding");
+				resp.add_header("Content-Length", std::format("{}", size));
+			} else if (!writer.can_compress(type)) {
 				resp.add_header("Content-Length", std::format("{}", size));
 			}
 
 			http_ostream sock_ostream = co_await std::move(writer).send(resp);
 			co_await pipe(buffered_istream_reference(fis), ostream_reference(sock_ostream));
 		} catch (const std::filesystem::filesystem_error&) {
-			throw HTTP_NOT_FOUND;
+			co_return http_error(HTTP_NOT_FOUND);
 		} catch (const std::ifstream::failure&) {
-			throw HTTP_NOT_FOUND;
+			co_return http_error(HTTP_NOT_FOUND);
 		}
+
+		co_return {};
 	}
 
-	task<void> handle_cgi_response(buffered_istream_reference istream, http_response_writer writer) {
+	task<http_result<void>> handle_cgi_response(buffered_istream_reference istream, http_response_writer writer) {
 		http_header_map header_map = co_await parse_cgi(istream);
 		http_response_code code = 200;
 		std::string reason_phrase;
@@ -214,17 +368,17 @@ namespace cobra {
 		if (header_map.contains("Status")) {
 			auto& val = header_map.at("Status");
 			if (val.length() < 5) {
-				throw HTTP_BAD_GATEWAY;
+				co_return http_error(HTTP_BAD_GATEWAY);
 			}
 
 			auto tmp = parse_unsigned_strict<http_response_code>(val.substr(0, 3), 999);
 			if (!tmp)
-				throw HTTP_BAD_GATEWAY;
+				co_return http_error(HTTP_BAD_GATEWAY);
 			code = *tmp;
 
 			// code = std::stoi(val.substr(0, 3));
 			if (val[3] != ' ') {
-				throw HTTP_BAD_GATEWAY;
+				co_return http_error(HTTP_BAD_GATEWAY);
 			}
 
 			reason_phrase = val.substr(4);
@@ -240,8 +394,10 @@ namespace cobra {
 			http_ostream sock = co_await std::move(writer).send(response);
 			co_await pipe(istream, ostream_reference(sock));
 		} else {
-			throw HTTP_NOT_FOUND;
+			co_return http_error(HTTP_NOT_FOUND);
 		}
+
+		co_return {};
 	}
 
 	template <class T>
@@ -253,13 +409,24 @@ namespace cobra {
 		}
 	}
 
+	template <class T, class U>
+	static task<void> try_await(std::exception_ptr& ptr, T& awaitable, U& result) {
+		try {
+			result = co_await awaitable;
+		} catch (...) {
+			ptr = std::current_exception();
+		}
+	}
+
 	static void try_throw(std::exception_ptr ptr) {
 		if (ptr) {
 			std::rethrow_exception(ptr);
 		}
 	}
 
-	task<void> handle_cgi(http_response_writer writer, const handle_context<cgi_config>& context) {
+	task<http_result<void>> handle_cgi(http_response_writer writer, const handle_context<cgi_config>& context) {
+		http_result<void> result;
+
 		if (const auto* config = context.config().cmd()) {
 			command cmd({config->cmd(), context.root() + context.file()});
 
@@ -282,13 +449,13 @@ namespace cobra {
 				try_throw(ptr);
 			}(context.istream(), proc_ostream));
 
-			auto sock_writer = context.exec()->schedule([](auto& proc, auto writer) -> task<void> {
-				co_await handle_cgi_response(proc, std::move(writer));
+			auto sock_writer = context.exec()->schedule([](auto& proc, auto writer) -> task<http_result<void>> {
+				co_return co_await handle_cgi_response(proc, std::move(writer));
 			}(proc_istream, std::move(writer)));
 
 			std::exception_ptr ptr;
 			co_await try_await(ptr, proc_writer);
-			co_await try_await(ptr, sock_writer);
+			co_await try_await(ptr, sock_writer, result);
 			auto coro = proc.wait();
 			co_await try_await(ptr, coro);
 			try_throw(ptr);
@@ -343,8 +510,8 @@ namespace cobra {
 					try_throw(ptr);
 				}(context.istream(), fcgi_ostream, fcgi_connection, *fcgi_client, fcgi));
 
-			auto sock_writer = context.exec()->schedule([](auto& fcgi, auto writer) -> task<void> {
-				co_await handle_cgi_response(fcgi, std::move(writer));
+			auto sock_writer = context.exec()->schedule([](auto& fcgi, auto writer) -> task<http_result<void>> {
+				co_return co_await handle_cgi_response(fcgi, std::move(writer));
 			}(fcgi_istream, std::move(writer)));
 
 			while (co_await fcgi_connection.poll())
@@ -352,16 +519,20 @@ namespace cobra {
 
 			std::exception_ptr ptr;
 			co_await try_await(ptr, fcgi_writer);
-			co_await try_await(ptr, sock_writer);
+			co_await try_await(ptr, sock_writer, result);
 			try_throw(ptr);
 		}
+
+		co_return result;
 	}
 
-	task<void> handle_redirect(http_response_writer writer, const handle_context<redirect_config>& context) {
+	task<http_result<void>> handle_redirect(http_response_writer writer,
+											const handle_context<redirect_config>& context) {
 		std::string path = context.config().root() + context.file();
 		http_response response(context.config().code());
 		response.set_header("Location", path);
 		co_await std::move(writer).send(response);
+		co_return {};
 	}
 
 	void forward_headers(http_message& to, const http_message& from) {
@@ -386,7 +557,12 @@ namespace cobra {
 		}
 	}
 
-	task<void> handle_proxy(http_response_writer writer, const handle_context<proxy_config>& context) {
+	static bool has_body(const http_request& request, const http_response& response) {
+		return request.method() != "HEAD" && response.code() >= 200 && response.code() != HTTP_NO_CONTENT &&
+			   response.code() != HTTP_NOT_MODIFIED;
+	}
+
+	task<http_result<void>> handle_proxy(http_response_writer writer, const handle_context<proxy_config>& context) {
 		try {
 			socket_stream gate = co_await open_connection(context.loop(), context.config().node().c_str(),
 														  context.config().service().c_str());
@@ -394,6 +570,8 @@ namespace cobra {
 			ostream_buffer gate_ostream(make_ostream_ref(gate), COBRA_BUFFER_SIZE);
 			http_request gate_request(context.request().method(), context.request().uri());
 			forward_headers(gate_request, context.request());
+			// Either one can be decoded again for clients that do not accept it
+			gate_request.set_header("Accept-Encoding", "gzip, deflate");
 
 			co_await write_http_request(gate_ostream, gate_request);
 
@@ -402,30 +580,56 @@ namespace cobra {
 				// co_await gate.inner().ptr()->shutdown(shutdown_how::write);
 			}(context.istream(), gate_ostream));
 
-			auto sock_writer = context.exec()->schedule([](auto& gate, auto writer) -> task<void> {
+			auto sock_writer = context.exec()->schedule([](auto& gate, auto writer,
+														   const http_request& request) -> task<void> {
 				http_response gate_response = co_await parse_http_response(gate);
 				http_response response(gate_response.code(), gate_response.reason());
 				forward_headers(response, gate_response);
+
+				std::optional<deflate_mode> coding = content_encoding(gate_response);
+				// Decided without the body so HEAD gets the same headers as GET
+				bool decode = coding && !accept_coding(request, *coding);
+
+				if (!identity_encoding(gate_response)) {
+					response.add_header("Vary", "Accept-Encoding");
+
+					if (decode) {
+						// Only compressed again for clients that refuse identity
+						response.remove_header("Content-Length");
+						writer.set_compress_level(std::nullopt);
+					} else {
+						response.set_header("Content-Encoding", gate_response.header("Content-Encoding"));
+					}
+				}
+
 				http_ostream sock = co_await std::move(writer).send(response);
 				http_istream_variant<buffered_istream_reference> gate_stream =
 					get_istream(buffered_istream_reference(gate), gate_response);
-				co_await pipe(buffered_istream_reference(gate_stream), ostream_reference(sock));
-			}(gate_istream, std::move(writer)));
+
+				if (decode && has_body(request, gate_response)) {
+					inflate_istream body(buffered_istream_reference(gate_stream), *coding);
+					co_await pipe(buffered_istream_reference(body), ostream_reference(sock));
+				} else {
+					co_await pipe(buffered_istream_reference(gate_stream), ostream_reference(sock));
+				}
+			}(gate_istream, std::move(writer), context.request()));
 
 			co_await gate_writer;
 			co_await sock_writer;
 		} catch (const connection_error& ex) {
 			eprintln("connection error: {}", ex.what());
-			throw HTTP_BAD_GATEWAY;
+			co_return http_error(HTTP_BAD_GATEWAY);
 		} catch (http_parse_error err) {
 			eprintln("parse_error {}", static_cast<int>(err));
-			throw HTTP_BAD_GATEWAY;
+			co_return http_error(HTTP_BAD_GATEWAY);
 		} catch (stream_error) {
 			eprintln("stream_error");
-			throw HTTP_BAD_GATEWAY;
+			co_return http_error(HTTP_BAD_GATEWAY);
 		} catch (compress_error) {
 			eprintln("compress_error");
-			throw HTTP_BAD_GATEWAY;
+			co_return http_error(HTTP_BAD_GATEWAY);
 		}
+
+		co_return {};
 	}
 } // namespace cobra
@@ -66,6 +66,10 @@ namespace cobra {
 		}
 	}
 
+	void http_header_map::erase(const http_header_key& key) {
+		_map.erase(key);
+	}
+
 	http_header_map::iterator http_header_map::begin() {
 		return _map.begin();
 	}
@@ -132,6 +136,10 @@ namespace cobra {
 		}
 	}
 
+	void http_message::remove_header(const http_header_key& key) {
+		_header_map.erase(key);
+	}
+
 	http_request::http_request(http_version version, http_request_method method, http_request_uri uri)
 		: http_message(std::move(version)), _method(std::move(method)), _uri(std::move(uri)) {}
 
@@ -322,6 +322,12 @@ namespace cobra {
 		co_return response;
 	}
 
+	task<http_header_map> parse_http_trailer(buffered_istream_reference stream) {
+		http_message message(http_version(1, 1));
+		co_await parse_http_header_map(stream, message);
+		co_return message.header_map();
+	}
+
 	task<http_header_map> parse_cgi(buffered_istream_reference stream) {
 		return parse_cgi_header_map(stream);
 	}
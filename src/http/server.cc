@@ -7,6 +7,7 @@
 #include "cobra/http/handler.hh"
 #include "cobra/http/parse.hh"
 
+#include <algorithm>
 #include <cassert>
 #include <exception>
 #include <iterator>
@@ -17,6 +18,7 @@
 #include <ranges>
 #include <stdexcept>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <variant>
 
@@ -34,78 +36,179 @@ namespace cobra {
 	http_filter::http_filter(std::shared_ptr<const config::config> config, std::vector<http_filter> filters)
 		: _config(config), _sub_filters(std::move(filters)), _match_count(0) {}
 
-	generator<std::pair<http_filter*, uri_abs_path>>
-	http_filter::match(const basic_socket_stream& socket, const http_request& request, const uri_abs_path& normalized) {
-		if (eval(socket, request, normalized)) {
-			for (auto& filter : _sub_filters) {
-				for (auto& result : filter.match(socket, request, normalized)) {
-					co_yield result;
+	http_router::http_router(const std::vector<http_filter>& filters) {
+		std::unordered_set<std::string> hosts;
+
+		for (const auto& filter : filters) {
+			add_route(filter, npos);
+		}
+
+		for (const auto& route : _routes) {
+			hosts.insert(route.filter->config().server_names.begin(), route.filter->config().server_names.end());
+		}
+
+		for (const auto& host : hosts) {
+			_hosts.insert({host, make_table(host)});
+		}
+
+		_default = make_table(std::nullopt);
+	}
+
+	void http_router::add_route(const http_filter& filter, std::size_t parent) {
+		const std::size_t id = _routes.size();
+		route& current = _routes.emplace_back();
+
+		current.filter = &filter;
+		current.parent = parent;
+
+		if (parent != npos) {
+			current.location = _routes[parent].location;
+		}
+
+		current.location.insert(current.location.end(), filter.config().location.begin(),
+								filter.config().location.end());
+
+		for (const auto& method : filter.config().methods) {
+			const std::size_t bit = _methods.insert({method, _methods.size()}).first->second;
+
+			current.methods.resize(std::max(current.methods.size(), bit + 1));
+			current.methods[bit] = true;
+		}
+
+		if (_extensions.empty()) {
+			_extensions.emplace_back();
+		}
+
+		for (const auto& extension : filter.config().extensions) {
+			std::size_t node = 0;
+
+			for (auto it = extension.rbegin(); it != extension.rend(); ++it) {
+				auto [child, inserted] = _extensions[node].children.insert({*it, _extensions.size()});
+				node = child->second;
+
+				if (inserted) {
+					_extensions.emplace_back();
 				}
 			}
 
-			co_yield {this, normalized};
+			_extensions[node].extension = node;
+
+			const std::size_t bit = *_extensions[node].extension;
+			_routes[id].extensions.resize(std::max(_routes[id].extensions.size(), bit + 1));
+			_routes[id].extensions[bit] = true;
+		}
 
-			if (config().index.has_value()) {
-				uri_abs_path normalized_clone = normalized;
-				normalized_clone.push_back(config().index->string());
+		for (const auto& sub_filter : filter.sub_filters()) {
+			add_route(sub_filter, id);
+		}
 
-				for (auto& filter : _sub_filters) {
-					for (auto& result : filter.match(socket, request, normalized_clone)) {
-						co_yield result;
-					}
-				}
+		_routes[id].end = _routes.size();
+	}
+
+	http_router::table http_router::make_table(std::optional<std::string_view> host) const {
+		table routes(1);
+		std::vector<bool> included(_routes.size());
+
+		for (std::size_t id = 0; id < _routes.size(); ++id) {
+			const route& current = _routes[id];
+			const auto& server_names = current.filter->config().server_names;
 
-				co_yield {this, normalized_clone};
+			if (current.parent != npos && !included[current.parent]) {
+				continue;
 			}
+
+			if (!server_names.empty() && (!host || !server_names.contains(std::string(*host)))) {
+				continue;
+			}
+
+			std::size_t node = 0;
+
+			for (const auto& segment : current.location) {
+				auto [child, inserted] = routes[node].children.insert({segment, routes.size()});
+				node = child->second;
+
+				if (inserted) {
+					routes.emplace_back();
+				}
+			}
+
+			routes[node].routes.push_back(id);
+			included[id] = true;
 		}
+
+		return routes;
 	}
 
-	bool http_filter::eval(const basic_socket_stream& socket, const http_request& request,
-						   const uri_abs_path& normalized) const {
-		if (!config().server_names.empty()) {
-			if (socket.server_name()) {
-				if (!config().server_names.contains(std::string(*socket.server_name()))) {
-					return false;
-				}
-			} else {
-				if (!request.has_header("host")) {
-					return false;
-				}
-				if (!config().server_names.contains(request.header("host"))) {
-					return false;
-				}
+	std::vector<std::size_t> http_router::get_candidates(const table& routes, const uri_abs_path& path) const {
+		std::vector<std::size_t> result;
+		std::size_t node = 0;
+		auto it = path.begin();
+
+		while (true) {
+			result.insert(result.end(), routes[node].routes.begin(), routes[node].routes.end());
+
+			if (it == path.end()) {
+				break;
 			}
+
+			auto child = routes[node].children.find(*it++);
+
+			if (child == routes[node].children.end()) {
+				break;
+			}
+
+			node = child->second;
 		}
 
-		if (!config().location.empty()) {
-			const std::size_t already_matched = match_count() - config().location.size();
+		std::sort(result.begin(), result.end());
+		return result;
+	}
+
+	std::vector<std::size_t> http_router::get_extensions(const uri_abs_path& path) const {
+		std::vector<std::size_t> result;
 
-			assert(already_matched <= static_cast<std::size_t>(std::distance(normalized.begin(), normalized.end())));
-			auto it = normalized.begin() + already_matched;
+		if (!path.empty() && !_extensions.empty()) {
+			const std::string& segment = path.back();
+			std::size_t node = 0;
+			auto it = segment.rbegin();
 
-			for (auto& part : config().location) {
-				if (it == normalized.end()) {
-					return false;
-				} else if (*it != part) {
-					return false;
+			while (true) {
+				if (_extensions[node].extension) {
+					result.push_back(*_extensions[node].extension);
 				}
-				++it;
+
+				if (it == segment.rend()) {
+					break;
+				}
+
+				auto child = _extensions[node].children.find(*it++);
+
+				if (child == _extensions[node].children.end()) {
+					break;
+				}
+
+				node = child->second;
 			}
 		}
 
-		if (!config().methods.empty() && !config().methods.contains(request.method())) {
-			return false;
+		return result;
+	}
+
+	bool http_router::eval(const route& current, std::optional<std::size_t> method,
+						   const std::vector<std::size_t>& extensions) const {
+		if (!current.filter->config().methods.empty()) {
+			if (!method || *method >= current.methods.size() || !current.methods[*method]) {
+				return false;
+			}
 		}
 
-		if (!config().extensions.empty()) {
+		if (!current.filter->config().extensions.empty()) {
 			bool matched = false;
 
-			if (!normalized.empty()) {
-				for (const std::string& extension : config().extensions) {
-					if (normalized.back().ends_with(extension)) {
-						matched = true;
-						break;
-					}
+			for (std::size_t extension : extensions) {
+				if (extension < current.extensions.size() && current.extensions[extension]) {
+					matched = true;
+					break;
 				}
 			}
 
@@ -117,71 +220,146 @@ namespace cobra {
 		return true;
 	}
 
+	void http_router::match_children(const table& routes, std::size_t parent, std::optional<std::size_t> method,
+									 const uri_abs_path& path,
+									 std::vector<std::pair<const http_filter*, uri_abs_path>>& result) const {
+		const std::vector<std::size_t> candidates = get_candidates(routes, path);
+		const std::size_t* first = candidates.data();
+		const std::size_t* last = candidates.data() + candidates.size();
+
+		if (parent != npos) {
+			first = std::upper_bound(first, last, parent);
+			last = std::lower_bound(first, last, _routes[parent].end);
+		}
+
+		match_range(routes, first, last, method, path, result);
+	}
+
+	// [first, last) holds the candidates of one or more sibling subtrees in
+	// pre-order, so it always starts at the root of the next subtree.
+	void http_router::match_range(const table& routes, const std::size_t* first, const std::size_t* last,
+								  std::optional<std::size_t> method, const uri_abs_path& path,
+								  std::vector<std::pair<const http_filter*, uri_abs_path>>& result) const {
+		const std::vector<std::size_t> extensions = get_extensions(path);
+
+		while (first != last) {
+			const route& current = _routes[*first];
+			const std::size_t* subtree_last = std::lower_bound(first + 1, last, current.end);
+
+			if (eval(current, method, extensions)) {
+				match_range(routes, first + 1, subtree_last, method, path, result);
+				result.push_back({current.filter, path});
+
+				if (current.filter->config().index.has_value()) {
+					uri_abs_path index_path = path;
+					index_path.push_back(current.filter->config().index->string());
+
+					match_children(routes, *first, method, index_path, result);
+					result.push_back({current.filter, std::move(index_path)});
+				}
+			}
+
+			first = subtree_last;
+		}
+	}
+
+	std::vector<std::pair<const http_filter*, uri_abs_path>>
+	http_router::match(std::optional<std::string_view> host, const http_request& request,
+					   const uri_abs_path& normalized) const {
+		std::vector<std::pair<const http_filter*, uri_abs_path>> result;
+		std::optional<std::size_t> method;
+		const table* routes = &_default;
+
+		if (host) {
+			auto it = _hosts.find(std::string(*host));
+
+			if (it != _hosts.end()) {
+				routes = &it->second;
+			}
+		}
+
+		if (auto it = _methods.find(request.method()); it != _methods.end()) {
+			method = it->second;
+		}
+
+		match_children(*routes, npos, method, normalized, result);
+		return result;
+	}
+
 	server::server(config::listen_address address, std::unordered_map<std::string, ssl_ctx> contexts,
-				   std::vector<http_filter> filters, executor* exec, event_loop* loop)
+				   std::vector<http_filter> filters, executor* exec, executor* compress_exec, event_loop* loop,
+				   access_log* log)
 		: http_filter(std::shared_ptr<config::config>(new config::config()), std::move(filters)),
-		  _address(std::move(address)), _contexts(std::move(contexts)), _exec(exec), _loop(loop) {}
+		  _address(std::move(address)), _contexts(std::move(contexts)), _router(sub_filters()), _exec(exec),
+		  _compress_exec(compress_exec), _loop(loop), _log(log) {}
 
 	server::server(server&& other)
 		: http_filter(std::move(other)), _address(std::move(other._address)), _contexts(std::move(other._contexts)),
-		  _exec(other._exec), _loop(other._loop), _num_connections(other._num_connections.load()) {}
+		  _router(std::move(other._router)), _exec(other._exec), _compress_exec(other._compress_exec),
+		  _loop(other._loop), _log(other._log), _num_connections(other._num_connections.load()) {}
 
-	task<void> server::match_and_handle(basic_socket_stream& socket, const http_request& request,
-										buffered_istream_reference in, http_ostream_wrapper& out,
-										http_server_logger* logger, std::optional<http_response_code> code) {
-		// std::optional<std::pair<int, const config::config*>> error;
+	task<http_result<void>> server::match_and_handle(basic_socket_stream& socket, const http_request& request,
+													 buffered_istream_reference in, http_ostream_wrapper& out,
+													 http_server_logger* logger,
+													 std::optional<http_response_code> code) {
 		const uri_origin* org = request.uri().get<uri_origin>();
 
 		if (!org) {
-			eprintln("request did not contain uri_origin");
-			throw HTTP_BAD_REQUEST;
+			co_return http_error(HTTP_BAD_REQUEST);
 		}
 
 		const config::config* last_config = nullptr; // ODOT give other name
+		std::optional<std::string_view> host;
+
+		if (socket.server_name()) {
+			host = socket.server_name();
+		} else if (request.has_header("host")) {
+			host = request.header("host");
+		}
 
 		const uri_abs_path normalized = org->path().normalize();
-		for (auto [filter, normalized] : match(socket, request, normalized)) {
-			try {
-				if (!filter || !filter->config().handler) {
-					/*
-					if (!filter)
-						std::cerr << "no filter matched" << std::endl;
-					else if (!filter->config().handler)
-						std::cerr << "no handler" << std::endl;
-					*/
-					continue;
-				}
+		for (const auto& [filter, normalized] : _router.match(host, request, normalized)) {
+			if (!filter->config().handler) {
+				continue;
+			}
 
-				if (last_config == nullptr)
-					last_config = &filter->config();
+			if (last_config == nullptr)
+				last_config = &filter->config();
+
+			http_result<void> result;
 
-				// co_await (*handler)(std::move(writer), std::move(request),
-				// buffered_istream_reference(socket_istream));
+			try {
 				http_response_writer writer(&request, &out, logger);
-				co_await handle_request(*filter, request, normalized, in, std::move(writer), code);
-				co_return;
-			} catch (int code) {
-				last_config = &filter->config();
-				if (code != HTTP_NOT_FOUND) {
-					throw std::make_pair(code, &filter->config());
-				}
+				result = co_await handle_request(*filter, request, normalized, in, std::move(writer), code);
+			} catch (const http_error& error) {
+				result = error;
 			} catch (const std::exception& ex) {
 				eprintln("An internal server error has ocurred: {}", ex.what());
-				throw std::make_pair(HTTP_INTERNAL_SERVER_ERROR, &filter->config());
-				// error = std::make_pair(HTTP_INTERNAL_SERVER_ERROR, &config());
+				result = http_error(HTTP_INTERNAL_SERVER_ERROR);
 			} catch (...) {
 				eprintln("An exception was thrown that does not inherit from std::exception");
-				throw std::make_pair(HTTP_INTERNAL_SERVER_ERROR, &filter->config());
+				result = http_error(HTTP_INTERNAL_SERVER_ERROR);
+			}
+
+			if (result) {
+				co_return result;
+			}
+
+			last_config = &filter->config();
+
+			if (result.error().code() != HTTP_NOT_FOUND) {
+				co_return http_error(result.error().code(), &filter->config());
 			}
 		}
-		throw std::make_pair(HTTP_NOT_FOUND, last_config);
+
+		co_return http_error(HTTP_NOT_FOUND, last_config);
 	}
 
 	task<void> server::on_connect(basic_socket_stream& socket) {
 		istream_buffer socket_istream(make_istream_ref(socket), COBRA_BUFFER_SIZE);
 		ostream_buffer socket_ostream(make_ostream_ref(socket), COBRA_BUFFER_SIZE);
 		http_ostream_wrapper wrapper(socket_ostream);
-		http_server_logger logger;
+		http_server_logger logger(_log);
 		logger.set_socket(socket);
 
 #ifdef COBRA_FUZZ_HANDLER
@@ -201,30 +379,35 @@ namespace cobra {
 		} else {
 			http_request request("GET", parse_uri("/", "GET"));
 			do {
-				std::optional<std::pair<int, const config::config*>> error;
+				std::optional<http_error> error;
 
 				try {
-					try {
-						request = co_await parse_http_request(socket_istream);
-					} catch (http_parse_error err) {
-						throw HTTP_BAD_REQUEST;
-					} catch (uri_parse_error err) {
-						throw HTTP_BAD_REQUEST;
-					}
+					request = co_await parse_http_request(socket_istream);
+				} catch (http_parse_error err) {
+					error = http_error(HTTP_BAD_REQUEST);
+				} catch (uri_parse_error err) {
+					error = http_error(HTTP_BAD_REQUEST);
+				}
 
-					co_await match_and_handle(socket, request, socket_istream, wrapper, logger_ptr);
-				} catch (std::pair<int, const config::config*> err) {
-					error = err;
-					// error = code;
-				} catch (int err) {
-					error = std::make_pair(err, nullptr);
+				if (!error && !request.uri().get<uri_origin>()) {
+					eprintln("request did not contain uri_origin");
+					error = http_error(HTTP_BAD_REQUEST);
+				}
+
+				if (error) {
 					// Parse error, cannot keep connection alive
 					wrapper.set_close();
+				} else {
+					auto result = co_await match_and_handle(socket, request, socket_istream, wrapper, logger_ptr);
+
+					if (!result) {
+						error = result.error();
+					}
 				}
 
-				if (!wrapper.sent() && error.has_value() && error->second &&
-					error->second->error_pages.contains(error->first)) {
-					const std::string& error_page = error->second->error_pages.at(error->first);
+				if (!wrapper.sent() && error.has_value() && error->config() &&
+					error->config()->error_pages.contains(error->code())) {
+					const std::string& error_page = error->config()->error_pages.at(error->code());
 					std::string uri;
 					if (!error_page.empty()) {
 						if (error_page[0] == '/') {
@@ -242,8 +425,9 @@ namespace cobra {
 
 					bool errored_again = false;
 					try {
-						co_await match_and_handle(socket, error_request, socket_istream, wrapper, logger_ptr,
-												  error->first);
+						auto result = co_await match_and_handle(socket, error_request, socket_istream, wrapper,
+																logger_ptr, error->code());
+						errored_again = !result;
 					} catch (...) {
 						errored_again = true;
 					}
@@ -252,11 +436,7 @@ namespace cobra {
 						co_await http_response_writer(&request, &wrapper, logger_ptr).send(HTTP_NOT_FOUND);
 					}
 				} else if (!wrapper.sent() && error.has_value()) {
-					// eprintln("no error_page ({}) {}", error->first,
-					// error->second->error_pages.contains(error->first));
-					co_await http_response_writer(&request, &wrapper, logger_ptr).send(error->first);
-				} else if (error.has_value()) {
-					//eprintln("http error {}", error->first);
+					co_await http_response_writer(&request, &wrapper, logger_ptr).send(error->code());
 				}
 
 				co_await wrapper.end();
@@ -264,13 +444,22 @@ namespace cobra {
 		}
 	}
 
-	task<void> server::handle_request(const http_filter& filt, const http_request& request,
-									  const uri_abs_path& normalized, buffered_istream_reference in,
-									  http_response_writer writer, std::optional<http_response_code> code) {
+	task<http_result<void>> server::handle_request(const http_filter& filt, const http_request& request,
+												   const uri_abs_path& normalized, buffered_istream_reference in,
+												   http_response_writer writer,
+												   std::optional<http_response_code> code) {
 		for (auto& [key, value] : filt.config().headers) {
 			writer.set_header(key, value);
 		}
 
+		writer.set_compress_level(filt.config().compress_level);
+		writer.set_compress_types(&filt.config().compress_types);
+		writer.set_compress_adaptive(filt.config().compress_adaptive);
+
+		if (_compress_exec) {
+			writer.set_compress_executor(_compress_exec, _loop->post_executor());
+		}
+
 		// ODOT properly match uri
 		fs::path file("/");
 		for (std::size_t i = filt.match_count(); i < normalized.size(); ++i) {
@@ -282,7 +471,7 @@ namespace cobra {
 								  ? parse_unsigned_strict<std::size_t>(request.header("content-length"))
 								  : 0;
 		if (!content_length)
-			throw HTTP_BAD_REQUEST;
+			co_return http_error(HTTP_BAD_REQUEST);
 
 		gluttonous_stream limited_stream(istream_limit(std::move(in), *content_length), filt.config().max_body_size);
 
@@ -295,15 +484,20 @@ namespace cobra {
 		auto index = std::vector<std::string>(1, filt.config().index.value_or("").string());
 
 		if (auto cfg = std::get_if<cobra::cgi_config>(&*filt.config().handler)) {
-			co_await handle_cgi(std::move(writer), {_loop, _exec, root, file.string(), *cfg, request, in});
+			co_return co_await handle_cgi(std::move(writer),
+										  {_loop, _exec, root, file.string(), *cfg, request, in});
 		} else if (auto cfg = std::get_if<cobra::static_config>(&*filt.config().handler)) {
-			co_await handle_static(std::move(writer), {_loop, _exec, root, file.string(), *cfg, request, in}, code);
+			co_return co_await handle_static(std::move(writer),
+											 {_loop, _exec, root, file.string(), *cfg, request, in}, code);
 		} else if (auto cfg = std::get_if<cobra::redirect_config>(&*filt.config().handler)) {
-			co_await handle_redirect(std::move(writer), {_loop, _exec, root, file.string(), *cfg, request, in});
+			co_return co_await handle_redirect(std::move(writer),
+											   {_loop, _exec, root, file.string(), *cfg, request, in});
 		} else if (auto cfg = std::get_if<cobra::proxy_config>(&*filt.config().handler)) {
-			co_await handle_proxy(std::move(writer), {_loop, _exec, root, file.string(), *cfg, request, in});
+			co_return co_await handle_proxy(std::move(writer),
+											{_loop, _exec, root, file.string(), *cfg, request, in});
 		} else {
 			assert(0 && "Unimplemented");
+			co_return http_error(HTTP_INTERNAL_SERVER_ERROR);
 		}
 	}
 
@@ -336,7 +530,7 @@ namespace cobra {
 	}
 
 	std::vector<server> server::convert(const std::vector<std::shared_ptr<config::server>>& configs, executor* exec,
-										event_loop* loop) {
+										event_loop* loop, access_log* log, executor* compress_exec) {
 		std::map<config::listen_address, std::unordered_map<std::string, ssl_ctx>> contexts;
 		std::map<config::listen_address, std::vector<http_filter>> filters;
 
@@ -364,7 +558,7 @@ namespace cobra {
 			if (contexts.contains(listen)) {
 				ssl = contexts.at(listen);
 			}
-			result.push_back(server(listen, std::move(ssl), filters, exec, loop));
+			result.push_back(server(listen, std::move(ssl), filters, exec, compress_exec, loop, log));
 		}
 		return result;
 	}
@@ -3,7 +3,17 @@
 #include "cobra/compress/deflate.hh"
 #include "cobra/print.hh"
 
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <ctime>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+
 namespace cobra {
+	constexpr std::size_t http_head_buffer_size = 4096;
+
 	bool has_header_value(const http_message& message, const std::string& key, std::string_view target) {
 		if (message.has_header(key)) {
 			std::string_view value = message.header(key);
@@ -39,19 +49,160 @@ namespace cobra {
 		return false;
 	}
 
-	static http_ostream to_stream(http_ostream_wrapper* stream, const http_message& message) {
+	static bool equals_ignore_case(std::string_view a, std::string_view b) {
+		return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](char a, char b) {
+			return tolower(a) == tolower(b);
+		});
+	}
+
+	static std::string_view trim(std::string_view str) {
+		std::size_t begin = str.find_first_not_of(" \t");
+
+		if (begin == std::string_view::npos) {
+			return std::string_view();
+		}
+
+		return str.substr(begin, str.find_last_not_of(" \t") + 1 - begin);
+	}
+
+	// Parses a qvalue into thousandths, anything malformed is not acceptable
+	static int parse_qvalue(std::string_view str) {
+		if (str.empty() || (str[0] != '0' && str[0] != '1') || str.size() > 5 || (str.size() > 1 && str[1] != '.')) {
+			return 0;
+		}
+
+		int value = (str[0] - '0') * 1000;
+
+		for (std::size_t i = 2, scale = 100; i < str.size(); i++, scale /= 10) {
+			if (str[i] < '0' || str[i] > '9') {
+				return 0;
+			}
+
+			value += (str[i] - '0') * scale;
+		}
+
+		return std::min(value, 1000);
+	}
+
+	struct accept_encoding_qualities {
+		std::optional<int> gzip;
+		std::optional<int> deflate;
+		std::optional<int> identity;
+		std::optional<int> any;
+	};
+
+	static accept_encoding_qualities parse_accept_encoding(std::string_view value) {
+		accept_encoding_qualities result;
+
+		while (!value.empty()) {
+			std::size_t end = value.find(',');
+			std::string_view part = value.substr(0, end);
+			std::size_t params = part.find(';');
+			std::string_view coding = trim(part.substr(0, params));
+			int quality = 1000;
+
+			while (params != std::string_view::npos) {
+				part = part.substr(params + 1);
+				params = part.find(';');
+				std::string_view param = trim(part.substr(0, params));
+
+				if (param.size() >= 2 && equals_ignore_case(param.substr(0, 2), "q=")) {
+					quality = parse_qvalue(param.substr(2));
+				}
+			}
+
+			if (equals_ignore_case(coding, "gzip") || equals_ignore_case(coding, "x-gzip")) {
+				result.gzip = quality;
+			} else if (equals_ignore_case(coding, "deflate")) {
+				result.deflate = quality;
+			} else if (equals_ignore_case(coding, "identity")) {
+				result.identity = quality;
+			} else if (coding == "*") {
+				result.any = quality;
+			}
+
+			value = end == std::string_view::npos ? std::string_view() : value.substr(end + 1);
+		}
+
+		return result;
+	}
+
+	std::optional<deflate_mode> accept_encoding(const http_message& message) {
+		if (!message.has_header("Accept-Encoding")) {
+			return std::nullopt;
+		}
+
+		accept_encoding_qualities accept = parse_accept_encoding(message.header("Accept-Encoding"));
+		int gzip = accept.gzip.value_or(accept.any.value_or(0));
+		int deflate = accept.deflate.value_or(accept.any.value_or(0));
+
+		if (gzip == 0 && deflate == 0) {
+			return std::nullopt;
+		} else if (gzip >= deflate) {
+			return deflate_mode::gzip;
+		} else {
+			return deflate_mode::zlib;
+		}
+	}
+
+	bool accept_identity(const http_message& message) {
+		if (!message.has_header("Accept-Encoding")) {
+			return true;
+		}
+
+		accept_encoding_qualities accept = parse_accept_encoding(message.header("Accept-Encoding"));
+		return accept.identity.value_or(accept.any.value_or(1000)) != 0;
+	}
+
+	bool accept_coding(const http_message& message, deflate_mode mode) {
+		if (!message.has_header("Accept-Encoding")) {
+			return false;
+		}
+
+		accept_encoding_qualities accept = parse_accept_encoding(message.header("Accept-Encoding"));
+		std::optional<int> quality = mode == deflate_mode::gzip ? accept.gzip : accept.deflate;
+		return quality.value_or(accept.any.value_or(0)) != 0;
+	}
+
+	std::optional<deflate_mode> content_encoding(const http_message& message) {
+		if (!message.has_header("Content-Encoding")) {
+			return std::nullopt;
+		}
+
+		std::string_view coding = trim(message.header("Content-Encoding"));
+
+		if (equals_ignore_case(coding, "gzip") || equals_ignore_case(coding, "x-gzip")) {
+			return deflate_mode::gzip;
+		} else if (equals_ignore_case(coding, "deflate")) {
+			return deflate_mode::zlib;
+		} else {
+			return std::nullopt;
+		}
+	}
+
+	bool identity_encoding(const http_message& message) {
+		return !message.has_header("Content-Encoding") ||
+			   equals_ignore_case(trim(message.header("Content-Encoding")), "identity");
+	}
+
+	// Only encodes the body when mode is given, content that is already encoded is passed through
+	static http_ostream to_stream(http_ostream_wrapper* stream, const http_message& message,
+								  std::optional<deflate_mode> mode, int level, bool adaptive, executor* exec,
+								  executor* resume) {
 		if (!has_header_value(message, "Connection", "keep-alive")) {
 			stream->set_close();
 		}
 
-		if (has_header_value(message, "Content-Encoding", "deflate")) {
+		if (mode) {
 			if (message.has_header("Content-Length")) {
 				std::size_t size = std::stoull(message.header("Content-Length"));
-				return stream->get_deflate(size);
+				return stream->get_deflate(size, *mode, level, adaptive);
+			} else if (has_header_value(message, "Transfer-Encoding", "chunked") && exec) {
+				return stream->get_parallel_deflate_chunked(exec, resume, *mode, level, adaptive);
 			} else if (has_header_value(message, "Transfer-Encoding", "chunked")) {
-				return stream->get_deflate_chunked();
+				return stream->get_deflate_chunked(*mode, level, adaptive);
 			} else {
-				return stream->get_deflate();
+				return stream->get_deflate(*mode, level, adaptive);
 			}
 		} else {
 			if (message.has_header("Content-Length")) {
@@ -76,6 +227,12 @@ namespace cobra {
 		co_return co_await end_stream(tmp);
 	}
 
+	template <AsyncBufferedOutputStream Stream>
+	static task<buffered_ostream_reference> end_stream(parallel_deflate_ostream<Stream>& stream) {
+		Stream tmp = co_await std::move(stream).end();
+		co_return co_await end_stream(tmp);
+	}
+
 	template <AsyncBufferedOutputStream Stream>
 	static task<buffered_ostream_reference> end_stream(ostream_limit<Stream>& stream) {
 		co_return co_await end_stream(stream.inner());
@@ -93,42 +250,16 @@ namespace cobra {
 		co_return co_await end_stream(tmp);
 	}
 
+	http_server_logger::http_server_logger(access_log* log) : _log(log) {}
+
 	void http_server_logger::set_socket(const basic_socket_stream& socket) {
 		_socket = &socket;
 	}
 
 	void http_server_logger::log(const http_request* request, const http_response& response) {
-		term::control ctrl;
-		std::stringstream ss;
-
-		if (response.code() / 100 == 1) {
-			ctrl |= term::fg_cyan();
-		} else if (response.code() / 100 == 2) {
-			ctrl |= term::fg_green();
-		} else if (response.code() / 100 == 3) {
-			ctrl |= term::fg_yellow();
-		} else if (response.code() / 100 == 4) {
-			ctrl |= term::fg_red();
-		} else if (response.code() / 100 == 5) {
-			ctrl |= term::fg_magenta();
-		}
-
-		print(ss, "{}[{}]", ctrl, response.code());
-
-		if (_socket) {
-			print(ss, " {}", _socket->peername().string());
+		if (_log) {
+			_log->log(_socket, request, response);
 		}
-
-		if (request) {
-			if (_socket) {
-				print(ss, " ->");
-			}
-
-			print(ss, " {} {}", request->method(), request->uri().string());
-		}
-
-		print(ss, "{}", term::reset());
-		println("{}", ss.str());
 	}
 
 	http_ostream_wrapper::http_ostream_wrapper(buffered_ostream_reference stream) : _stream(std::move(stream)) {}
@@ -151,18 +282,25 @@ namespace cobra {
 		return make_buffered_ostream_ref(_stream);
 	}
 
-	http_ostream http_ostream_wrapper::get_deflate() {
-		_stream = deflate_ostream(inner(), deflate_mode::zlib);
+	http_ostream http_ostream_wrapper::get_deflate(deflate_mode mode, int level, bool adaptive) {
+		_stream = deflate_ostream(inner(), mode, level, adaptive);
 		return make_buffered_ostream_ref(_stream);
 	}
 
-	http_ostream http_ostream_wrapper::get_deflate_chunked() {
-		_stream = deflate_ostream(ostream_buffer(chunked_ostream(inner()), COBRA_BUFFER_SIZE), deflate_mode::zlib);
+	http_ostream http_ostream_wrapper::get_deflate_chunked(deflate_mode mode, int level, bool adaptive) {
+		_stream = deflate_ostream(ostream_buffer(chunked_ostream(inner()), COBRA_BUFFER_SIZE), mode, level, adaptive);
 		return make_buffered_ostream_ref(_stream);
 	}
 
-	http_ostream http_ostream_wrapper::get_deflate(std::size_t limit) {
-		_stream = ostream_limit(deflate_ostream(inner(), deflate_mode::zlib), limit);
+	http_ostream http_ostream_wrapper::get_deflate(std::size_t limit, deflate_mode mode, int level, bool adaptive) {
+		_stream = ostream_limit(deflate_ostream(inner(), mode, level, adaptive), limit);
+		return make_buffered_ostream_ref(_stream);
+	}
+
+	http_ostream http_ostream_wrapper::get_parallel_deflate_chunked(executor* exec, executor* resume, deflate_mode mode,
+																	int level, bool adaptive) {
+		_stream = parallel_deflate_ostream(ostream_buffer(chunked_ostream(inner()), COBRA_BUFFER_SIZE), exec, mode,
+										   level, resume, adaptive);
 		return make_buffered_ostream_ref(_stream);
 	}
 
@@ -194,7 +332,7 @@ namespace cobra {
 	task<http_ostream> http_request_writer::send(http_request request) && {
 		_stream->set_sent();
 		co_await write_http_request(_stream->inner(), request);
-		co_return to_stream(_stream, request);
+		co_return to_stream(_stream, request, std::nullopt, lz_level_default, false, nullptr, nullptr);
 	}
 
 	http_response_writer::http_response_writer(const http_request* request, http_ostream_wrapper* stream,
@@ -205,8 +343,169 @@ namespace cobra {
 		_headers.push_back({std::move(key), std::move(value)});
 	}
 
-	bool http_response_writer::can_compress() const {
-		return _request && has_header_value(*_request, "Accept-Encoding", "deflate");
+	void http_response_writer::set_compress_level(std::optional<int> level) {
+		_compress_level = level;
+	}
+
+	void http_response_writer::set_compress_types(const std::unordered_set<std::string>* types) {
+		_compress_types = types;
+	}
+
+	void http_response_writer::set_compress_adaptive(bool adaptive) {
+		_compress_adaptive = adaptive;
+	}
+
+	void http_response_writer::set_compress_executor(executor* exec, executor* resume) {
+		_compress_executor = exec;
+		_resume_executor = resume;
+	}
+
+	void http_response_writer::set_content_path(std::string path) {
+		_content_path = std::move(path);
+	}
+
+	// Lower case extension including the dot, empty when there is none
+	static std::string file_extension(std::string_view path) {
+		std::string extension;
+		std::size_t slash = path.find_last_of('/');
+		std::size_t dot = path.find_last_of('.');
+
+		if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+			extension = path.substr(dot);
+			std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char ch) {
+				return std::tolower(ch);
+			});
+		}
+
+		return extension;
+	}
+
+	static const std::unordered_set<std::string> compressed_types = {
+		".jpg", ".jpeg", ".png", ".gif", ".webp", ".avif", ".heic", ".mp3", ".mp4", ".m4a", ".m4v", ".mov", ".webm",
+		".ogg", ".opus", ".zip", ".gz", ".tgz", ".bz2", ".xz", ".zst", ".br", ".7z", ".rar", ".deflate", ".woff",
+		".woff2", ".pdf", "image/*", "video/*", "audio/*", "font/woff", "font/woff2", "application/zip",
+		"application/gzip", "application/x-7z-compressed", "application/zstd", "application/x-rar-compressed",
+		"application/pdf",
+	};
+
+	bool compressed_format(std::string_view path) {
+		const std::string extension = file_extension(path);
+		return !extension.empty() && compressed_types.contains(extension);
+	}
+
+	std::optional<std::string_view> file_content_type(std::string_view path) {
+		static const std::unordered_map<std::string, std::string_view> types = {
+			{".html", "text/html"},
+			{".htm", "text/html"},
+			{".css", "text/css"},
+			{".js", "text/javascript"},
+			{".mjs", "text/javascript"},
+			{".txt", "text/plain"},
+			{".csv", "text/csv"},
+			{".md", "text/markdown"},
+			{".xml", "application/xml"},
+			{".json", "application/json"},
+			{".wasm", "application/wasm"},
+			{".svg", "image/svg+xml"},
+			{".ico", "image/vnd.microsoft.icon"},
+			{".jpg", "image/jpeg"},
+			{".jpeg", "image/jpeg"},
+			{".png", "image/png"},
+			{".gif", "image/gif"},
+			{".webp", "image/webp"},
+			{".avif", "image/avif"},
+			{".mp3", "audio/mpeg"},
+			{".ogg", "audio/ogg"},
+			{".mp4", "video/mp4"},
+			{".webm", "video/webm"},
+			{".woff", "font/woff"},
+			{".woff2", "font/woff2"},
+			{".ttf", "font/ttf"},
+			{".pdf", "application/pdf"},
+			{".zip", "application/zip"},
+			{".gz", "application/gzip"},
+		};
+
+		auto it = types.find(file_extension(path));
+
+		if (it == types.end()) {
+			return std::nullopt;
+		}
+
+		return it->second;
+	}
+
+	static bool matches_content_type(std::string_view pattern, std::string_view type) {
+		if (pattern.ends_with("/*")) {
+			pattern.remove_suffix(1);
+			return type.size() >= pattern.size() && equals_ignore_case(type.substr(0, pattern.size()), pattern);
+		}
+
+		return equals_ignore_case(type, pattern);
+	}
+
+	bool http_response_writer::compressible(std::string_view content_type) const {
+
+		std::string path = _content_path;
+
+		if (path.empty() && _request) {
+			if (const uri_origin* origin = _request->uri().get<uri_origin>()) {
+				path = origin->path().string();
+			}
+		}
+
+		const std::string extension = file_extension(path);
+		content_type = trim(content_type.substr(0, content_type.find(';')));
+
+		auto matches = [&](const std::unordered_set<std::string>& types) {
+			if (!extension.empty() && types.contains(extension)) {
+				return true;
+			}
+
+			if (content_type.empty()) {
+				return false;
+			}
+
+			return std::any_of(types.begin(), types.end(), [&](const std::string& type) {
+				return type[0] != '.' && matches_content_type(type, content_type);
+			});
+		};
+
+		if (_compress_types && !_compress_types->empty()) {
+			return matches(*_compress_types);
+		}
+
+		// The one image format that is worth compressing
+		if (extension == ".svg" || equals_ignore_case(content_type, "image/svg+xml")) {
+			return true;
+		}
+
+		return !matches(compressed_types);
+	}
+
+	std::optional<deflate_mode> http_response_writer::encoding(std::string_view content_type) const {
+		if (!_request) {
+			return std::nullopt;
+		}
+
+		// A client that refuses identity gets compressed content even when compression is turned off
+		if (!accept_identity(*_request)) {
+			return accept_encoding(*_request);
+		}
+
+		if (_compress_level && compressible(content_type)) {
+			return accept_encoding(*_request);
+		}
+
+		return std::nullopt;
+	}
+
+	bool http_response_writer::can_compress(std::string_view content_type) const {
+		return encoding(content_type).has_value();
+	}
+
+	bool http_response_writer::acceptable(std::string_view content_type) const {
+		return can_compress(content_type) || !_request || accept_identity(*_request);
 	}
 
 	task<http_ostream> http_response_writer::send(http_response response) && {
@@ -214,9 +513,21 @@ namespace cobra {
 			response.set_header(key, value);
 		}
 
+		std::optional<deflate_mode> mode;
+
 		if (response.code() != HTTP_SWITCHING_PROTOCOLS) {
-			if (!response.has_header("Content-Encoding") && !response.has_header("Content-Length") && can_compress()) {
-				response.set_header("Content-Encoding", "deflate");
+			if (!response.has_header("Content-Encoding")) {
+				mode = encoding(response.has_header("Content-Type") ? response.header("Content-Type") : "");
+
+				if (_request && (_compress_level || mode) && !has_header_value(response, "Vary", "Accept-Encoding")) {
+					response.add_header("Vary", "Accept-Encoding");
+				}
+
+				if (mode && !response.has_header("Content-Length")) {
+					response.set_header("Content-Encoding", content_coding(*mode));
+				} else {
+					mode = std::nullopt;
+				}
 			}
 
 			if (!response.has_header("Transfer-Encoding") && !response.has_header("Content-Length")) {
@@ -244,29 +555,246 @@ namespace cobra {
 		if (_request && _request->method() == "HEAD") {
 			co_return null_ostream();
 		} else {
-			co_return to_stream(_stream, response);
+			co_return to_stream(_stream, response, mode, encoding_level(), _compress_adaptive, _compress_executor,
+								 _resume_executor);
 		}
 	}
 
-	static task<void> write_http_header_map(ostream_reference stream, const http_message& message) {
+	class http_head_counter {
+		std::size_t _size = 0;
+
+	public:
+		void write(std::string_view str) {
+			_size += str.size();
+		}
+
+		void write(unsigned long value) {
+			char buffer[20];
+			_size += std::to_chars(buffer, buffer + sizeof buffer, value).ptr - buffer;
+		}
+
+		std::size_t size() const {
+			return _size;
+		}
+	};
+
+	class http_head_writer {
+		char* _data;
+		std::size_t _size = 0;
+
+	public:
+		http_head_writer(char* data) : _data(data) {}
+
+		void write(std::string_view str) {
+			std::copy(str.begin(), str.end(), _data + _size);
+			_size += str.size();
+		}
+
+		void write(unsigned long value) {
+			_size = std::to_chars(_data + _size, _data + _size + 20, value).ptr - _data;
+		}
+
+		std::size_t size() const {
+			return _size;
+		}
+	};
+
+	static std::string_view http_date() {
+		static constexpr std::string_view days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+		static constexpr std::string_view months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+													  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+		thread_local std::time_t date_time = -1;
+		thread_local char date[29];
+
+		std::time_t now = std::time(nullptr);
+
+		if (now != date_time) {
+			std::tm tm;
+			gmtime_r(&now, &tm);
+
+			auto put = [](char* out, int value, int digits) {
+				while (digits-- > 0) {
+					out[digits] = '0' + value % 10;
+					value /= 10;
+				}
+			};
+
+			std::copy(days[tm.tm_wday].begin(), days[tm.tm_wday].end(), date);
+			std::copy(months[tm.tm_mon].begin(), months[tm.tm_mon].end(), date + 8);
+			date[3] = ',';
+			date[4] = ' ';
+			put(date + 5, tm.tm_mday, 2);
+			date[7] = ' ';
+			date[11] = ' ';
+			put(date + 12, tm.tm_year + 1900, 4);
+			date[16] = ' ';
+			put(date + 17, tm.tm_hour, 2);
+			date[19] = ':';
+			put(date + 20, tm.tm_min, 2);
+			date[22] = ':';
+			put(date + 23, tm.tm_sec, 2);
+			std::copy_n(" GMT", 4, date + 25);
+			date_time = now;
+		}
+
+		return {date, sizeof date};
+	}
+
+	static std::optional<std::string_view> get_status_line(const http_response& response) {
+		std::string_view line;
+
+		if (response.version().major() != 1 || response.version().minor() != 1) {
+			return std::nullopt;
+		}
+
+		switch (response.code()) {
+		case HTTP_SWITCHING_PROTOCOLS:
+			line = "HTTP/1.1 101 Switching Protocols\r\n";
+			break;
+		case HTTP_OK:
+			line = "HTTP/1.1 200 OK\r\n";
+			break;
+		case HTTP_NO_CONTENT:
+			line = "HTTP/1.1 204 No Content\r\n";
+			break;
+		case HTTP_PARTIAL_CONTENT:
+			line = "HTTP/1.1 206 Partial Content\r\n";
+			break;
+		case HTTP_MOVED_PERMANENTLY:
+			line = "HTTP/1.1 301 Moved Permanently\r\n";
+			break;
+		case HTTP_FOUND:
+			line = "HTTP/1.1 302 Found\r\n";
+			break;
+		case HTTP_NOT_MODIFIED:
+			line = "HTTP/1.1 304 Not Modified\r\n";
+			break;
+		case HTTP_BAD_REQUEST:
+			line = "HTTP/1.1 400 Bad Request\r\n";
+			break;
+		case HTTP_FORBIDDEN:
+			line = "HTTP/1.1 403 Forbidden\r\n";
+			break;
+		case HTTP_NOT_FOUND:
+			line = "HTTP/1.1 404 Not Found\r\n";
+			break;
+		case HTTP_METHOD_NOT_ALLOWED:
+			line = "HTTP/1.1 405 Method Not Allowed\r\n";
+			break;
+		case HTTP_CONTENT_TOO_LARGE:
+			line = "HTTP/1.1 413 Content Too Large\r\n";
+			break;
+		case HTTP_INTERNAL_SERVER_ERROR:
+			line = "HTTP/1.1 500 Internal Server Error\r\n";
+			break;
+		case HTTP_BAD_GATEWAY:
+			line = "HTTP/1.1 502 Bad Gateway\r\n";
+			break;
+		case HTTP_SERVICE_UNAVAILABLE:
+			line = "HTTP/1.1 503 Service Unavailable\r\n";
+			break;
+		default:
+			return std::nullopt;
+		}
+
+		// Only usable when the handler kept the default reason phrase
+		if (line.substr(13, line.size() - 15) != response.reason()) {
+			return std::nullopt;
+		}
+
+		return line;
+	}
+
+	template <class Writer>
+	static void write_http_header_map(Writer& writer, const http_message& message) {
 		for (const auto& [key, value] : message.header_map()) {
-			co_await print(stream, "{}: {}\r\n", key, value);
+			writer.write(key);
+			writer.write(": ");
+			writer.write(value);
+			writer.write("\r\n");
 		}
+	}
 
-		co_await print(stream, "\r\n");
+	template <class Writer>
+	static void write_http_request_head(Writer& writer, const http_request& request, std::string_view uri) {
+		writer.write(request.method());
+		writer.write(" ");
+		writer.write(uri);
+		writer.write(" HTTP/");
+		writer.write(request.version().major());
+		writer.write(".");
+		writer.write(request.version().minor());
+		writer.write("\r\n");
+		write_http_header_map(writer, request);
+		writer.write("\r\n");
 	}
 
-	task<void> write_http_request(ostream_reference stream, const http_request& request) {
-		co_await print(stream, "{} {} HTTP/{}.{}\r\n", request.method(), request.uri().string(),
-					   request.version().major(), request.version().minor());
-		co_await write_http_header_map(stream, request);
+	template <class Writer>
+	static void write_http_response_head(Writer& writer, const http_response& response, std::string_view date) {
+		if (auto line = get_status_line(response)) {
+			writer.write(*line);
+		} else {
+			writer.write("HTTP/");
+			writer.write(response.version().major());
+			writer.write(".");
+			writer.write(response.version().minor());
+			writer.write(" ");
+			writer.write(response.code());
+			writer.write(" ");
+			writer.write(response.reason());
+			writer.write("\r\n");
+		}
+
+		if (!response.has_header("Server")) {
+			writer.write("Server: cobra\r\n");
+		}
+
+		if (!response.has_header("Date")) {
+			writer.write("Date: ");
+			writer.write(date);
+			writer.write("\r\n");
+		}
+
+		write_http_header_map(writer, response);
+		writer.write("\r\n");
+	}
+
+	// Serializes the whole message head up front so it reaches the stream as a
+	// single write, only falling back to the heap for unusually large heads.
+	template <class Function>
+	static task<void> write_http_head(ostream_reference stream, Function function) {
+		http_head_counter counter;
+		char buffer[http_head_buffer_size];
+		std::unique_ptr<char[]> large_buffer;
+		char* data = buffer;
+
+		function(counter);
+
+		if (counter.size() > sizeof buffer) {
+			large_buffer = std::make_unique<char[]>(counter.size());
+			data = large_buffer.get();
+		}
+
+		http_head_writer writer(data);
+		function(writer);
+		assert(writer.size() == counter.size());
+		co_await stream.write_all(data, writer.size());
 		co_await stream.flush();
 	}
 
+	task<void> write_http_request(ostream_reference stream, const http_request& request) {
+		std::string uri = request.uri().string();
+
+		co_await write_http_head(stream, [&](auto& writer) {
+			write_http_request_head(writer, request, uri);
+		});
+	}
+
 	task<void> write_http_response(ostream_reference stream, const http_response& response) {
-		co_await print(stream, "HTTP/{}.{} {} {}\r\n", response.version().major(), response.version().minor(),
-					   response.code(), response.reason());
-		co_await write_http_header_map(stream, response);
-		co_await stream.flush();
+		std::string_view date = http_date();
+
+		co_await write_http_head(stream, [&](auto& writer) {
+			write_http_response_head(writer, response, date);
+		});
 	}
 } // namespace cobra
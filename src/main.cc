@@ -5,8 +5,10 @@
 #include "cobra/asyncio/std_stream.hh"
 #include "cobra/asyncio/stream.hh"
 #include "cobra/asyncio/stream_buffer.hh"
+#include "cobra/compress/deflate.hh"
 #include "cobra/compress/lz.hh"
 #include "cobra/config.hh"
+#include "cobra/http/access_log.hh"
 #include "cobra/http/parse.hh"
 #include "cobra/http/server.hh"
 #include "cobra/http/writer.hh"
@@ -18,6 +20,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <exception>
+#include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -27,7 +30,9 @@
 #include <sstream>
 
 extern "C" {
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <unistd.h>
 }
 
 #ifndef COBRA_TEST
@@ -58,6 +63,11 @@ struct args_type {
 	std::string program_name;
 	std::optional<std::string> config_file;
 	std::optional<std::string> num_threads;
+	std::optional<std::string> log_file;
+	std::optional<std::string> log_format;
+	std::optional<std::string> log_overflow;
+	std::optional<std::string> precompress;
+	std::optional<std::string> compress_threads;
 	bool json = false;
 	bool check = false;
 	bool help = false;
@@ -66,6 +76,64 @@ struct args_type {
 };
 
 #ifndef COBRA_FUZZ
+static bool precompress_file(const std::filesystem::path& path, const std::filesystem::path& sidecar,
+							  cobra::deflate_mode mode) {
+	using namespace cobra;
+	istream_buffer input(file_istream(path.c_str()), COBRA_BUFFER_SIZE);
+	file_ostream output(sidecar.c_str());
+
+	if (!input.inner() || !output) {
+		return false;
+	}
+
+	deflate_ostream defl_ostream(std::move(output), mode, lz_level_max);
+	block_task(pipe(buffered_istream_reference(input), ostream_reference(defl_ostream)));
+	block_task(std::move(defl_ostream).end());
+
+	// Serving the original is cheaper than a sidecar that did not get any smaller. The
+	// empty sidecar is never served and keeps the next run from compressing it again.
+	if (std::filesystem::file_size(sidecar) >= std::filesystem::file_size(path)) {
+		std::filesystem::resize_file(sidecar, 0);
+	}
+
+	return true;
+}
+
+static int precompress(const std::string& dir) {
+	using namespace cobra;
+
+	try {
+		for (const auto& entry : std::filesystem::recursive_directory_iterator(dir)) {
+			const std::filesystem::path& path = entry.path();
+
+			// Sidecars included, they are compressed already
+			if (!entry.is_regular_file() || compressed_format(path.string())) {
+				continue;
+			}
+
+			for (deflate_mode mode : {deflate_mode::gzip, deflate_mode::zlib}) {
+				std::filesystem::path sidecar = path;
+				sidecar += precompressed_extension(mode);
+
+				if (std::filesystem::exists(sidecar) &&
+					std::filesystem::last_write_time(sidecar) >= std::filesystem::last_write_time(path)) {
+					continue;
+				}
+
+				if (!precompress_file(path, sidecar, mode)) {
+					eprintln("failed to precompress {}", path.string());
+					return EXIT_FAILURE;
+				}
+			}
+		}
+	} catch (const std::filesystem::filesystem_error& err) {
+		eprintln("failed to precompress {}: {}", dir, err.what());
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char** argv) {
 	using namespace cobra;
 	std::unique_ptr<executor> exec;
@@ -84,11 +152,22 @@ int main(int argc, char** argv) {
 	std::string help_help = COBRA_TEXT("display this help message");
 	std::string threads_help = COBRA_TEXT("use the thread pool executor");
 	std::string verbose_help = COBRA_TEXT("show verbose output");
+	std::string log_file_help = COBRA_TEXT("append the access log to a file instead of stdout");
+	std::string log_format_help = COBRA_TEXT("access log format (simple, combined or json)");
+	std::string log_overflow_help = COBRA_TEXT("drop or block on access log records when the log falls behind");
+	std::string precompress_help = COBRA_TEXT("write .gz and .deflate sidecars for every file in a directory and exit");
+	std::string compress_threads_help = COBRA_TEXT("number of threads that compress responses off the event loop");
 
 	auto parser = argument_parser<args_type>()
 					  .add_program_name(&args_type::program_name)
 					  .add_positional(&args_type::config_file, false, "file", file_help.c_str())
 					  .add_argument(&args_type::num_threads, "T", "num-threads", num_threads_help.c_str())
+					  .add_argument(&args_type::log_file, "L", "log-file", log_file_help.c_str())
+					  .add_argument(&args_type::log_format, "F", "log-format", log_format_help.c_str())
+					  .add_argument(&args_type::log_overflow, "O", "log-overflow", log_overflow_help.c_str())
+					  .add_argument(&args_type::precompress, "P", "precompress", precompress_help.c_str())
+					  .add_argument(&args_type::compress_threads, "C", "compress-threads",
+									compress_threads_help.c_str())
 					  .add_flag(&args_type::json, true, "j", "json", json_help.c_str())
 					  .add_flag(&args_type::check, true, "c", "check", check_help.c_str())
 					  .add_flag(&args_type::help, true, "h", "help", help_help.c_str())
@@ -101,6 +180,32 @@ int main(int argc, char** argv) {
 		return EXIT_SUCCESS;
 	}
 
+	if (args.precompress) {
+		return precompress(*args.precompress);
+	}
+
+	access_log_options log_options;
+
+	if (!args.log_format || *args.log_format == "simple") {
+		log_options.format = access_log_format::simple;
+	} else if (*args.log_format == "combined") {
+		log_options.format = access_log_format::combined;
+	} else if (*args.log_format == "json") {
+		log_options.format = access_log_format::json;
+	} else {
+		eprintln("unknown log format: {}", *args.log_format);
+		return EXIT_FAILURE;
+	}
+
+	if (!args.log_overflow || *args.log_overflow == "drop") {
+		log_options.overflow = access_log_overflow::drop;
+	} else if (*args.log_overflow == "block") {
+		log_options.overflow = access_log_overflow::block;
+	} else {
+		eprintln("unknown log overflow policy: {}", *args.log_overflow);
+		return EXIT_FAILURE;
+	}
+
 	if (args.num_threads) {
 		exec = std::make_unique<thread_pool_executor>(std::stoull(*args.num_threads));
 	} else if (args.threads) {
@@ -109,6 +214,12 @@ int main(int argc, char** argv) {
 		exec = std::make_unique<sequential_executor>();
 	}
 
+	std::unique_ptr<executor> compress_exec;
+
+	if (args.compress_threads) {
+		compress_exec = std::make_unique<thread_pool_executor>(std::stoull(*args.compress_threads));
+	}
+
 	platform_event_loop loop(*exec);
 
 	/*
@@ -227,7 +338,17 @@ int main(int argc, char** argv) {
 			for (auto& server : srvs) {
 				server->debug_print(std::cerr, 0);
 			}*/
-			std::vector<server> servers = server::convert(srvs, exec.get(), &loop);
+			int log_fd = args.log_file ? ::open(args.log_file->c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)
+									   : ::dup(STDOUT_FILENO);
+
+			if (log_fd < 0) {
+				eprintln("failed to open access log: {}", std::strerror(errno));
+				return EXIT_FAILURE;
+			}
+
+			log_options.color = log_options.format == access_log_format::simple && isatty(log_fd);
+			access_log log(cobra::file(log_fd), log_options);
+			std::vector<server> servers = server::convert(srvs, exec.get(), &loop, &log, compress_exec.get());
 			eprintln("setup {} server(s)", servers.size());
 			std::vector<future_task<void>> jobs;
 
@@ -243,6 +364,8 @@ int main(int argc, char** argv) {
 				for (auto&& job : jobs) {
 					job.get_future().get();
 				}
+
+				eprintln("access log: {} record(s) written, {} dropped", log.written(), log.dropped());
 			}
 		} catch (const config::error& err) {
 			session.report(err.diag());
@@ -0,0 +1,87 @@
+#include "cobra/mirrored_buffer.hh"
+
+#include "cobra/file.hh"
+
+#include <algorithm>
+#include <bit>
+#include <utility>
+
+extern "C" {
+#include <sys/mman.h>
+#include <unistd.h>
+}
+
+namespace cobra {
+#ifdef COBRA_LINUX
+	static char* map_mirrored(std::size_t size) {
+		int fd = memfd_create("cobra_mirrored_buffer", MFD_CLOEXEC);
+
+		if (fd == -1) {
+			return nullptr;
+		}
+
+		// The mappings keep the memory alive once the file is closed
+		file memory(fd);
+
+		if (ftruncate(memory.fd(), size) == -1) {
+			return nullptr;
+		}
+
+		// Reserve both halves first so nothing else can end up in between
+		void* reserved = mmap(nullptr, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (reserved == MAP_FAILED) {
+			return nullptr;
+		}
+
+		char* data = static_cast<char*>(reserved);
+
+		for (char* half : {data, data + size}) {
+			if (mmap(half, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memory.fd(), 0) == MAP_FAILED) {
+				munmap(data, 2 * size);
+				return nullptr;
+			}
+		}
+
+		return data;
+	}
+#endif
+
+	mirrored_buffer::mirrored_buffer(std::size_t size, bool mirror) : _data(nullptr) {
+		_size = std::bit_ceil(std::max(size, std::size_t(1)));
+
+#ifdef COBRA_LINUX
+		if (mirror) {
+			// Page sizes are powers of two as well
+			_size = std::max(_size, static_cast<std::size_t>(sysconf(_SC_PAGESIZE)));
+			_data = map_mirrored(_size);
+			_mirrored = _data != nullptr;
+		}
+#else
+		(void)mirror;
+#endif
+
+		if (!_data) {
+			_data = new char[_size];
+		}
+	}
+
+	mirrored_buffer::mirrored_buffer(mirrored_buffer&& other) noexcept
+		: _data(std::exchange(other._data, nullptr)), _size(std::exchange(other._size, 0)),
+		  _mirrored(std::exchange(other._mirrored, false)) {}
+
+	mirrored_buffer::~mirrored_buffer() {
+		if (_mirrored) {
+			munmap(_data, 2 * _size);
+		} else {
+			delete[] _data;
+		}
+	}
+
+	mirrored_buffer& mirrored_buffer::operator=(mirrored_buffer other) noexcept {
+		std::swap(_data, other._data);
+		std::swap(_size, other._size);
+		std::swap(_mirrored, other._mirrored);
+		return *this;
+	}
+} // namespace cobra
@@ -0,0 +1,90 @@
+#include "cobra/simd.hh"
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define COBRA_SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace cobra {
+	using common_prefix_kernel = std::size_t (*)(const unsigned char*, const unsigned char*, std::size_t);
+
+	static std::size_t common_prefix_scalar(const unsigned char* a, const unsigned char* b, std::size_t size) {
+		std::size_t index = 0;
+
+		if constexpr (std::endian::native == std::endian::little) {
+			for (; index + 8 <= size; index += 8) {
+				std::uint64_t x, y;
+				std::memcpy(&x, a + index, 8);
+				std::memcpy(&y, b + index, 8);
+
+				if (x != y) {
+					return index + std::countr_zero(x ^ y) / 8;
+				}
+			}
+		}
+
+		while (index < size && a[index] == b[index]) {
+			index += 1;
+		}
+
+		return index;
+	}
+
+#ifdef COBRA_SIMD_X86
+	__attribute__((target("sse2"))) static std::size_t common_prefix_sse2(const unsigned char* a,
+																		   const unsigned char* b, std::size_t size) {
+		std::size_t index = 0;
+
+		for (; index + 16 <= size; index += 16) {
+			__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + index));
+			__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + index));
+			unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFF;
+
+			if (mask != 0) {
+				return index + std::countr_zero(mask);
+			}
+		}
+
+		return index + common_prefix_scalar(a + index, b + index, size - index);
+	}
+
+	__attribute__((target("avx2"))) static std::size_t common_prefix_avx2(const unsigned char* a,
+																		   const unsigned char* b, std::size_t size) {
+		std::size_t index = 0;
+
+		for (; index + 32 <= size; index += 32) {
+			__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + index));
+			__m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + index));
+			unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+
+			if (mask != 0) {
+				return index + std::countr_zero(mask);
+			}
+		}
+
+		return index + common_prefix_sse2(a + index, b + index, size - index);
+	}
+#endif
+
+	static common_prefix_kernel select_common_prefix() {
+#ifdef COBRA_SIMD_X86
+		__builtin_cpu_init();
+
+		if (__builtin_cpu_supports("avx2")) {
+			return common_prefix_avx2;
+		} else if (__builtin_cpu_supports("sse2")) {
+			return common_prefix_sse2;
+		}
+#endif
+		return common_prefix_scalar;
+	}
+
+	std::size_t common_prefix(const void* a, const void* b, std::size_t size) {
+		static const common_prefix_kernel kernel = select_common_prefix();
+		return kernel(static_cast<const unsigned char*>(a), static_cast<const unsigned char*>(b), size);
+	}
+} // namespace cobra
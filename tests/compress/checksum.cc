@@ -0,0 +1,116 @@
+#include "cobra/compress/checksum.hh"
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+static std::uint32_t adler32_reference(std::uint32_t adler, const unsigned char* data, std::size_t size) {
+	std::uint32_t a = adler & 0xFFFF;
+	std::uint32_t b = adler >> 16;
+
+	for (std::size_t i = 0; i < size; i++) {
+		a = (a + data[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+
+	return b << 16 | a;
+}
+
+static std::uint32_t crc32_reference(std::uint32_t crc, const unsigned char* data, std::size_t size) {
+	crc = ~crc;
+
+	for (std::size_t i = 0; i < size; i++) {
+		crc ^= data[i];
+
+		for (int j = 0; j < 8; j++) {
+			crc = crc & 1 ? 0xEDB88320 ^ (crc >> 1) : crc >> 1;
+		}
+	}
+
+	return ~crc;
+}
+
+static std::vector<unsigned char> random_data(std::size_t size, std::uint32_t seed) {
+	std::vector<unsigned char> data(size);
+
+	for (unsigned char& ch : data) {
+		seed = seed * 1103515245 + 12345;
+		ch = static_cast<unsigned char>(seed >> 16);
+	}
+
+	return data;
+}
+
+int main() {
+	using namespace cobra;
+
+	const char* check = "123456789";
+	const char* wikipedia = "Wikipedia";
+
+	assert(adler32(adler32_init, wikipedia, std::strlen(wikipedia)) == 0x11E60398);
+	assert(crc32(crc32_init, check, std::strlen(check)) == 0xCBF43926);
+	assert(adler32(adler32_init, nullptr, 0) == adler32_init);
+	assert(crc32(crc32_init, nullptr, 0) == crc32_init);
+
+	const std::vector<checksum_variant> adler32s = adler32_variants();
+	const std::vector<checksum_variant> crc32s = crc32_variants();
+	const std::vector<unsigned char> data = random_data(3 * 5552 + 256, 42);
+	// All bytes at their largest make the sums grow as fast as they can
+	const std::vector<unsigned char> ones(3 * 5552 + 256, 0xFF);
+
+	assert(std::strcmp(adler32s.front().name, "scalar") == 0);
+	assert(std::strcmp(crc32s.front().name, "scalar") == 0);
+
+	for (const checksum_variant& variant : adler32s) {
+		assert(variant.update(adler32_init, wikipedia, std::strlen(wikipedia)) == 0x11E60398);
+	}
+
+	for (const checksum_variant& variant : crc32s) {
+		assert(variant.update(crc32_init, check, std::strlen(check)) == 0xCBF43926);
+	}
+
+	// Every length around the vector widths, at every alignment
+	for (std::size_t offset = 0; offset < 8; offset++) {
+		for (std::size_t size = 0; size <= 200; size++) {
+			const unsigned char* begin = data.data() + offset;
+			const std::uint32_t adler = adler32_reference(adler32_init, begin, size);
+			const std::uint32_t crc = crc32_reference(crc32_init, begin, size);
+
+			for (const checksum_variant& variant : adler32s) {
+				assert(variant.update(adler32_init, begin, size) == adler);
+			}
+
+			for (const checksum_variant& variant : crc32s) {
+				assert(variant.update(crc32_init, begin, size) == crc);
+			}
+		}
+	}
+
+	// Sizes around the block sizes of the kernels and around the point where
+	// the adler sums have to be reduced, continuing from a previous checksum
+	for (std::size_t size : {63, 64, 65, 127, 128, 129, 255, 256, 257, 5551, 5552, 5553, 2 * 5552, 3 * 5552 + 255}) {
+		for (const std::vector<unsigned char>* input : {&data, &ones}) {
+			const unsigned char* begin = input->data() + 1;
+			const std::uint32_t adler = adler32_reference(0xFFF0FFF0, begin, size);
+			const std::uint32_t crc = crc32_reference(0x12345678, begin, size);
+
+			for (const checksum_variant& variant : adler32s) {
+				assert(variant.update(0xFFF0FFF0, begin, size) == adler);
+			}
+
+			for (const checksum_variant& variant : crc32s) {
+				assert(variant.update(0x12345678, begin, size) == crc);
+			}
+		}
+	}
+
+	for (std::size_t split : {0, 1, 63, 64, 1000, 5552, 3 * 5552 + 256}) {
+		const unsigned char* second = data.data() + split;
+		const std::size_t size2 = data.size() - split;
+
+		assert(adler32_combine(adler32(adler32_init, data.data(), split), adler32(adler32_init, second, size2),
+							   size2) == adler32(adler32_init, data.data(), data.size()));
+		assert(crc32_combine(crc32(crc32_init, data.data(), split), crc32(crc32_init, second, size2), size2) ==
+			   crc32(crc32_init, data.data(), data.size()));
+	}
+}
@@ -0,0 +1,170 @@
+#include "cobra/asyncio/future_task.hh"
+#include "cobra/asyncio/std_stream.hh"
+#include "cobra/asyncio/stream_buffer.hh"
+#include "cobra/compress/deflate.hh"
+#include "util/assert.hh"
+#include "util/trickle.hh"
+#include <cassert>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace cobra;
+
+static std::string compress(const std::string& data, deflate_mode mode, int level, bool adaptive) {
+	deflate_ostream output(std_ostream<std::ostringstream>(std::ostringstream()), mode, level, adaptive);
+
+	// Flushing now and then ends blocks in the middle of the window
+	for (std::size_t i = 0; i < data.size(); i += 40000) {
+		block_task(output.write_all(data.data() + i, std::min<std::size_t>(40000, data.size() - i)));
+		block_task(output.flush());
+	}
+
+	return block_task(std::move(output).end()).inner().str();
+}
+
+// Reads with sizes taken in turn from sizes, so reads below and above the
+// size that inflates straight into the caller's buffer follow each other.
+static std::string decompress(const std::string& data, deflate_mode mode, std::size_t step,
+							  const std::vector<std::size_t>& sizes) {
+	inflate_istream input(istream_buffer(test::trickle_istream(data, step), 4096), mode);
+	std::string result;
+	std::string buffer;
+
+	for (std::size_t i = 0;; i++) {
+		buffer.resize(sizes[i % sizes.size()]);
+		std::size_t count = block_task(input.read(buffer.data(), buffer.size()));
+
+		if (count == 0) {
+			return result;
+		}
+
+		result.append(buffer.data(), count);
+	}
+}
+
+static std::string make_data() {
+	std::string data;
+	std::uint32_t seed = 1;
+
+	auto next = [&seed]() {
+		seed = seed * 1103515245 + 12345;
+		return seed >> 16;
+	};
+
+	while (data.size() < 100000) {
+		switch (next() % 4) {
+		case 0:
+			// Runs longer than a match, copied from one element back
+			data.append(next() % 2000, static_cast<char>(next()));
+			break;
+		case 1:
+			for (std::size_t i = next() % 2000; i > 0; i--) {
+				data.push_back(static_cast<char>(next()));
+			}
+
+			break;
+		default:
+			// Repeats from anywhere in the window, some of it overlapping
+			if (!data.empty()) {
+				std::size_t dist = 1 + next() % std::min<std::size_t>(data.size(), 32768);
+				std::size_t size = next() % 3000;
+
+				for (std::size_t i = 0; i < size; i++) {
+					data.push_back(data[data.size() - dist]);
+				}
+			}
+		}
+	}
+
+	return data;
+}
+
+int main() {
+	const std::string data = make_data();
+	const std::vector<std::vector<std::size_t>> read_sizes = {
+		{7, 4096},
+		{4095, 70000, 3},
+		{32768},
+		{65536, 1, 5000},
+		{1000000},
+	};
+
+	for (auto [mode, level] : {std::pair(deflate_mode::raw, lz_level_fastest),
+							   std::pair(deflate_mode::zlib, lz_level_default),
+							   std::pair(deflate_mode::gzip, lz_level_max)}) {
+		const std::string compressed = compress(data, mode, level, false);
+
+		for (const std::vector<std::size_t>& sizes : read_sizes) {
+			for (std::size_t step : {std::size_t(13), std::size_t(65536)}) {
+				assert(decompress(compressed, mode, step, sizes) == data);
+			}
+		}
+	}
+
+	// Incompressible data ends up in stored blocks
+	{
+		std::string noise(50000, '\0');
+		std::uint32_t seed = 7;
+
+		for (char& ch : noise) {
+			seed = seed * 1103515245 + 12345;
+			ch = static_cast<char>(seed >> 16);
+		}
+
+		const std::string compressed = compress(noise, deflate_mode::gzip, lz_level_default, true);
+
+		for (const std::vector<std::size_t>& sizes : read_sizes) {
+			assert(decompress(compressed, deflate_mode::gzip, 4096, sizes) == noise);
+		}
+
+		// Without sampling the blocks turn out cheapest to store as well
+		for (int level : {lz_level_fastest, lz_level_default}) {
+			const std::string blocks = compress(noise, deflate_mode::gzip, level, false);
+			assert(blocks.size() < noise.size() + 100);
+			assert(decompress(blocks, deflate_mode::gzip, 4096, {4096}) == noise);
+		}
+
+		// Sampling looks past writes that are too small to judge on their own
+		deflate_ostream output(std_ostream<std::ostringstream>(std::ostringstream()), deflate_mode::gzip,
+							   lz_level_default, true);
+
+		for (std::size_t i = 0; i < noise.size(); i += 100) {
+			block_task(output.write_all(noise.data() + i, 100));
+		}
+
+		assert(output.stored());
+		const std::string small_writes = block_task(std::move(output).end()).inner().str();
+		assert(decompress(small_writes, deflate_mode::gzip, 4096, {4096}) == noise);
+	}
+
+	// Made by zlib, with matches that overlap themselves
+	{
+		const std::string compressed("\x78\xda\x0b\xc9\x48\x55\x28\x2c\xcd\x4c\xce\x56\x48\x2a\xca\x2f\xcf\x53\x48"
+									 "\xcb\xaf\x50\xc8\x2a\xcd\x2d\x28\x56\xc8\x2f\x4b\x2d\x52\x28\x01\x4a\xe7\x24"
+									 "\x56\x55\x2a\xa4\xe4\xa7\xeb\x29\x84\xd0\x4d\x71\x72\x62\x89\x1e\x00\x0e\xdd"
+									 "\x37\xa2",
+									 59);
+		std::string expected;
+
+		for (int i = 0; i < 3; i++) {
+			expected += "The quick brown fox jumps over the lazy dog. ";
+		}
+
+		expected += "The quick brown cat.";
+
+		for (std::size_t size : {1, 7, 4096}) {
+			assert(decompress(compressed, deflate_mode::zlib, 1, {size}) == expected);
+		}
+	}
+
+	// Checksums are verified whichever way the data was read
+	{
+		std::string compressed = compress(data, deflate_mode::zlib, lz_level_default, false);
+		compressed.back() ^= 1;
+
+		for (const std::vector<std::size_t>& sizes : read_sizes) {
+			ASSERT_THROW(decompress(compressed, deflate_mode::zlib, 65536, sizes), compress_error);
+		}
+	}
+}
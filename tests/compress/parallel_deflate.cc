@@ -0,0 +1,94 @@
+#include "cobra/asyncio/event_loop.hh"
+#include "cobra/asyncio/future_task.hh"
+#include "cobra/asyncio/std_stream.hh"
+#include "cobra/asyncio/stream_buffer.hh"
+#include "cobra/compress/parallel_deflate.hh"
+#include <cassert>
+#include <chrono>
+#include <future>
+#include <sstream>
+#include <string>
+#include <thread>
+
+using namespace cobra;
+
+using string_ostream = std_ostream<std::ostringstream>;
+
+static task<std::string> compress(std::string data, executor* exec, executor* resume, deflate_mode mode,
+								  bool adaptive, std::size_t flush_every, std::thread::id owner) {
+	parallel_deflate_ostream output(string_ostream(std::ostringstream()), exec, mode, lz_level_default, resume,
+									adaptive);
+
+	for (std::size_t i = 0; i < data.size(); i += flush_every) {
+		co_await output.write_all(data.data() + i, std::min(flush_every, data.size() - i));
+		co_await output.flush();
+		assert(std::this_thread::get_id() == owner);
+	}
+
+	string_ostream result = co_await std::move(output).end();
+	assert(std::this_thread::get_id() == owner);
+	co_return std::move(result.inner()).str();
+}
+
+// Polls until the task is done, segments resume on this thread through the loop
+static std::string run(event_loop& loop, task<std::string> task) {
+	future_task<std::string> job = make_future_task(std::move(task));
+	std::future<std::string> future = job.get_future();
+
+	while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+		loop.poll();
+	}
+
+	return future.get();
+}
+
+static std::string decompress(const std::string& data, deflate_mode mode) {
+	std::istringstream stream(data);
+	inflate_istream input(istream_buffer(std_istream<std::istringstream>(std::move(stream)), 4096), mode);
+	std::string result;
+	std::string buffer(65536, '\0');
+
+	while (std::size_t count = block_task(input.read(buffer.data(), buffer.size()))) {
+		result.append(buffer.data(), count);
+	}
+
+	return result;
+}
+
+int main() {
+	thread_pool_executor exec(2);
+	sequential_executor loop_exec;
+	platform_event_loop loop(loop_exec);
+	executor* resume = loop.post_executor();
+	auto compressed = [&](const std::string& data, deflate_mode mode, bool adaptive, std::size_t flush_every) {
+		return run(loop, compress(data, &exec, resume, mode, adaptive, flush_every, std::this_thread::get_id()));
+	};
+	std::string text;
+	std::string noise(parallel_deflate_segment_size * 2, '\0');
+	std::uint32_t seed = 5;
+
+	for (int i = 0; text.size() < parallel_deflate_segment_size * 3 + 1000; i++) {
+		text += "line " + std::to_string(i * 7919 % 1000) + " of some text\n";
+	}
+
+	for (char& ch : noise) {
+		seed = seed * 1103515245 + 12345;
+		ch = static_cast<char>(seed >> 16);
+	}
+
+	for (deflate_mode mode : {deflate_mode::raw, deflate_mode::zlib, deflate_mode::gzip}) {
+		// Small bodies and ones flushed before a whole segment stay inline
+		assert(decompress(compressed("", mode, false, 1), mode).empty());
+		assert(decompress(compressed(text.substr(0, 1000), mode, false, 1000), mode) == text.substr(0, 1000));
+		assert(decompress(compressed(text, mode, false, 5000), mode) == text);
+
+		// Whole segments are compressed in parallel, flushes included
+		assert(decompress(compressed(text, mode, false, text.size()), mode) == text);
+		assert(decompress(compressed(text, mode, true, parallel_deflate_segment_size + 1), mode) == text);
+	}
+
+	// Incompressible bodies are stored by the inline stream instead
+	const std::string stored = compressed(noise, deflate_mode::gzip, true, noise.size());
+	assert(stored.size() < noise.size() + 100);
+	assert(decompress(stored, deflate_mode::gzip) == noise);
+}
@@ -0,0 +1,152 @@
+#include "cobra/asyncio/future_task.hh"
+#include "cobra/compress/stream_ringbuffer.hh"
+#include "cobra/mirrored_buffer.hh"
+#include "util/assert.hh"
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace cobra;
+
+struct command {
+	std::string literal;
+	std::size_t dist;
+	std::size_t size;
+};
+
+// Plays back literals and back-references the way inflate_istream does,
+// filling the buffer as far as it goes every time.
+class replay : public istream_ringbuffer<replay> {
+	using base = istream_ringbuffer<replay>;
+
+	std::vector<command> _commands;
+	std::size_t _index = 0;
+	std::size_t _done = 0;
+
+public:
+	replay(std::vector<command> commands, bool mirror) : base(4096, mirror), _commands(std::move(commands)) {}
+
+	task<void> fill_ringbuf() {
+		while (!base::full() && _index < _commands.size()) {
+			const command& current = _commands[_index];
+
+			if (current.literal.empty()) {
+				_done += base::copy(current.dist, current.size - _done);
+			} else {
+				_done += base::write(current.literal.data() + _done, current.literal.size() - _done);
+			}
+
+			if (_done == (current.literal.empty() ? current.size : current.literal.size())) {
+				_index += 1;
+				_done = 0;
+			}
+		}
+
+		co_return;
+	}
+};
+
+static void drain(replay& stream) {
+	while (true) {
+		auto [data, size] = block_task(stream.fill_buf());
+
+		if (size == 0) {
+			return;
+		}
+
+		stream.consume(size);
+	}
+}
+
+static std::uint32_t next(std::uint32_t& seed) {
+	seed = seed * 1103515245 + 12345;
+	return seed >> 16;
+}
+
+int main() {
+	{
+		mirrored_buffer plain(3000);
+		assert(plain.size() == 4096);
+		assert(plain.mask() == 4095);
+		assert(!plain.mirrored());
+	}
+
+#ifdef COBRA_LINUX
+	{
+		mirrored_buffer mirrored(4096, true);
+		assert(mirrored.mirrored());
+		std::memcpy(mirrored.data(), "abc", 3);
+		assert(std::memcmp(mirrored.data() + mirrored.size(), "abc", 3) == 0);
+
+		mirrored_buffer moved(std::move(mirrored));
+		assert(moved.mirrored());
+		assert(std::memcmp(moved.data() + moved.size(), "abc", 3) == 0);
+	}
+#endif
+
+	std::uint32_t seed = 3;
+	std::vector<command> commands;
+	std::string expected;
+
+	while (expected.size() < 200000) {
+		if (expected.empty() || next(seed) % 3 == 0) {
+			std::string literal(1 + next(seed) % 300, '\0');
+
+			for (char& ch : literal) {
+				ch = static_cast<char>(next(seed));
+			}
+
+			expected += literal;
+			commands.push_back({literal, 0, 0});
+		} else {
+			// Short distances overlap the copy, long ones wrap around the end
+			std::size_t dist = 1 + next(seed) % std::min<std::size_t>(expected.size(), next(seed) % 2 ? 16 : 4096);
+			std::size_t size = 1 + next(seed) % 600;
+
+			for (std::size_t i = 0; i < size; i++) {
+				expected.push_back(expected[expected.size() - dist]);
+			}
+
+			commands.push_back({"", dist, size});
+		}
+	}
+
+	for (bool mirror : {false, true}) {
+		replay spans(commands, mirror);
+		std::string result;
+
+		while (true) {
+			auto [data, size] = block_task(spans.fill_buf());
+
+			if (size == 0) {
+				break;
+			}
+
+			size = std::min<std::size_t>(size, 1 + next(seed) % 5000);
+			result.append(data, size);
+			spans.consume(size);
+		}
+
+		assert(result == expected);
+
+		replay reads(commands, mirror);
+		std::string buffer(8192, '\0');
+		result.clear();
+
+		while (std::size_t count = block_task(reads.read(buffer.data(), 1 + next(seed) % buffer.size()))) {
+			result.append(buffer.data(), count);
+		}
+
+		assert(result == expected);
+	}
+
+	// Back-references cannot reach before the start or past the buffer
+	{
+		replay early({{"abc", 0, 0}, {"", 4, 1}}, false);
+		ASSERT_THROW(drain(early), compress_error);
+
+		replay far({{std::string(100000, 'x'), 0, 0}, {"", 70000, 1}}, true);
+		ASSERT_THROW(drain(far), compress_error);
+	}
+}
@@ -0,0 +1,58 @@
+#include "cobra/http/access_log.hh"
+#include "cobra/http/parse.hh"
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+extern "C" {
+#include <fcntl.h>
+}
+
+using namespace cobra;
+
+// Logs a single request in the combined format and returns the line
+static std::string log_combined(const http_request& request) {
+	char path[] = "/tmp/cobra_test_access_log_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+
+	{
+		access_log_options options;
+		options.format = access_log_format::combined;
+		access_log log(file(fd), options);
+		log.log(nullptr, &request, http_response(200));
+	}
+
+	std::ifstream input(path);
+	std::stringstream result;
+	result << input.rdbuf();
+	std::remove(path);
+	return result.str();
+}
+
+int main() {
+	{
+		http_request request("GET", parse_uri("/index.html", "GET"));
+		request.set_header("Referer", "http://example.com/");
+		request.set_header("User-Agent", "curl/8.0");
+		const std::string line = log_combined(request);
+		assert(line.ends_with("\"GET /index.html HTTP/1.1\" 200 - \"http://example.com/\" \"curl/8.0\"\n"));
+	}
+
+	// Quotes cannot end a field early and control or non-ascii bytes are spelled out
+	{
+		http_request request("GET", parse_uri("/", "GET"));
+		request.set_header("Referer", "a\" 200 \"forged");
+		request.set_header("User-Agent", "back\\slash\ttab\xc3\xa9");
+		const std::string line = log_combined(request);
+		assert(line.ends_with("\"a\\\" 200 \\\"forged\" \"back\\\\slash\\x09tab\\xC3\\xA9\"\n"));
+	}
+
+	{
+		http_request request("GET", parse_uri("/", "GET"));
+		const std::string line = log_combined(request);
+		assert(line.ends_with("\"GET / HTTP/1.1\" 200 - \"-\" \"-\"\n"));
+	}
+}
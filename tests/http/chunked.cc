@@ -0,0 +1,111 @@
+#include "cobra/asyncio/future_task.hh"
+#include "cobra/asyncio/stream_buffer.hh"
+#include "cobra/http/writer.hh"
+#include "util/assert.hh"
+#include "util/trickle.hh"
+#include <cassert>
+#include <string>
+
+using namespace cobra;
+
+using chunked = chunked_istream<istream_buffer<test::trickle_istream>>;
+
+static chunked make_chunked(std::string data, std::size_t step, std::size_t buffer_size) {
+	return chunked(istream_buffer(test::trickle_istream(std::move(data), step), buffer_size));
+}
+
+// Reads through fill_buf and consume, one span at a time
+static std::string read_spans(chunked& stream) {
+	std::string result;
+
+	while (true) {
+		auto [data, size] = block_task(stream.fill_buf());
+
+		if (size == 0) {
+			return result;
+		}
+
+		result.append(data, size);
+		stream.consume(size);
+	}
+}
+
+static std::string read_all(chunked& stream, std::size_t size) {
+	std::string result;
+	std::string buffer(size, '\0');
+
+	while (std::size_t count = block_task(stream.read(buffer.data(), size))) {
+		result.append(buffer.data(), count);
+	}
+
+	return result;
+}
+
+static void check(const std::string& data, const std::string& expected) {
+	for (std::size_t step : {std::size_t(1), std::size_t(2), std::size_t(3), std::size_t(5), data.size()}) {
+		for (std::size_t buffer_size : {1, 2, 3, 7, 64}) {
+			chunked spans = make_chunked(data, step, buffer_size);
+			assert(read_spans(spans) == expected);
+			block_task(std::move(spans).end());
+
+			chunked reads = make_chunked(data, step, buffer_size);
+			assert(read_all(reads, 4) == expected);
+			block_task(std::move(reads).end());
+		}
+	}
+}
+
+static void check_throws(const std::string& data) {
+	for (std::size_t step : {std::size_t(1), std::size_t(5), data.size()}) {
+		chunked stream = make_chunked(data, step, 16);
+		ASSERT_THROW(read_spans(stream), http_parse_error);
+	}
+}
+
+int main() {
+	check("0\r\n\r\n", "");
+	check("5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n", "hello world");
+	check("a\r\n0123456789\r\nA\r\nabcdefghij\r\n0\r\n\r\n", "0123456789abcdefghij");
+
+	// Extensions are skipped, with or without whitespace in front of them
+	check("5;name=value;flag\r\nhello\r\n0;last=\"yes\"\r\n\r\n", "hello");
+	check("5 ; name=value\r\nhello\r\n0\t;x\r\n\r\n", "hello");
+
+	// Trailers come out of the regular header parser
+	for (std::size_t step = 1; step <= 8; step++) {
+		chunked stream = make_chunked("3\r\nabc\r\n0\r\nX-Checksum: 42\r\nX-Other: a b\r\n\r\n", step, 3);
+		assert(read_spans(stream) == "abc");
+		assert(stream.trailers().at("X-Checksum") == "42");
+		assert(stream.trailers().at("X-Other") == "a b");
+		block_task(std::move(stream).end());
+	}
+
+	{
+		chunked stream = make_chunked("3\r\nabc\r\n0\r\n\r\n", 2, 4);
+		assert(read_spans(stream) == "abc");
+		assert(!stream.trailers().contains("X-Checksum"));
+	}
+
+	// Sizes are limited in digits, leading zeros included
+	check(std::string(http_chunk_size_max_length - 1, '0') + "1\r\nx\r\n0\r\n\r\n", "x");
+	check_throws(std::string(http_chunk_size_max_length, '0') + "1\r\nx\r\n0\r\n\r\n");
+
+	const std::string extension(http_chunk_extension_max_length - 1, 'e');
+	check("1;" + extension + "\r\nx\r\n0\r\n\r\n", "x");
+	check_throws("1;" + extension + "ee\r\nx\r\n0\r\n\r\n");
+
+	check_throws("\r\n");
+	check_throws(";x\r\nhello\r\n0\r\n\r\n");
+	check_throws("g\r\n");
+	check_throws("5\nhello\r\n0\r\n\r\n");
+	check_throws("5\r\nhelloX\r\n0\r\n\r\n");
+	check_throws("5\r\nhello\r0\r\n\r\n");
+	check_throws("1;a\x01\r\nx\r\n0\r\n\r\n");
+	check_throws("5\r\nhello\r\n");
+
+	{
+		chunked stream = make_chunked("5\r\nhel", 2, 4);
+		assert(read_spans(stream) == "hel");
+		ASSERT_THROW(block_task(std::move(stream).end()), stream_error);
+	}
+}
@@ -0,0 +1,116 @@
+#include "cobra/asyncio/future_task.hh"
+#include "cobra/http/compress_cache.hh"
+#include "util/assert.hh"
+#include <cassert>
+#include <stdexcept>
+#include <string>
+
+using namespace cobra;
+
+static compress_cache_key make_key(const std::string& path) {
+	return {path, 1, 2, 3, deflate_mode::gzip, 6};
+}
+
+int main() {
+	sequential_executor exec;
+	int calls = 0;
+
+	// Populates until the test unlocks the gate, so other callers can pile up
+	async_mutex gate(&exec);
+	auto gated = [&]() -> task<std::string> {
+		calls += 1;
+		async_lock lock = co_await async_lock::lock(gate);
+		co_return "gated";
+	};
+	auto gated_error = [&]() -> task<std::string> {
+		calls += 1;
+		async_lock lock = co_await async_lock::lock(gate);
+		throw std::runtime_error("populate failed");
+	};
+	auto immediate = [&]() -> task<std::string> {
+		calls += 1;
+		co_return "data";
+	};
+
+	// Concurrent misses for one key populate it once
+	{
+		compress_cache cache(1024);
+
+		assert(gate.try_lock());
+		auto a = make_future_task(cache.get(make_key("a"), &exec, gated));
+		auto b = make_future_task(cache.get(make_key("a"), &exec, gated));
+		auto c = make_future_task(cache.get(make_key("a"), &exec, gated));
+		assert(calls == 1);
+		gate.unlock();
+
+		compress_cache::value_type value = a.get_future().get();
+		assert(value && *value == "gated");
+		assert(b.get_future().get() == value);
+		assert(c.get_future().get() == value);
+		assert(block_task(cache.get(make_key("a"), &exec, immediate)) == value);
+		assert(calls == 1);
+	}
+
+	// The owner gets the error, waiters get nothing and the next miss retries
+	{
+		compress_cache cache(1024);
+
+		calls = 0;
+		assert(gate.try_lock());
+		auto a = make_future_task(cache.get(make_key("a"), &exec, gated_error));
+		auto b = make_future_task(cache.get(make_key("a"), &exec, gated_error));
+		gate.unlock();
+
+		ASSERT_THROW(a.get_future().get(), std::runtime_error);
+		assert(b.get_future().get() == nullptr);
+		assert(calls == 1);
+
+		compress_cache::value_type value = block_task(cache.get(make_key("a"), &exec, immediate));
+		assert(value && *value == "data");
+		assert(calls == 2);
+	}
+
+	// Entries are evicted in least recently used order once over capacity
+	{
+		compress_cache cache(10);
+
+		calls = 0;
+		block_task(cache.get(make_key("a"), &exec, immediate));
+		block_task(cache.get(make_key("b"), &exec, immediate));
+		block_task(cache.get(make_key("a"), &exec, immediate));
+		assert(calls == 2);
+
+		block_task(cache.get(make_key("c"), &exec, immediate));
+		assert(calls == 3);
+
+		block_task(cache.get(make_key("a"), &exec, immediate));
+		block_task(cache.get(make_key("c"), &exec, immediate));
+		assert(calls == 3);
+
+		block_task(cache.get(make_key("b"), &exec, immediate));
+		assert(calls == 4);
+	}
+
+	// Keys differ in more than their path
+	{
+		compress_cache cache(1024);
+		compress_cache_key zlib = make_key("a");
+
+		calls = 0;
+		zlib.mode = deflate_mode::zlib;
+		block_task(cache.get(make_key("a"), &exec, immediate));
+		block_task(cache.get(zlib, &exec, immediate));
+		assert(calls == 2);
+	}
+
+	// Entries larger than the whole cache are still handed out
+	{
+		compress_cache cache(2);
+
+		calls = 0;
+		compress_cache::value_type value = block_task(cache.get(make_key("a"), &exec, immediate));
+		assert(value && *value == "data");
+		block_task(cache.get(make_key("a"), &exec, immediate));
+		assert(calls == 2);
+	}
+}
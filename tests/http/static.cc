@@ -0,0 +1,130 @@
+#include "cobra/asyncio/event_loop.hh"
+#include "cobra/asyncio/future_task.hh"
+#include "cobra/asyncio/std_stream.hh"
+#include "cobra/asyncio/stream_buffer.hh"
+#include "cobra/http/handler.hh"
+#include "cobra/http/parse.hh"
+#include <cassert>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+
+using namespace cobra;
+
+// Polls until the task is done, work on the compress executor resumes on this thread through the loop
+template <class T>
+static T run(event_loop* loop, task<T> task) {
+	if (!loop) {
+		return block_task(std::move(task));
+	}
+
+	future_task<T> job = make_future_task(std::move(task));
+	std::future<T> future = job.get_future();
+
+	while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+		loop->poll();
+	}
+
+	return future.get();
+}
+
+// Serves one file and returns the head of the response
+static std::string serve(const std::string& root, const std::string& file,
+						 const std::unordered_set<std::string>& compress_types, executor* compress_exec = nullptr,
+						 event_loop* loop = nullptr) {
+	sequential_executor exec;
+	http_request request("GET", parse_uri(file, "GET"));
+	request.set_header("Accept-Encoding", "gzip");
+
+	std::string empty;
+	istream_buffer body(std_istream<std::istringstream>(std::istringstream(empty)), 16);
+	ostream_buffer output(std_ostream<std::ostringstream>(std::ostringstream()), 4096);
+	http_ostream_wrapper wrapper(output);
+
+	http_response_writer writer(&request, &wrapper);
+	writer.set_compress_types(&compress_types);
+
+	if (compress_exec) {
+		writer.set_compress_executor(compress_exec, loop->post_executor());
+	}
+
+	static_config config(false);
+	handle_context<static_config> context(nullptr, &exec, root, file, config, request, body);
+	assert(run(loop, handle_static(std::move(writer), context, std::nullopt)));
+	block_task(wrapper.end());
+	block_task(output.flush());
+
+	const std::string response = output.inner().inner().str();
+	return response.substr(0, response.find("\r\n\r\n"));
+}
+
+int main() {
+	const std::filesystem::path root = std::filesystem::temp_directory_path() / "cobra_test_static";
+	std::filesystem::create_directories(root);
+
+	std::string text;
+
+	for (int i = 0; i < 200; i++) {
+		text += "<p>some text that compresses well</p>\n";
+	}
+
+	std::ofstream(root / "index.html") << text;
+	std::ofstream(root / "data.json") << "{\"text\": \"" << text.substr(0, 2000) << "\"}";
+	std::ofstream(root / "image.png") << text;
+	std::ofstream(root / "notes") << text;
+	std::ofstream(root / "pooled.html") << text;
+	std::ofstream(root / "marked.html") << text;
+	std::ofstream(root / "marked.html.gz");
+
+	// Mime types in the allowlist match static files by their extension
+	{
+		const std::unordered_set<std::string> types = {"text/*", "application/json"};
+		const std::string html = serve(root, "/index.html", types);
+		assert(html.find("Content-Type: text/html") != std::string::npos);
+		assert(html.find("Content-Encoding: gzip") != std::string::npos);
+
+		const std::string json = serve(root, "/data.json", types);
+		assert(json.find("Content-Type: application/json") != std::string::npos);
+		assert(json.find("Content-Encoding: gzip") != std::string::npos);
+
+		const std::string png = serve(root, "/image.png", types);
+		assert(png.find("Content-Type: image/png") != std::string::npos);
+		assert(png.find("Content-Encoding") == std::string::npos);
+
+		const std::string unknown = serve(root, "/notes", types);
+		assert(unknown.find("Content-Type") == std::string::npos);
+		assert(unknown.find("Content-Encoding") == std::string::npos);
+	}
+
+	// Without an allowlist the well known compressed formats are still left alone
+	{
+		const std::unordered_set<std::string> types;
+		assert(serve(root, "/index.html", types).find("Content-Encoding: gzip") != std::string::npos);
+		assert(serve(root, "/image.png", types).find("Content-Encoding") == std::string::npos);
+	}
+
+	// An empty sidecar marks a file that precompressing did not shrink, it is never served
+	{
+		const std::unordered_set<std::string> types;
+		const std::string marked = serve(root, "/marked.html", types);
+		assert(marked.find("Content-Encoding: gzip") != std::string::npos);
+		assert(marked.find("Content-Length: 0\r") == std::string::npos && !marked.ends_with("Content-Length: 0"));
+	}
+
+	// Cache misses are compressed on the compress executor
+	{
+		thread_pool_executor pool(1);
+		sequential_executor loop_exec;
+		platform_event_loop loop(loop_exec);
+		const std::unordered_set<std::string> types;
+
+		assert(serve(root, "/pooled.html", types, &pool, &loop).find("Content-Encoding: gzip") != std::string::npos);
+		assert(serve(root, "/pooled.html", types, &pool, &loop).find("Content-Encoding: gzip") != std::string::npos);
+	}
+
+	std::filesystem::remove_all(root);
+}
@@ -0,0 +1,30 @@
+#ifndef COBRA_TEST_TRICKLE
+#define COBRA_TEST_TRICKLE
+
+#include "cobra/asyncio/stream.hh"
+#include "cobra/asyncio/task.hh"
+#include <algorithm>
+#include <string>
+
+namespace test {
+
+	// Hands out a string at most step bytes per read, so a buffer on top of
+	// it sees the data split up across many spans.
+	class trickle_istream : public cobra::istream_impl<trickle_istream> {
+		std::string _data;
+		std::size_t _step;
+		std::size_t _offset = 0;
+
+	public:
+		trickle_istream(std::string data, std::size_t step) : _data(std::move(data)), _step(step) {}
+
+		cobra::task<std::size_t> read(char* dst, std::size_t count) {
+			count = std::min({count, _step, _data.size() - _offset});
+			std::copy(_data.data() + _offset, _data.data() + _offset + count, dst);
+			_offset += count;
+			co_return count;
+		}
+	};
+}
+
+#endif